@@ -0,0 +1,76 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+
+#include "archivepolicy.h"
+
+#include <MCLog.hpp>
+
+#include <math.h>
+
+ArchivePolicy::ArchivePolicy(float margin_threshold) : MarginThreshold(margin_threshold)
+{
+}
+
+
+bool ArchivePolicy::IsFullQuality(int label, const float* probabilities)
+{
+  const int PreviousLabel = LastLabel;
+
+  LastLabel = label;
+  // Invalid and unlabeled frames
+  if (probabilities == nullptr || (label != 0 && label != 1))
+    return true;
+
+  return label != PreviousLabel || fabs(probabilities[0]-probabilities[1]) < MarginThreshold;
+}
+
+
+void ArchivePolicy::AddWritten(bool full_quality, int bytes)
+{
+  if (full_quality)
+  {
+    FullCount++;
+    FullBytes += bytes;
+  } else {
+    ThumbnailCount++;
+    ThumbnailBytes += bytes;
+  }
+}
+
+
+void ArchivePolicy::LogNight()
+{
+  if (FullCount > 0)
+  {
+    // The thumbnails are estimated with the average full quality frame
+    const long long Written = FullBytes+ThumbnailBytes;
+    const long long AllFull = FullBytes+FullBytes*ThumbnailCount / FullCount;
+
+    MC_LOG("Archive policy: %d full quality, %d thumbnails, %lld bytes written instead of %lld (%1.1f %%)", FullCount,
+           ThumbnailCount, Written, AllFull, (float)Written / AllFull*100);
+  }
+  LastLabel = -1;
+  FullCount = 0;
+  ThumbnailCount = 0;
+  FullBytes = 0;
+  ThumbnailBytes = 0;
+}
@@ -0,0 +1,45 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+
+#pragma once
+
+// Quality of the archived night frames: the uncertain classifications (small
+// softmax margin) and the label changes are archived in full quality, the
+// confident frames as thumbnails in the input size of the model.
+class ArchivePolicy
+{
+public:
+  explicit ArchivePolicy(float margin_threshold = 0.5);
+
+  bool IsFullQuality(int label, const float* probabilities);
+  void AddWritten(bool full_quality, int bytes);
+  // Bytes of the night against the full quality of every frame, the counters are reset
+  void LogNight();
+
+protected:
+  float MarginThreshold { 0.5 };
+  int LastLabel { -1 };
+  int FullCount { 0 };
+  int ThumbnailCount { 0 };
+  long long FullBytes { 0 };
+  long long ThumbnailBytes { 0 };
+};
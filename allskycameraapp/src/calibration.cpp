@@ -0,0 +1,509 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "calibration.h"
+#include "simd.h"
+
+#include <MEImage.hpp>
+
+#include <MCLog.hpp>
+
+#include <QDir>
+#include <QFile>
+
+#include <algorithm>
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+namespace
+{
+const char CalibrationMagic[4] = { 'A', 'S', 'C', 'F' };
+const int CalibrationVersion = 1;
+// Fixed-point shift of the flat gains (Q4.12)
+const int GainShift = 12;
+// Masters are large, keep only the exposures of the last few hours in memory
+const size_t MaxCachedDarks = 8;
+
+#pragma pack(push, 1)
+struct CalibrationHeader
+{
+  char Magic[4];
+  uint16_t Version;
+  uint16_t Type;
+  uint16_t Width;
+  uint16_t Height;
+  uint16_t Layers;
+  uint16_t Reserved;
+  int32_t ShutterTime;
+  int32_t Iso;
+  int32_t FrameCount;
+  int32_t HotPixelCount;
+};
+#pragma pack(pop)
+
+
+void SubtractDark(unsigned char* data, const unsigned char* offsets, int size)
+{
+  int i = 0;
+
+#if defined(ASC_NEON)
+  for (; i+SimdWidth <= size; i += SimdWidth)
+  {
+    vst1q_u8(data+i, vqsubq_u8(vld1q_u8(data+i), vld1q_u8(offsets+i)));
+  }
+#elif defined(ASC_SSE2)
+  for (; i+SimdWidth <= size; i += SimdWidth)
+  {
+    __m128i Samples = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data+i));
+    __m128i Offsets = _mm_loadu_si128(reinterpret_cast<const __m128i*>(offsets+i));
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(data+i), _mm_subs_epu8(Samples, Offsets));
+  }
+#endif
+  for (; i < size; ++i)
+  {
+    data[i] = data[i] > offsets[i] ? data[i]-offsets[i] : 0;
+  }
+}
+
+
+void CalibrateSamples(unsigned char* data, const unsigned char* offsets, const unsigned short* gains, int size)
+{
+  int i = 0;
+
+#if defined(ASC_NEON)
+  for (; i+SimdWidth <= size; i += SimdWidth)
+  {
+    uint8x16_t Diff = vqsubq_u8(vld1q_u8(data+i), vld1q_u8(offsets+i));
+    uint16x8_t Low = vmovl_u8(vget_low_u8(Diff));
+    uint16x8_t High = vmovl_u8(vget_high_u8(Diff));
+    uint16x8_t GainLow = vld1q_u16(gains+i);
+    uint16x8_t GainHigh = vld1q_u16(gains+i+8);
+    uint16x8_t ResultLow = vcombine_u16(vqshrn_n_u32(vmull_u16(vget_low_u16(Low), vget_low_u16(GainLow)), GainShift),
+                                        vqshrn_n_u32(vmull_u16(vget_high_u16(Low), vget_high_u16(GainLow)), GainShift));
+    uint16x8_t ResultHigh = vcombine_u16(vqshrn_n_u32(vmull_u16(vget_low_u16(High), vget_low_u16(GainHigh)), GainShift),
+                                         vqshrn_n_u32(vmull_u16(vget_high_u16(High), vget_high_u16(GainHigh)), GainShift));
+
+    vst1q_u8(data+i, vcombine_u8(vqmovn_u16(ResultLow), vqmovn_u16(ResultHigh)));
+  }
+#elif defined(ASC_SSE2)
+  const __m128i Zero = _mm_setzero_si128();
+
+  for (; i+SimdWidth <= size; i += SimdWidth)
+  {
+    __m128i Samples = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data+i));
+    __m128i Offsets = _mm_loadu_si128(reinterpret_cast<const __m128i*>(offsets+i));
+    __m128i Diff = _mm_subs_epu8(Samples, Offsets);
+    // (x << 4)*gain >> 16 == x*gain >> 12 with the unsigned high multiply
+    __m128i Low = _mm_slli_epi16(_mm_unpacklo_epi8(Diff, Zero), 16-GainShift);
+    __m128i High = _mm_slli_epi16(_mm_unpackhi_epi8(Diff, Zero), 16-GainShift);
+    __m128i GainLow = _mm_loadu_si128(reinterpret_cast<const __m128i*>(gains+i));
+    __m128i GainHigh = _mm_loadu_si128(reinterpret_cast<const __m128i*>(gains+i+8));
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(data+i),
+                     _mm_packus_epi16(_mm_mulhi_epu16(Low, GainLow), _mm_mulhi_epu16(High, GainHigh)));
+  }
+#endif
+  for (; i < size; ++i)
+  {
+    int Value = data[i] > offsets[i] ? data[i]-offsets[i] : 0;
+
+    Value = (Value*gains[i]) >> GainShift;
+    data[i] = Value > 255 ? 255 : (unsigned char)Value;
+  }
+}
+
+
+void RepairHotPixels(unsigned char* data, const std::vector<int>& hot_pixels, int width, int layers)
+{
+  const int RowSize = width*layers;
+
+  for (int index : hot_pixels)
+  {
+    const int X = (index % RowSize) / layers;
+
+    // Average of the horizontal neighbours in the same channel
+    if (X == 0)
+      data[index] = data[index+layers];
+    else
+    if (X == width-1)
+      data[index] = data[index-layers];
+    else
+      data[index] = (unsigned char)(((int)data[index-layers]+(int)data[index+layers]) / 2);
+  }
+}
+
+
+int LoadFrames(const QStringList& files, std::vector<uint32_t>& sums, int& width, int& height, int& layers)
+{
+  int Count = 0;
+
+  for (auto filename : files)
+  {
+    MEImage Frame;
+
+    Frame.LoadFromFile(filename.toStdString());
+    if (Count == 0)
+    {
+      width = Frame.GetWidth();
+      height = Frame.GetHeight();
+      layers = Frame.GetLayerCount();
+      sums.assign(Frame.GetImageDataSize(), 0);
+    }
+    if (Frame.GetWidth() != width || Frame.GetHeight() != height || Frame.GetLayerCount() != layers)
+    {
+      MC_WARNING("Skip calibration frame with different size: %s", qPrintable(filename));
+      continue;
+    }
+    const unsigned char* Data = reinterpret_cast<unsigned char*>(Frame.GetIplImage()->imageData);
+
+    for (size_t i = 0; i < sums.size(); ++i)
+    {
+      sums[i] += Data[i];
+    }
+    Count++;
+  }
+  return Count;
+}
+}
+
+
+bool CalibrationFrame::Load(const QString& filename, bool header_only)
+{
+  QFile CurrentFile(filename);
+  CalibrationHeader Header;
+
+  if (!CurrentFile.open(QIODevice::ReadOnly))
+    return false;
+
+  if (CurrentFile.read(reinterpret_cast<char*>(&Header), sizeof(Header)) != sizeof(Header) ||
+      memcmp(Header.Magic, CalibrationMagic, sizeof(CalibrationMagic)) != 0 || Header.Version != CalibrationVersion)
+  {
+    MC_WARNING("Invalid calibration file: %s", qPrintable(filename));
+    return false;
+  }
+  FileName = filename;
+  Type = Header.Type;
+  Width = Header.Width;
+  Height = Header.Height;
+  Layers = Header.Layers;
+  ShutterTime = Header.ShutterTime;
+  Iso = Header.Iso;
+  FrameCount = Header.FrameCount;
+  if (header_only)
+    return true;
+
+  const int64_t HotPixelBytes = (int64_t)Header.HotPixelCount*sizeof(int32_t);
+  const int64_t DataBytes = (int64_t)GetDataSize()*(Type == Dark ? sizeof(unsigned char) : sizeof(unsigned short));
+
+  // The hot pixel list must fit in the file after the samples
+  if (Header.HotPixelCount < 0 || HotPixelBytes > CurrentFile.size()-(int64_t)sizeof(Header)-DataBytes)
+  {
+    MC_WARNING("Invalid hot pixel count in calibration file: %s", qPrintable(filename));
+    return false;
+  }
+  bool Success = true;
+
+  HotPixels.resize(Header.HotPixelCount);
+  if (Type == Dark)
+  {
+    Offsets.resize(GetDataSize());
+    Success = CurrentFile.read(reinterpret_cast<char*>(Offsets.data()), DataBytes) == DataBytes;
+  } else {
+    Gains.resize(GetDataSize());
+    Success = CurrentFile.read(reinterpret_cast<char*>(Gains.data()), DataBytes) == DataBytes;
+  }
+  if (Success && HotPixelBytes > 0)
+    Success = CurrentFile.read(reinterpret_cast<char*>(HotPixels.data()), HotPixelBytes) == HotPixelBytes;
+
+  if (!Success)
+  {
+    MC_WARNING("Truncated calibration file: %s", qPrintable(filename));
+    return false;
+  }
+  // RepairHotPixels writes at the indices without further checks
+  for (int index : HotPixels)
+  {
+    if (index < 0 || index >= GetDataSize())
+    {
+      MC_WARNING("Invalid hot pixel index %d in calibration file: %s", index, qPrintable(filename));
+      return false;
+    }
+  }
+  return true;
+}
+
+
+bool CalibrationFrame::Save(const QString& filename) const
+{
+  QFile CurrentFile(filename);
+  CalibrationHeader Header;
+
+  memcpy(Header.Magic, CalibrationMagic, sizeof(CalibrationMagic));
+  Header.Version = CalibrationVersion;
+  Header.Type = Type;
+  Header.Width = Width;
+  Header.Height = Height;
+  Header.Layers = Layers;
+  Header.Reserved = 0;
+  Header.ShutterTime = ShutterTime;
+  Header.Iso = Iso;
+  Header.FrameCount = FrameCount;
+  Header.HotPixelCount = (int32_t)HotPixels.size();
+  if (!CurrentFile.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    return false;
+
+  CurrentFile.write(reinterpret_cast<const char*>(&Header), sizeof(Header));
+  if (Type == Dark)
+    CurrentFile.write(reinterpret_cast<const char*>(Offsets.data()), Offsets.size());
+  else
+    CurrentFile.write(reinterpret_cast<const char*>(Gains.data()), Gains.size()*sizeof(unsigned short));
+
+  CurrentFile.write(reinterpret_cast<const char*>(HotPixels.data()), HotPixels.size()*sizeof(int32_t));
+  return CurrentFile.flush();
+}
+
+
+bool Calibration::Open(const QString& path)
+{
+  if (!QDir().mkpath(path))
+  {
+    MC_WARNING("Unable to create calibration directory: %s", qPrintable(path));
+    return false;
+  }
+  Path = path+'/';
+  DarkHeaders.clear();
+  DarkCache.clear();
+  FlatFrame.reset();
+
+  QStringList Filenames = QDir(path).entryList(QStringList() << "dark_*.bin", QDir::Files | QDir::NoDotAndDotDot, QDir::Name);
+
+  for (auto filename : Filenames)
+  {
+    std::shared_ptr<CalibrationFrame> Frame(new CalibrationFrame());
+
+    if (Frame->Load(Path+filename, true) && Frame->Type == CalibrationFrame::Dark)
+      DarkHeaders.push_back(Frame);
+  }
+  if (QFile(Path+"flat.bin").exists())
+  {
+    FlatFrame.reset(new CalibrationFrame());
+    if (!FlatFrame->Load(Path+"flat.bin") || FlatFrame->Type != CalibrationFrame::Flat)
+      FlatFrame.reset();
+  }
+  MC_LOG("Calibration: %d master dark frame(s), flat field %s", (int)DarkHeaders.size(),
+         FlatFrame.get() ? "loaded" : "missing");
+  return true;
+}
+
+
+bool Calibration::BuildDark(const QStringList& files, int shutter_time, int iso)
+{
+  std::vector<uint32_t> Sums;
+  CalibrationFrame Frame;
+
+  if (!IsOpen())
+    return false;
+
+  Frame.FrameCount = LoadFrames(files, Sums, Frame.Width, Frame.Height, Frame.Layers);
+  if (Frame.FrameCount == 0)
+    return false;
+
+  Frame.Type = CalibrationFrame::Dark;
+  Frame.ShutterTime = shutter_time;
+  Frame.Iso = iso;
+  Frame.Offsets.resize(Sums.size());
+
+  uint64_t Total = 0;
+
+  for (size_t i = 0; i < Sums.size(); ++i)
+  {
+    Frame.Offsets[i] = (unsigned char)((Sums[i]+Frame.FrameCount / 2) / Frame.FrameCount);
+    Total += Frame.Offsets[i];
+  }
+  const int HotLimit = (int)(Total / Sums.size())+HotPixelLevel;
+
+  for (size_t i = 0; i < Frame.Offsets.size(); ++i)
+  {
+    if (Frame.Offsets[i] > HotLimit)
+      Frame.HotPixels.push_back((int)i);
+  }
+  const QString FileName = QString("%1dark_%2_%3.bin").arg(Path).arg(GetShutterBucket(shutter_time)).arg(iso);
+
+  if (!Frame.Save(FileName))
+  {
+    MC_WARNING("Unable to save master dark frame: %s", qPrintable(FileName));
+    return false;
+  }
+  MC_LOG("Master dark frame saved: %s (%d frames, %d hot pixels)", qPrintable(FileName), Frame.FrameCount,
+         (int)Frame.HotPixels.size());
+  return Open(Path);
+}
+
+
+bool Calibration::BuildFlat(const QStringList& files)
+{
+  std::vector<uint32_t> Sums;
+  CalibrationFrame Frame;
+
+  if (!IsOpen())
+    return false;
+
+  Frame.FrameCount = LoadFrames(files, Sums, Frame.Width, Frame.Height, Frame.Layers);
+  if (Frame.FrameCount == 0)
+    return false;
+
+  Frame.Type = CalibrationFrame::Flat;
+  Frame.Gains.resize(Sums.size());
+
+  // Normalize every channel separately to keep the colour balance
+  std::vector<uint64_t> ChannelSums(Frame.Layers, 0);
+
+  for (size_t i = 0; i < Sums.size(); ++i)
+  {
+    ChannelSums[i % Frame.Layers] += Sums[i];
+  }
+  const int PixelCount = Frame.Width*Frame.Height;
+
+  for (size_t i = 0; i < Sums.size(); ++i)
+  {
+    const double ChannelMean = (double)ChannelSums[i % Frame.Layers] / PixelCount;
+    const double Gain = Sums[i] > 0 ? ChannelMean / Sums[i] : 1.0;
+
+    Frame.Gains[i] = (unsigned short)std::min(65535.0, Gain*(1 << GainShift)+0.5);
+  }
+  if (!Frame.Save(Path+"flat.bin"))
+  {
+    MC_WARNING("Unable to save flat field: %sflat.bin", qPrintable(Path));
+    return false;
+  }
+  MC_LOG("Flat field saved: %sflat.bin (%d frames)", qPrintable(Path), Frame.FrameCount);
+  return Open(Path);
+}
+
+
+bool Calibration::Apply(MEImage& image, int shutter_time, int iso)
+{
+  std::shared_ptr<CalibrationFrame> DarkFrame = SelectDark(shutter_time, iso);
+  const int DataSize = image.GetImageDataSize();
+
+  if (DarkFrame.get() && (DarkFrame->Width != image.GetWidth() || DarkFrame->Height != image.GetHeight() ||
+      DarkFrame->Layers != image.GetLayerCount()))
+  {
+    DarkFrame.reset();
+  }
+  const bool UseFlat = FlatFrame.get() && FlatFrame->GetDataSize() == DataSize && FlatFrame->Width == image.GetWidth();
+
+  if (!DarkFrame.get() && !UseFlat)
+    return false;
+
+  unsigned char* Data = reinterpret_cast<unsigned char*>(image.GetIplImage()->imageData);
+
+  if (UseFlat)
+  {
+    if (!DarkFrame.get() && (int)ZeroOffsets.size() != DataSize)
+      ZeroOffsets.assign(DataSize, 0);
+
+    CalibrateSamples(Data, DarkFrame.get() ? DarkFrame->Offsets.data() : ZeroOffsets.data(), FlatFrame->Gains.data(),
+                     DataSize);
+  } else {
+    SubtractDark(Data, DarkFrame->Offsets.data(), DataSize);
+  }
+  if (DarkFrame.get())
+    RepairHotPixels(Data, DarkFrame->HotPixels, image.GetWidth(), image.GetLayerCount());
+
+  return true;
+}
+
+
+int Calibration::GetShutterBucket(int shutter_time)
+{
+  return (int)lround(2*log2((double)std::max(shutter_time, 1)));
+}
+
+
+std::shared_ptr<CalibrationFrame> Calibration::SelectDark(int shutter_time, int iso)
+{
+  const int Bucket = GetShutterBucket(shutter_time);
+  const std::pair<int, int> Key(Bucket, iso);
+  auto Cached = DarkCache.find(Key);
+
+  if (Cached != DarkCache.end())
+  {
+    Cached->second.LastUse = ++DarkUseCount;
+    return Cached->second.Frame;
+  }
+
+  // Nearest master in exposure with the same ISO
+  std::shared_ptr<CalibrationFrame> Header;
+  double BestDistance = 0;
+
+  for (auto& dark : DarkHeaders)
+  {
+    if (dark->Iso != iso)
+      continue;
+
+    const double Distance = fabs(log2((double)std::max(dark->ShutterTime, 1) / std::max(shutter_time, 1)));
+
+    if (!Header.get() || Distance < BestDistance)
+    {
+      Header = dark;
+      BestDistance = Distance;
+    }
+  }
+  std::shared_ptr<CalibrationFrame> Frame;
+
+  if (Header.get())
+  {
+    Frame.reset(new CalibrationFrame());
+    if (!Frame->Load(Header->FileName))
+    {
+      Frame.reset();
+    } else {
+      // The dark current grows linearly with the exposure, scale the master to the bucket
+      const double Ratio = pow(2.0, Bucket / 2.0) / std::max(Frame->ShutterTime, 1);
+
+      if (fabs(Ratio-1.0) > 0.05)
+      {
+        for (auto& offset : Frame->Offsets)
+        {
+          offset = (unsigned char)std::min(255.0, offset*Ratio+0.5);
+        }
+      }
+    }
+  }
+  // Evict the least recently used master
+  if (DarkCache.size() >= MaxCachedDarks)
+  {
+    auto Oldest = DarkCache.begin();
+
+    for (auto cached = DarkCache.begin(); cached != DarkCache.end(); ++cached)
+    {
+      if (cached->second.LastUse < Oldest->second.LastUse)
+        Oldest = cached;
+    }
+    DarkCache.erase(Oldest);
+  }
+  DarkCache[Key] = { Frame, ++DarkUseCount };
+  return Frame;
+}
@@ -0,0 +1,101 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <QString>
+#include <QStringList>
+
+#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <stdint.h>
+
+class MEImage;
+
+// Master dark or flat frame in the binary calibration format
+class CalibrationFrame
+{
+public:
+  enum FrameType
+  {
+    Dark = 0,
+    Flat = 1
+  };
+
+  CalibrationFrame() = default;
+
+  bool Load(const QString& filename, bool header_only = false);
+  bool Save(const QString& filename) const;
+  int GetDataSize() const { return Width*Height*Layers; }
+
+  QString FileName;
+  int Type { Dark };
+  int Width { 0 };
+  int Height { 0 };
+  int Layers { 0 };
+  int ShutterTime { 0 };
+  int Iso { 0 };
+  int FrameCount { 0 };
+  // Dark frame: 8 bit offsets per sample
+  std::vector<unsigned char> Offsets;
+  // Flat frame: Q4.12 fixed-point gains per sample
+  std::vector<unsigned short> Gains;
+  // Sample indices of the hot pixels found in the dark frame
+  std::vector<int> HotPixels;
+};
+
+class Calibration
+{
+public:
+  Calibration() = default;
+
+  bool Open(const QString& path);
+  bool IsOpen() const { return !Path.isEmpty(); }
+  bool BuildDark(const QStringList& files, int shutter_time, int iso);
+  bool BuildFlat(const QStringList& files);
+  bool Apply(MEImage& image, int shutter_time, int iso);
+
+  // Half-stop exposure bucket of a shutter time in microseconds
+  static int GetShutterBucket(int shutter_time);
+
+  // Hot pixel limit above the average dark level
+  int HotPixelLevel { 40 };
+
+protected:
+  struct CachedDark
+  {
+    std::shared_ptr<CalibrationFrame> Frame;
+    // Value of DarkUseCount at the last lookup
+    uint64_t LastUse;
+  };
+
+  std::shared_ptr<CalibrationFrame> SelectDark(int shutter_time, int iso);
+
+  QString Path;
+  std::vector<std::shared_ptr<CalibrationFrame>> DarkHeaders;
+  std::map<std::pair<int, int>, CachedDark> DarkCache;
+  uint64_t DarkUseCount { 0 };
+  std::shared_ptr<CalibrationFrame> FlatFrame;
+  std::vector<unsigned char> ZeroOffsets;
+};
@@ -0,0 +1,290 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "capturesource.h"
+#include "framering.h"
+
+#include <MEImage.hpp>
+
+#include <MCLog.hpp>
+
+#include <QDateTime>
+#include <QDir>
+#include <QProcess>
+
+#include <opencv2/imgcodecs.hpp>
+
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace
+{
+// The camera firmware pads the raw frames to 32 columns and 16 rows
+int AlignUp(int value, int alignment)
+{
+  return (value+alignment-1) / alignment*alignment;
+}
+
+
+CaptureError PublishFrame(FrameRing& ring, const unsigned char* data, int width, int height, int stride, int format,
+                          const CaptureSettings& settings)
+{
+  if (width*3*height > ring.GetSlotSize())
+  {
+    MC_WARNING("Frame does not fit into the frame ring (%dx%d)", width, height);
+    return CaptureInvalidFrame;
+  }
+  FrameHeader* Frame = ring.BeginWrite();
+  unsigned char* Target = ring.GetData(Frame);
+
+  for (int y = 0; y < height; ++y)
+  {
+    memcpy(Target+y*width*3, data+y*stride, width*3);
+  }
+  Frame->Timestamp = QDateTime::currentMSecsSinceEpoch();
+  Frame->Width = width;
+  Frame->Height = height;
+  Frame->Layers = 3;
+  Frame->Stride = width*3;
+  Frame->Format = format;
+  Frame->ShutterTime = settings.ShutterTime;
+  Frame->Iso = settings.Iso;
+  Frame->DataSize = width*3*height;
+  ring.EndWrite(Frame);
+  return CaptureOk;
+}
+}
+
+
+bool CaptureSettings::operator==(const CaptureSettings& other) const
+{
+  return ShutterTime == other.ShutterTime && Iso == other.Iso && Saturation == other.Saturation &&
+         Width == other.Width && Height == other.Height;
+}
+
+
+CaptureSource* CaptureSource::Create(const QString& source_str)
+{
+  if (source_str.isEmpty() || source_str == "raspistill")
+    return new RaspistillSource();
+
+  if (source_str == "stream")
+    return new StreamingCameraSource();
+
+  if (source_str.startsWith("files:"))
+    return new FileSequenceSource(source_str.mid(6));
+
+  MC_WARNING("Unknown capture source: %s", qPrintable(source_str));
+  return nullptr;
+}
+
+
+const char* CaptureSource::GetErrorString(CaptureError error)
+{
+  switch (error)
+  {
+    case CaptureOk:
+      return "no error";
+    case CaptureProcessFailed:
+      return "camera process failed";
+    case CaptureTimeout:
+      return "camera timeout";
+    case CaptureInvalidFrame:
+      return "invalid frame";
+    case CaptureNoFrames:
+      return "no frames";
+  }
+  return "unknown error";
+}
+
+
+int CaptureSource::GetFrameBufferSize(int width, int height)
+{
+  return AlignUp(width, 32)*3*AlignUp(height, 16);
+}
+
+
+CaptureError RaspistillSource::Capture(FrameRing& ring, const CaptureSettings& settings)
+{
+  QProcess Camera;
+  QStringList Arguments;
+
+  Arguments << "-awb" << "cloud" << "-ISO" << QString::number(settings.Iso) << "-sa" << QString::number(settings.Saturation) <<
+               "-n" << "-w" << QString::number(settings.Width) << "-h" << QString::number(settings.Height) <<
+               "-ss" << QString::number(settings.ShutterTime) << "-vf" << "-hf" << "-e" << "bmp" << "-o" << "-";
+  Camera.start("raspistill", Arguments);
+  if (!Camera.waitForStarted())
+    return CaptureProcessFailed;
+
+  // Long exposures take several times the shutter time in the firmware
+  if (!Camera.waitForFinished(settings.ShutterTime / 1000*8+30000))
+  {
+    Camera.kill();
+    Camera.waitForFinished();
+    return CaptureTimeout;
+  }
+  if (Camera.exitCode() != 0)
+    return CaptureProcessFailed;
+
+  // Uncompressed BMP, the decoding is a copy
+  QByteArray Output = Camera.readAllStandardOutput();
+  cv::Mat Image = cv::imdecode(cv::Mat(1, Output.size(), CV_8UC1, Output.data()), cv::IMREAD_COLOR);
+
+  if (Image.empty())
+    return CaptureInvalidFrame;
+
+  return PublishFrame(ring, Image.data, Image.cols, Image.rows, (int)Image.step, FrameHeader::Bgr, settings);
+}
+
+
+StreamingCameraSource::~StreamingCameraSource()
+{
+  Stop();
+}
+
+
+CaptureError StreamingCameraSource::Capture(FrameRing& ring, const CaptureSettings& settings)
+{
+  const int Stride = AlignUp(settings.Width, 32)*3;
+  const int FrameSize = GetFrameBufferSize(settings.Width, settings.Height);
+
+  if (FrameSize > ring.GetSlotSize())
+    return CaptureInvalidFrame;
+
+  // The camera process has to be restarted only for new exposure settings
+  if (!Camera.get() || Camera->state() != QProcess::Running || settings != CurrentSettings)
+  {
+    Stop();
+    if (!Start(settings))
+      return CaptureProcessFailed;
+  }
+  FrameHeader* Frame = ring.BeginWrite();
+
+  // Trigger one capture in signal mode, the pipe is read straight into the ring slot
+  kill((pid_t)Camera->processId(), SIGUSR1);
+  if (!ReadFrame(ring.GetData(Frame), FrameSize, settings.ShutterTime / 1000*8+10000))
+  {
+    MC_WARNING("Camera stream timeout, restart the camera");
+    Stop();
+    return CaptureTimeout;
+  }
+  Frame->Timestamp = QDateTime::currentMSecsSinceEpoch();
+  Frame->Width = settings.Width;
+  Frame->Height = settings.Height;
+  Frame->Layers = 3;
+  Frame->Stride = Stride;
+  Frame->Format = FrameHeader::Rgb;
+  Frame->ShutterTime = settings.ShutterTime;
+  Frame->Iso = settings.Iso;
+  Frame->DataSize = FrameSize;
+  ring.EndWrite(Frame);
+  return CaptureOk;
+}
+
+
+bool StreamingCameraSource::Start(const CaptureSettings& settings)
+{
+  QStringList Arguments;
+
+  Arguments << "-rgb" << "-s" << "-t" << "0" << "-n" << "-awb" << "cloud" << "-vf" << "-hf" <<
+               "-ISO" << QString::number(settings.Iso) << "-sa" << QString::number(settings.Saturation) <<
+               "-w" << QString::number(settings.Width) << "-h" << QString::number(settings.Height) <<
+               "-ss" << QString::number(settings.ShutterTime) << "-o" << "-";
+  Camera.reset(new QProcess());
+  Camera->start("raspiyuv", Arguments);
+  if (!Camera->waitForStarted())
+  {
+    MC_WARNING("Unable to start the camera process");
+    Camera.reset();
+    return false;
+  }
+  MC_LOG("Camera stream started (shutter: %d, ISO: %d)", settings.ShutterTime, settings.Iso);
+  CurrentSettings = settings;
+  // Let the sensor settle before the first signal
+  sleep(2);
+  return true;
+}
+
+
+void StreamingCameraSource::Stop()
+{
+  if (!Camera.get())
+    return;
+
+  Camera->terminate();
+  if (!Camera->waitForFinished(3000))
+    Camera->kill();
+
+  Camera.reset();
+}
+
+
+bool StreamingCameraSource::ReadFrame(unsigned char* buffer, int size, int timeout)
+{
+  const qint64 Deadline = QDateTime::currentMSecsSinceEpoch()+timeout;
+  int Received = 0;
+
+  while (Received < size)
+  {
+    const qint64 Remaining = Deadline-QDateTime::currentMSecsSinceEpoch();
+
+    if (Camera->bytesAvailable() == 0 && (Remaining <= 0 || !Camera->waitForReadyRead((int)Remaining)))
+      return false;
+
+    const qint64 Bytes = Camera->read(reinterpret_cast<char*>(buffer)+Received, size-Received);
+
+    if (Bytes < 0)
+      return false;
+
+    Received += (int)Bytes;
+  }
+  return true;
+}
+
+
+FileSequenceSource::FileSequenceSource(const QString& path) : Path(path)
+{
+  Files = QDir(path).entryList(QStringList() << "*.png" << "*.jpg" << "*.jpeg", QDir::Files | QDir::NoDotAndDotDot,
+                               QDir::Name);
+  MC_LOG("Replay %d images from %s", Files.size(), qPrintable(path));
+}
+
+
+CaptureError FileSequenceSource::Capture(FrameRing& ring, const CaptureSettings& settings)
+{
+  if (Files.isEmpty())
+    return CaptureNoFrames;
+
+  MEImage Image;
+
+  // Start again at the end of the sequence
+  Image.LoadFromFile((Path+'/'+Files[Next]).toStdString());
+  Next = (Next+1) % Files.size();
+  if (Image.GetLayerCount() == 1)
+    Image.ConvertToRGB();
+
+  if (Image.GetLayerCount() != 3)
+    return CaptureInvalidFrame;
+
+  return PublishFrame(ring, reinterpret_cast<unsigned char*>(Image.GetIplImage()->imageData), Image.GetWidth(),
+                      Image.GetHeight(), Image.GetIplImage()->widthStep, FrameHeader::Bgr, settings);
+}
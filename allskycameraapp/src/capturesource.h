@@ -0,0 +1,109 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <QString>
+#include <QStringList>
+
+#include <memory>
+
+class FrameRing;
+class QProcess;
+
+enum CaptureError
+{
+  CaptureOk = 0,
+  CaptureProcessFailed,
+  CaptureTimeout,
+  CaptureInvalidFrame,
+  CaptureNoFrames
+};
+
+struct CaptureSettings
+{
+  bool operator==(const CaptureSettings& other) const;
+  bool operator!=(const CaptureSettings& other) const { return !(*this == other); }
+
+  int ShutterTime { 0 };
+  int Iso { 100 };
+  int Saturation { 0 };
+  int Width { 640 };
+  int Height { 384 };
+};
+
+class CaptureSource
+{
+public:
+  virtual ~CaptureSource() = default;
+
+  // The frame is published in the next slot of the ring
+  virtual CaptureError Capture(FrameRing& ring, const CaptureSettings& settings) = 0;
+  virtual QString GetName() const = 0;
+
+  // raspistill, stream or files:<directory>
+  static CaptureSource* Create(const QString& source_str);
+  static const char* GetErrorString(CaptureError error);
+  // Slot size for the padded raw frames of the camera
+  static int GetFrameBufferSize(int width, int height);
+};
+
+// One raspistill process per frame, the BMP image is read from its stdout
+class RaspistillSource : public CaptureSource
+{
+public:
+  CaptureError Capture(FrameRing& ring, const CaptureSettings& settings) override;
+  QString GetName() const override { return "raspistill"; }
+};
+
+// Long-lived raspiyuv process in signal mode, the raw RGB frames are read from its stdout
+class StreamingCameraSource : public CaptureSource
+{
+public:
+  StreamingCameraSource() = default;
+  ~StreamingCameraSource() override;
+
+  CaptureError Capture(FrameRing& ring, const CaptureSettings& settings) override;
+  QString GetName() const override { return "stream"; }
+
+protected:
+  bool Start(const CaptureSettings& settings);
+  void Stop();
+  bool ReadFrame(unsigned char* buffer, int size, int timeout);
+
+  std::unique_ptr<QProcess> Camera;
+  CaptureSettings CurrentSettings;
+};
+
+// Stand-in camera replaying the images of a directory
+class FileSequenceSource : public CaptureSource
+{
+public:
+  explicit FileSequenceSource(const QString& path);
+
+  CaptureError Capture(FrameRing& ring, const CaptureSettings& settings) override;
+  QString GetName() const override { return "files"; }
+
+protected:
+  QString Path;
+  QStringList Files;
+  int Next { 0 };
+};
@@ -0,0 +1,374 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+
+#include "datasetpacker.h"
+#include "direnumerator.h"
+#include "framearchive.h"
+#include "inference.h"
+
+#include <MEImage.hpp>
+
+#include <MCLog.hpp>
+
+#include <QDir>
+#include <QFile>
+
+#include <opencv2/imgcodecs.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include <string.h>
+#include <unistd.h>
+
+namespace
+{
+const int ImageSize = CppInference::InputWidth*CppInference::InputHeight;
+// Images decoded in parallel between two sequential writes
+const size_t ChunkSize = 512;
+// Fixed size npy header, the image count is updated in place
+const int NpyHeaderSize = 128;
+
+
+std::string GetNpyHeader(const char* type, const QString& shape)
+{
+  const std::string Dict = QString("{'descr': '%1', 'fortran_order': False, 'shape': (%2), }").arg(type).arg(shape).toStdString();
+  std::string Header("\x93NUMPY\x01\x00", 8);
+
+  Header += (char)((NpyHeaderSize-10) & 0xff);
+  Header += (char)((NpyHeaderSize-10) >> 8);
+  Header += Dict;
+  Header.resize(NpyHeaderSize-1, ' ');
+  Header += '\n';
+  return Header;
+}
+
+
+int ReadNpyCount(FILE* file)
+{
+  char Header[NpyHeaderSize+1] = {};
+
+  if (fseeko(file, 0, SEEK_SET) != 0 || fread(Header, 1, NpyHeaderSize, file) != NpyHeaderSize ||
+      memcmp(Header, "\x93NUMPY", 6) != 0 || (unsigned char)Header[8]+((unsigned char)Header[9] << 8) != NpyHeaderSize-10)
+    return -1;
+
+  const char* Shape = strstr(Header+10, "'shape': (");
+
+  return Shape != nullptr ? atoi(Shape+10) : -1;
+}
+
+
+bool Truncate(FILE* file, off_t size)
+{
+  return fflush(file) == 0 && ftruncate(fileno(file), size) == 0 && fseeko(file, size, SEEK_SET) == 0;
+}
+
+
+// The archived JPEG frames are decoded without a temporary file
+bool DecodeFrame(const std::vector<unsigned char>& data, MEImage& image)
+{
+  const cv::Mat Frame = cv::imdecode(data, cv::IMREAD_COLOR);
+
+  if (Frame.empty())
+    return false;
+
+  image = MEImage(Frame.cols, Frame.rows, 3);
+  IplImage* Image = image.GetIplImage();
+
+  for (int y = 0; y < Frame.rows; ++y)
+  {
+    memcpy(Image->imageData+y*Image->widthStep, Frame.ptr(y), Frame.cols*3);
+  }
+  return true;
+}
+}
+
+
+DatasetPacker::DatasetPacker(const QString& prefix) : Prefix(prefix)
+{
+}
+
+
+DatasetPacker::~DatasetPacker()
+{
+  Close();
+}
+
+
+bool DatasetPacker::Open()
+{
+  Close();
+  if (QFile(Prefix+"_x.npy").exists())
+    return OpenExisting();
+
+  Images = fopen(qPrintable(Prefix+"_x.npy"), "w+b");
+  Labels = fopen(qPrintable(Prefix+"_y.npy"), "w+b");
+  Manifest = fopen(qPrintable(Prefix+"_files.txt"), "w+");
+  if (Images == nullptr || Labels == nullptr || Manifest == nullptr)
+  {
+    MC_WARNING("Unable to create the dataset %s", qPrintable(Prefix));
+    Close();
+    return false;
+  }
+  return WriteHeaders();
+}
+
+
+void DatasetPacker::Close()
+{
+  if (Images != nullptr)
+    fclose(Images);
+
+  if (Labels != nullptr)
+    fclose(Labels);
+
+  if (Manifest != nullptr)
+    fclose(Manifest);
+
+  Images = nullptr;
+  Labels = nullptr;
+  Manifest = nullptr;
+  PackedFiles.clear();
+  Count = 0;
+}
+
+
+bool DatasetPacker::Pack(const QString& path, int thread_count)
+{
+  if (Images == nullptr)
+    return false;
+
+  const QString Root = QDir::cleanPath(path);
+  const char* LabelDirs[] = { "clear", "clouds" };
+  std::vector<Sample> Samples;
+
+  // Sorted paths, the rebuilt datasets are identical
+  for (int label = 0; label < 2; ++label)
+  {
+    DirectoryEnumerator Files;
+    QString Filename;
+
+    if (!Files.Open(Root+'/'+LabelDirs[label], true, true))
+      continue;
+
+    while (Files.Next(Filename))
+    {
+      const QString Name = Filename.mid(Root.size()+1);
+
+      if (PackedFiles.find(Name) == PackedFiles.end())
+        Samples.push_back({ Name, label, false, QString(), -1, std::vector<unsigned char>() });
+    }
+  }
+  // The labelled frames of the night archives, they are named <index file>:<timestamp>
+  const QStringList Indexes = QDir(Root).entryList(QStringList() << "allskycam_*.index", QDir::Files, QDir::Name);
+
+  for (const QString& index : Indexes)
+  {
+    FrameArchiveReader Reader;
+    QFile SourcesFile(Root+'/'+index.section('.', 0, 0)+".sources");
+    QStringList Sources;
+
+    if (!Reader.Open(Root+'/'+index))
+      continue;
+
+    // The frames migrated by the housekeeping keep the names of their files, a file
+    // packed before the migration is not packed again
+    if (SourcesFile.open(QIODevice::ReadOnly))
+    {
+      while (!SourcesFile.atEnd())
+      {
+        const QByteArray Line = SourcesFile.readLine();
+
+        Sources << QString::fromLocal8Bit(Line.constData(), Line.endsWith('\n') ? Line.size()-1 : Line.size());
+      }
+      if (Sources.size() != Reader.GetCount())
+        Sources.clear();
+    }
+    for (int i = 0; i < Reader.GetCount(); ++i)
+    {
+      const ArchiveRecord& Record = Reader.GetRecord(i);
+      const QString Name = !Sources.isEmpty() ? Sources[i] : index+':'+QString::number((qlonglong)Record.Timestamp);
+
+      if ((Record.Label == ArchiveRecord::Clear || Record.Label == ArchiveRecord::Clouds) &&
+          PackedFiles.find(Name) == PackedFiles.end())
+      {
+        Samples.push_back({ Name, Record.Label, false, Root+'/'+index, i, std::vector<unsigned char>() });
+      }
+    }
+  }
+  std::vector<float> Data(ChunkSize*ImageSize);
+
+  AddedCount = 0;
+  thread_count = std::max(thread_count, 1);
+  for (size_t first = 0; first < Samples.size(); first += ChunkSize)
+  {
+    const size_t Size = std::min(ChunkSize, Samples.size()-first);
+    std::atomic<size_t> Next(0);
+    std::vector<std::thread> Workers;
+    FrameArchiveReader Reader;
+    QString ReaderIndex;
+
+    // The archived frames are read sequentially, only the decoding runs in parallel
+    for (size_t i = 0; i < Size; ++i)
+    {
+      Sample& Item = Samples[first+i];
+
+      if (Item.Record < 0)
+        continue;
+
+      if (ReaderIndex != Item.Index && Reader.Open(Item.Index))
+        ReaderIndex = Item.Index;
+
+      if (ReaderIndex != Item.Index || !Reader.ReadFrame(Item.Record, Item.Jpeg))
+        Item.Jpeg.clear();
+    }
+    auto Decode = [&]()
+    {
+      for (size_t i = Next++; i < Size; i = Next++)
+      {
+        Sample& Item = Samples[first+i];
+        MEImage Image;
+
+        if (Item.Record < 0)
+          Image.LoadFromFile((Root+'/'+Item.Filename).toStdString());
+        else
+        if (!DecodeFrame(Item.Jpeg, Image))
+          continue;
+
+        std::unique_ptr<MEImage> Input(CppInference::PrepareImage(Image));
+
+        Item.Valid = Input.get() != nullptr;
+        if (Item.Valid)
+          CppInference::CopyInput(*Input, &Data[i*ImageSize]);
+
+        // The compressed frame is not needed after the decoding
+        std::vector<unsigned char>().swap(Item.Jpeg);
+      }
+    };
+
+    for (int i = 1; i < thread_count; ++i)
+    {
+      Workers.emplace_back(Decode);
+    }
+    Decode();
+    for (auto& worker : Workers)
+    {
+      worker.join();
+    }
+    if (!WriteChunk(Samples, first, Size, Data))
+      return false;
+  }
+  return true;
+}
+
+
+bool DatasetPacker::OpenExisting()
+{
+  Images = fopen(qPrintable(Prefix+"_x.npy"), "r+b");
+  Labels = fopen(qPrintable(Prefix+"_y.npy"), "r+b");
+  Manifest = fopen(qPrintable(Prefix+"_files.txt"), "r+");
+  if (Images == nullptr || Labels == nullptr || Manifest == nullptr)
+  {
+    MC_WARNING("Unable to open the dataset %s", qPrintable(Prefix));
+    Close();
+    return false;
+  }
+  // The headers are updated last, the data of an interrupted append is cut off
+  const int ImageCount = ReadNpyCount(Images);
+  const int LabelCount = ReadNpyCount(Labels);
+  char* Line = nullptr;
+  size_t LineSize = 0;
+  ssize_t Length = 0;
+
+  Count = std::min(ImageCount, LabelCount);
+  while ((int)PackedFiles.size() < Count && (Length = getline(&Line, &LineSize, Manifest)) > 0)
+  {
+    PackedFiles.insert(QString::fromLocal8Bit(Line, Line[Length-1] == '\n' ? (int)Length-1 : (int)Length));
+  }
+  free(Line);
+  if (ImageCount < 0 || LabelCount < 0 || (int)PackedFiles.size() != Count)
+  {
+    MC_WARNING("Invalid dataset %s", qPrintable(Prefix));
+    Close();
+    return false;
+  }
+  if (!Truncate(Images, NpyHeaderSize+(off_t)Count*ImageSize*sizeof(float)) || !Truncate(Labels, NpyHeaderSize+(off_t)Count) ||
+      !Truncate(Manifest, ftello(Manifest)))
+  {
+    MC_WARNING("Unable to truncate the dataset %s", qPrintable(Prefix));
+    Close();
+    return false;
+  }
+  return true;
+}
+
+
+bool DatasetPacker::WriteChunk(const std::vector<Sample>& samples, size_t first, size_t size, const std::vector<float>& data)
+{
+  for (size_t i = 0; i < size; ++i)
+  {
+    const Sample& Item = samples[first+i];
+    const unsigned char Label = (unsigned char)Item.Label;
+
+    if (!Item.Valid)
+    {
+      printf("Unable to read %s\n", qPrintable(Item.Filename));
+      continue;
+    }
+    if (fwrite(&data[i*ImageSize], sizeof(float), ImageSize, Images) != ImageSize || fwrite(&Label, 1, 1, Labels) != 1 ||
+        fprintf(Manifest, "%s\n", Item.Filename.toLocal8Bit().constData()) < 0)
+    {
+      MC_WARNING("Unable to write the dataset %s", qPrintable(Prefix));
+      return false;
+    }
+    PackedFiles.insert(Item.Filename);
+    Count++;
+    AddedCount++;
+  }
+  return WriteHeaders();
+}
+
+
+bool DatasetPacker::WriteHeaders()
+{
+  const std::string ImageHeader = GetNpyHeader("<f4", QString("%1, %2, %3, 1").arg(Count).arg(CppInference::InputHeight).
+                                                      arg(CppInference::InputWidth));
+  const std::string LabelHeader = GetNpyHeader("|u1", QString("%1,").arg(Count));
+  bool Success = true;
+
+  // The data is on the disk before the new count
+  for (FILE* file : { Images, Labels, Manifest })
+  {
+    Success = Success && fflush(file) == 0 && fdatasync(fileno(file)) == 0;
+  }
+  Success = Success && fseeko(Images, 0, SEEK_SET) == 0 && fwrite(ImageHeader.data(), 1, NpyHeaderSize, Images) == NpyHeaderSize &&
+            fflush(Images) == 0 && fseeko(Images, 0, SEEK_END) == 0;
+  Success = Success && fseeko(Labels, 0, SEEK_SET) == 0 && fwrite(LabelHeader.data(), 1, NpyHeaderSize, Labels) == NpyHeaderSize &&
+            fflush(Labels) == 0 && fseeko(Labels, 0, SEEK_END) == 0;
+  if (!Success)
+    MC_WARNING("Unable to update the dataset headers %s", qPrintable(Prefix));
+
+  return Success;
+}
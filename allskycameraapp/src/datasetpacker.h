@@ -0,0 +1,74 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+
+#pragma once
+
+#include <QString>
+
+#include <set>
+#include <stdio.h>
+#include <vector>
+
+// Packs the labelled images of the clear/ and clouds/ directories and the
+// labelled frames of the night archives (allskycam_<night>.index) into the
+// input tensor of the model for the training: <prefix>_x.npy (float32,
+// N x 96 x 160 x 1) and <prefix>_y.npy (uint8 labels). The packed images are
+// listed in <prefix>_files.txt (archived frames as <index file>:<timestamp>, the
+// frames migrated by the housekeeping under their file names), the new images
+// of a later run are appended. The file offsets are 64-bit.
+class DatasetPacker
+{
+public:
+  explicit DatasetPacker(const QString& prefix);
+  ~DatasetPacker();
+
+  bool Open();
+  void Close();
+  // Decodes the new images in parallel with the preprocessing of the inference
+  bool Pack(const QString& path, int thread_count);
+  int GetCount() const { return Count; }
+  int GetAddedCount() const { return AddedCount; }
+
+protected:
+  struct Sample
+  {
+    QString Filename;
+    int Label;
+    bool Valid;
+    // Archived frame: index file and record, the JPEG data is read before the decoding
+    QString Index;
+    int Record;
+    std::vector<unsigned char> Jpeg;
+  };
+
+  bool OpenExisting();
+  bool WriteChunk(const std::vector<Sample>& samples, size_t first, size_t size, const std::vector<float>& data);
+  bool WriteHeaders();
+
+  QString Prefix;
+  FILE* Images { nullptr };
+  FILE* Labels { nullptr };
+  FILE* Manifest { nullptr };
+  std::set<QString> PackedFiles;
+  int Count { 0 };
+  int AddedCount { 0 };
+};
@@ -0,0 +1,219 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "denoiser.h"
+#include "simd.h"
+
+#include <MEImage.hpp>
+
+#include <MCLog.hpp>
+
+#include <algorithm>
+
+#include <stdint.h>
+#include <string.h>
+
+namespace
+{
+// Fewer frames than this are passed through unfiltered
+const int MinFilterDepth = 3;
+
+struct ScalarOps
+{
+  typedef unsigned char Type;
+  static const int Width = 1;
+
+  static Type Load(const unsigned char* data) { return *data; }
+  static void Store(unsigned char* data, Type value) { *data = value; }
+  static Type Min(Type a, Type b) { return a < b ? a : b; }
+  static Type Max(Type a, Type b) { return a > b ? a : b; }
+  static Type Average(Type a, Type b) { return (Type)(((int)a+(int)b+1) >> 1); }
+  static Type Mean(const Type* values, int count)
+  {
+    int Sum = count / 2;
+
+    for (int i = 0; i < count; ++i)
+    {
+      Sum += values[i];
+    }
+    return (Type)(Sum / count);
+  }
+};
+
+#if defined(ASC_NEON)
+struct VectorOps
+{
+  typedef uint8x16_t Type;
+  static const int Width = SimdWidth;
+
+  static Type Load(const unsigned char* data) { return vld1q_u8(data); }
+  static void Store(unsigned char* data, Type value) { vst1q_u8(data, value); }
+  static Type Min(Type a, Type b) { return vminq_u8(a, b); }
+  static Type Max(Type a, Type b) { return vmaxq_u8(a, b); }
+  static Type Average(Type a, Type b) { return vrhaddq_u8(a, b); }
+  static Type Mean(const Type* values, int count)
+  {
+    if (count == 1)
+      return values[0];
+
+    // Rounded sum times the 0.16 fixed-point reciprocal of the count
+    const uint16x4_t Reciprocal = vdup_n_u16((uint16_t)((65536+count-1) / count));
+    uint16x8_t Low = vdupq_n_u16(count / 2);
+    uint16x8_t High = Low;
+
+    for (int i = 0; i < count; ++i)
+    {
+      Low = vaddw_u8(Low, vget_low_u8(values[i]));
+      High = vaddw_u8(High, vget_high_u8(values[i]));
+    }
+    Low = vcombine_u16(vshrn_n_u32(vmull_u16(vget_low_u16(Low), Reciprocal), 16),
+                       vshrn_n_u32(vmull_u16(vget_high_u16(Low), Reciprocal), 16));
+    High = vcombine_u16(vshrn_n_u32(vmull_u16(vget_low_u16(High), Reciprocal), 16),
+                        vshrn_n_u32(vmull_u16(vget_high_u16(High), Reciprocal), 16));
+    return vcombine_u8(vqmovn_u16(Low), vqmovn_u16(High));
+  }
+};
+#elif defined(ASC_SSE2)
+struct VectorOps
+{
+  typedef __m128i Type;
+  static const int Width = SimdWidth;
+
+  static Type Load(const unsigned char* data) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(data)); }
+  static void Store(unsigned char* data, Type value) { _mm_storeu_si128(reinterpret_cast<__m128i*>(data), value); }
+  static Type Min(Type a, Type b) { return _mm_min_epu8(a, b); }
+  static Type Max(Type a, Type b) { return _mm_max_epu8(a, b); }
+  static Type Average(Type a, Type b) { return _mm_avg_epu8(a, b); }
+  static Type Mean(const Type* values, int count)
+  {
+    if (count == 1)
+      return values[0];
+
+    // Rounded sum times the 0.16 fixed-point reciprocal of the count
+    const __m128i Zero = _mm_setzero_si128();
+    const __m128i Reciprocal = _mm_set1_epi16((short)((65536+count-1) / count));
+    __m128i Low = _mm_set1_epi16((short)(count / 2));
+    __m128i High = Low;
+
+    for (int i = 0; i < count; ++i)
+    {
+      Low = _mm_add_epi16(Low, _mm_unpacklo_epi8(values[i], Zero));
+      High = _mm_add_epi16(High, _mm_unpackhi_epi8(values[i], Zero));
+    }
+    return _mm_packus_epi16(_mm_mulhi_epu16(Low, Reciprocal), _mm_mulhi_epu16(High, Reciprocal));
+  }
+};
+#endif
+
+
+// Sorts the samples of every lane across the ring with an odd-even transposition network
+template <class Ops>
+int FilterSamples(unsigned char* const* frames, int count, unsigned char* output, int begin, int size, int mode, int trim)
+{
+  typename Ops::Type Values[TemporalDenoiser::MaxDepth];
+  int i = begin;
+
+  for (; i+Ops::Width <= size; i += Ops::Width)
+  {
+    for (int f = 0; f < count; ++f)
+    {
+      Values[f] = Ops::Load(frames[f]+i);
+    }
+    for (int pass = 0; pass < count; ++pass)
+    {
+      for (int j = pass & 1; j+1 < count; j += 2)
+      {
+        typename Ops::Type Low = Ops::Min(Values[j], Values[j+1]);
+
+        Values[j+1] = Ops::Max(Values[j], Values[j+1]);
+        Values[j] = Low;
+      }
+    }
+    if (mode == TemporalDenoiser::Median)
+    {
+      Ops::Store(output+i, (count & 1) ? Values[count / 2] : Ops::Average(Values[count / 2-1], Values[count / 2]));
+    } else {
+      Ops::Store(output+i, Ops::Mean(Values+trim, count-2*trim));
+    }
+  }
+  return i;
+}
+}
+
+
+TemporalDenoiser::TemporalDenoiser(int depth, int mode) :
+  Depth(std::max(MinFilterDepth, std::min(depth, (int)MaxDepth))), Mode(mode)
+{
+}
+
+
+bool TemporalDenoiser::Process(MEImage& image, int shutter_time, int iso)
+{
+  // Frames with different exposure are not comparable
+  if (image.GetWidth() != Width || image.GetHeight() != Height || image.GetLayerCount() != Layers ||
+      shutter_time != ShutterTime || iso != Iso)
+  {
+    if (Count > 0)
+      MC_LOG("Exposure changed, restart temporal denoising");
+
+    Reset();
+    Width = image.GetWidth();
+    Height = image.GetHeight();
+    Layers = image.GetLayerCount();
+    ShutterTime = shutter_time;
+    Iso = iso;
+    Ring.assign(Depth, std::vector<unsigned char>(image.GetImageDataSize()));
+  }
+  unsigned char* Data = reinterpret_cast<unsigned char*>(image.GetIplImage()->imageData);
+  const int DataSize = image.GetImageDataSize();
+
+  memcpy(Ring[Next].data(), Data, DataSize);
+  Next = (Next+1) % Depth;
+  Count = std::min(Count+1, Depth);
+  if (Count < MinFilterDepth)
+    return false;
+
+  unsigned char* Frames[MaxDepth];
+  const int CurrentTrim = std::min(Trim, (Count-1) / 2);
+
+  for (int i = 0; i < Count; ++i)
+  {
+    Frames[i] = Ring[i].data();
+  }
+  int Processed = 0;
+
+#if defined(ASC_NEON) || defined(ASC_SSE2)
+  Processed = FilterSamples<VectorOps>(Frames, Count, Data, 0, DataSize, Mode, CurrentTrim);
+#endif
+  FilterSamples<ScalarOps>(Frames, Count, Data, Processed, DataSize, Mode, CurrentTrim);
+  return true;
+}
+
+
+void TemporalDenoiser::Reset()
+{
+  Width = 0;
+  Height = 0;
+  Layers = 0;
+  Next = 0;
+  Count = 0;
+  std::vector<std::vector<unsigned char>>().swap(Ring);
+}
@@ -0,0 +1,61 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <vector>
+
+class MEImage;
+
+// Per-pixel temporal median or trimmed mean over the last frames of a fixed camera
+class TemporalDenoiser
+{
+public:
+  enum FilterMode
+  {
+    Median = 0,
+    TrimmedMean = 1
+  };
+
+  // Longest supported ring, the sorting network is unrolled for this size
+  static const int MaxDepth = 9;
+
+  TemporalDenoiser(int depth = 5, int mode = Median);
+
+  bool Process(MEImage& image, int shutter_time, int iso);
+  void Reset();
+  int GetDepth() const { return Depth; }
+
+  // Samples dropped from both ends in the trimmed mean mode
+  int Trim { 1 };
+
+protected:
+  int Depth { 5 };
+  int Mode { Median };
+  int Width { 0 };
+  int Height { 0 };
+  int Layers { 0 };
+  int ShutterTime { 0 };
+  int Iso { 0 };
+  int Next { 0 };
+  int Count { 0 };
+  std::vector<std::vector<unsigned char>> Ring;
+};
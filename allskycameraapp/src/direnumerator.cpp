@@ -0,0 +1,281 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+
+#include "direnumerator.h"
+
+#include <MCLog.hpp>
+
+#include <algorithm>
+#include <utility>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace
+{
+// Record of the getdents64 system call, glibc does not declare it
+struct LinuxDirent64
+{
+  uint64_t Inode;
+  int64_t Offset;
+  unsigned short RecordLength;
+  unsigned char Type;
+  char Name[1];
+};
+
+const int DirentBufferSize = 64*1024;
+// Paths in memory per sorted run (~10 MB)
+const size_t SortRunSize = 100000;
+
+
+bool IsImageName(const char* name)
+{
+  const char* Extension = strrchr(name, '.');
+
+  return Extension != nullptr && (strcasecmp(Extension, ".png") == 0 || strcasecmp(Extension, ".jpg") == 0 ||
+                                  strcasecmp(Extension, ".jpeg") == 0);
+}
+}
+
+
+DirectoryEnumerator::~DirectoryEnumerator()
+{
+  Close();
+}
+
+
+bool DirectoryEnumerator::Open(const QString& path, bool recursive, bool sorted)
+{
+  Close();
+  Recursive = recursive;
+  Sorted = sorted;
+  CurrentPath = path.toLocal8Bit().constData();
+  while (CurrentPath.size() > 1 && CurrentPath.back() == '/')
+    CurrentPath.pop_back();
+  RootPath = CurrentPath;
+
+  Fd = open(CurrentPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (Fd < 0)
+  {
+    MC_WARNING("Unable to open the directory %s", qPrintable(path));
+    return false;
+  }
+  Buffer.resize(DirentBufferSize);
+  return !Sorted || Sort();
+}
+
+
+void DirectoryEnumerator::Close()
+{
+  if (Fd >= 0)
+    close(Fd);
+
+  for (auto run : Runs)
+    fclose(run);
+
+  free(Line);
+  Fd = -1;
+  RootPath.clear();
+  CurrentPath.clear();
+  PendingDirs.clear();
+  BufferPos = 0;
+  BufferSize = 0;
+  Names.clear();
+  NamePos = 0;
+  Runs.clear();
+  Heads = decltype(Heads)();
+  Line = nullptr;
+  LineSize = 0;
+}
+
+
+void DirectoryEnumerator::SetSkippedDirs(const QStringList& names)
+{
+  SkippedDirs.clear();
+  for (auto name : names)
+  {
+    SkippedDirs.insert(name.toLocal8Bit().constData());
+  }
+}
+
+
+bool DirectoryEnumerator::Next(QString& filename)
+{
+  std::string Name;
+
+  if (!Sorted)
+  {
+    if (!NextEntry(Name))
+      return false;
+  } else if (Runs.empty()) {
+    if (NamePos >= Names.size())
+      return false;
+
+    Name.swap(Names[NamePos++]);
+  } else {
+    if (Heads.empty())
+      return false;
+
+    const int Run = Heads.top().second;
+
+    Name = Heads.top().first;
+    Heads.pop();
+    ReadRun(Run);
+  }
+  filename = QString::fromLocal8Bit(Name.c_str());
+  return true;
+}
+
+
+bool DirectoryEnumerator::NextEntry(std::string& filename)
+{
+  while (true)
+  {
+    if (BufferPos >= BufferSize)
+    {
+      // Continue with the next subdirectory
+      if (Fd < 0)
+      {
+        if (PendingDirs.empty())
+          return false;
+
+        CurrentPath = PendingDirs.front();
+        PendingDirs.pop_front();
+        Fd = open(CurrentPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (Fd < 0)
+          MC_WARNING("Unable to open the directory %s", CurrentPath.c_str());
+
+        continue;
+      }
+      const long Bytes = syscall(SYS_getdents64, Fd, Buffer.data(), Buffer.size());
+
+      BufferPos = 0;
+      BufferSize = Bytes > 0 ? (int)Bytes : 0;
+      if (Bytes <= 0)
+      {
+        if (Bytes < 0)
+          MC_WARNING("Unable to read the directory %s", CurrentPath.c_str());
+
+        close(Fd);
+        Fd = -1;
+      }
+      continue;
+    }
+    const LinuxDirent64* Entry = reinterpret_cast<const LinuxDirent64*>(Buffer.data()+BufferPos);
+    unsigned char Type = Entry->Type;
+
+    BufferPos += Entry->RecordLength;
+    // ., .. and the hidden files like QDir
+    if (Entry->Name[0] == '.')
+      continue;
+
+    // Some file systems do not report the file type
+    if (Type == DT_UNKNOWN)
+    {
+      struct stat Stat;
+
+      if (fstatat(Fd, Entry->Name, &Stat, 0) != 0)
+        continue;
+
+      Type = S_ISDIR(Stat.st_mode) ? DT_DIR : S_ISREG(Stat.st_mode) ? DT_REG : DT_UNKNOWN;
+    }
+    if (Type == DT_DIR)
+    {
+      if (Recursive && (CurrentPath != RootPath || SkippedDirs.count(Entry->Name) == 0))
+        PendingDirs.push_back(CurrentPath+'/'+Entry->Name);
+
+      continue;
+    }
+    if ((Type == DT_REG || Type == DT_LNK) && IsImageName(Entry->Name))
+    {
+      filename = CurrentPath+'/'+Entry->Name;
+      return true;
+    }
+  }
+}
+
+
+bool DirectoryEnumerator::Sort()
+{
+  std::string Name;
+
+  while (NextEntry(Name))
+  {
+    Names.push_back(std::move(Name));
+    if (Names.size() >= SortRunSize && !WriteRun())
+      return false;
+  }
+  // Small directories are sorted in memory
+  if (Runs.empty())
+  {
+    std::sort(Names.begin(), Names.end());
+    return true;
+  }
+  if (!Names.empty() && !WriteRun())
+    return false;
+
+  for (int i = 0; i < (int)Runs.size(); ++i)
+  {
+    ReadRun(i);
+  }
+  return true;
+}
+
+
+bool DirectoryEnumerator::WriteRun()
+{
+  FILE* Run = tmpfile();
+
+  if (Run == nullptr)
+  {
+    MC_WARNING("Unable to create a temporary file for the sorting");
+    return false;
+  }
+  Runs.push_back(Run);
+  std::sort(Names.begin(), Names.end());
+  // The paths are separated by zero bytes, new lines are valid in the file names
+  for (auto& name : Names)
+  {
+    fwrite(name.c_str(), 1, name.size()+1, Run);
+  }
+  Names.clear();
+  if (fflush(Run) != 0 || fseek(Run, 0, SEEK_SET) != 0)
+  {
+    MC_WARNING("Unable to write a sorted run");
+    return false;
+  }
+  return true;
+}
+
+
+void DirectoryEnumerator::ReadRun(int run)
+{
+  if (getdelim(&Line, &LineSize, '\0', Runs[run]) > 0)
+    Heads.emplace(std::string(Line), run);
+}
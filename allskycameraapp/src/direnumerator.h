@@ -0,0 +1,78 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+
+#pragma once
+
+#include <QString>
+#include <QStringList>
+
+#include <deque>
+#include <queue>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+
+// Streams the image files of a directory tree with getdents64. The files are
+// returned in directory order as they are read, an external merge sort orders
+// the full paths only on request.
+class DirectoryEnumerator
+{
+public:
+  DirectoryEnumerator() = default;
+  ~DirectoryEnumerator();
+
+  bool Open(const QString& path, bool recursive = false, bool sorted = false);
+  void Close();
+  // Subdirectories of the root which are not read, e.g. the output of an earlier sorting
+  void SetSkippedDirs(const QStringList& names);
+  // Full path of the next image file, false at the end
+  bool Next(QString& filename);
+
+protected:
+  typedef std::pair<std::string, int> RunHead;
+
+  bool NextEntry(std::string& filename);
+  bool Sort();
+  bool WriteRun();
+  void ReadRun(int run);
+
+  bool Recursive { false };
+  bool Sorted { false };
+  int Fd { -1 };
+  std::string RootPath;
+  std::string CurrentPath;
+  std::set<std::string> SkippedDirs;
+  // Subdirectories to read after the current directory
+  std::deque<std::string> PendingDirs;
+  std::vector<char> Buffer;
+  int BufferPos { 0 };
+  int BufferSize { 0 };
+  // Sorted paths in memory or the sorted runs in temporary files
+  std::vector<std::string> Names;
+  size_t NamePos { 0 };
+  std::vector<FILE*> Runs;
+  std::priority_queue<RunHead, std::vector<RunHead>, std::greater<RunHead>> Heads;
+  char* Line { nullptr };
+  size_t LineSize { 0 };
+};
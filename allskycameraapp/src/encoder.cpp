@@ -0,0 +1,177 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "encoder.h"
+
+#include <MEImage.hpp>
+
+#include <MCLog.hpp>
+
+#include <QFile>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+#include <algorithm>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+bool EncodeJpeg(const MEImage& image, std::vector<unsigned char>& buffer, int quality, bool optimize, bool progressive)
+{
+  const IplImage* Image = image.GetIplImage();
+
+  if (Image == nullptr)
+    return false;
+
+  // Wrap the pixel data without a copy
+  const cv::Mat Frame(image.GetHeight(), image.GetWidth(), CV_8UC(image.GetLayerCount()), Image->imageData,
+                      Image->widthStep);
+  const std::vector<int> Parameters = { cv::IMWRITE_JPEG_QUALITY, quality, cv::IMWRITE_JPEG_OPTIMIZE, optimize ? 1 : 0,
+                                        cv::IMWRITE_JPEG_PROGRESSIVE, progressive ? 1 : 0 };
+
+  buffer.clear();
+  return cv::imencode(".jpg", Frame, buffer, Parameters);
+}
+
+
+ImageBuffer EncodeJpeg(const MEImage& image, int quality)
+{
+  std::shared_ptr<std::vector<unsigned char>> Buffer(new std::vector<unsigned char>());
+
+  if (!EncodeJpeg(image, *Buffer, quality))
+    return ImageBuffer();
+
+  return Buffer;
+}
+
+
+bool WriteBuffer(const QString& filename, const std::vector<unsigned char>& buffer)
+{
+  const QString TempFilename = filename+".tmp";
+  QFile File(TempFilename);
+
+  if (!File.open(QIODevice::WriteOnly) ||
+      File.write(reinterpret_cast<const char*>(buffer.data()), buffer.size()) != (qint64)buffer.size())
+  {
+    MC_WARNING("Unable to write %s", qPrintable(TempFilename));
+    File.close();
+    QFile::remove(TempFilename);
+    return false;
+  }
+  File.close();
+  // rename() replaces the old file atomically, QFile::rename() would refuse it
+  if (rename(qPrintable(TempFilename), qPrintable(filename)) != 0)
+  {
+    MC_WARNING("Unable to rename %s", qPrintable(TempFilename));
+    QFile::remove(TempFilename);
+    return false;
+  }
+  return true;
+}
+
+
+AdaptiveJpegEncoder::AdaptiveJpegEncoder(int target_bytes) : TargetBytes(target_bytes)
+{
+}
+
+
+ImageBuffer AdaptiveJpegEncoder::Encode(const MEImage& image)
+{
+  const double Energy = MeasureDetail(image);
+  int Quality = PredictQuality(Energy);
+  std::shared_ptr<std::vector<unsigned char>> Buffer(new std::vector<unsigned char>());
+
+  if (!EncodeJpeg(image, *Buffer, Quality, true, Progressive))
+    return ImageBuffer();
+
+  // Correct a bad prediction (first frame, sudden scene change) with one more encode
+  if (Quality > MinQuality && (int)Buffer->size() > TargetBytes*(1+Tolerance))
+  {
+    const int FirstQuality = Quality;
+    const int FirstBytes = (int)Buffer->size();
+
+    Update(Quality, (int)Buffer->size(), Energy);
+    Quality = std::min(PredictQuality(Energy), FirstQuality-1);
+    if (!EncodeJpeg(image, *Buffer, Quality, true, Progressive))
+      return ImageBuffer();
+
+    MC_LOG("JPEG quality %d gave %d bytes, encoded again", FirstQuality, FirstBytes);
+  }
+  Update(Quality, (int)Buffer->size(), Energy);
+  MC_LOG("JPEG quality: %d size: %d bytes (budget: %d bytes)", Quality, (int)Buffer->size(), TargetBytes);
+  return Buffer;
+}
+
+
+int AdaptiveJpegEncoder::PredictQuality(double energy) const
+{
+  if (TargetBytes <= 0 || LastBytes <= 0 || LastEnergy <= 0 || energy <= 0)
+    return LastQuality;
+
+  // The size at the last quality scales with the detail of the scene
+  const double ExpectedBytes = LastBytes*energy / LastEnergy;
+  const int Quality = LastQuality+(int)floor(log(TargetBytes / ExpectedBytes) / Slope);
+
+  return std::max(MinQuality, std::min(MaxQuality, Quality));
+}
+
+
+void AdaptiveJpegEncoder::Update(int quality, int bytes, double energy)
+{
+  // Refine the slope from two points of the size/quality curve
+  if (LastBytes > 0 && LastEnergy > 0 && energy > 0 && abs(quality-LastQuality) >= 3)
+  {
+    const double Measured = log(((double)bytes / energy) / ((double)LastBytes / LastEnergy)) / (quality-LastQuality);
+
+    if (Measured > 0)
+      Slope = std::max(0.01, std::min(0.1, Slope*0.7+Measured*0.3));
+  }
+  LastQuality = quality;
+  LastBytes = bytes;
+  LastEnergy = energy;
+}
+
+
+double MeasureDetail(const MEImage& image)
+{
+  const IplImage* Image = image.GetIplImage();
+  const int Layers = image.GetLayerCount();
+  const int Channel = Layers >= 3 ? 1 : 0;
+  double Energy = 0;
+
+  // Every second row is enough for the estimation
+  for (int y = 0; y < image.GetHeight()-1; y += 2)
+  {
+    const unsigned char* Row = reinterpret_cast<const unsigned char*>(Image->imageData)+y*Image->widthStep+Channel;
+    const unsigned char* NextRow = Row+Image->widthStep;
+    int RowEnergy = 0;
+
+    for (int x = 0; x < image.GetWidth()-1; ++x)
+    {
+      RowEnergy += abs(Row[x*Layers]-Row[(x+1)*Layers])+abs(Row[x*Layers]-NextRow[x*Layers]);
+    }
+    Energy += RowEnergy;
+  }
+  // Flat images still have a header and quantized DC values
+  return Energy+image.GetWidth()*image.GetHeight();
+}
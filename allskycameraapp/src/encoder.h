@@ -0,0 +1,71 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <QString>
+
+#include <memory>
+#include <vector>
+
+class MEImage;
+
+// Compressed image shared by the file writes and the upload
+typedef std::shared_ptr<const std::vector<unsigned char>> ImageBuffer;
+
+// JPEG compression into memory, the same buffer is written and uploaded
+bool EncodeJpeg(const MEImage& image, std::vector<unsigned char>& buffer, int quality = 95, bool optimize = false,
+                bool progressive = false);
+ImageBuffer EncodeJpeg(const MEImage& image, int quality = 95);
+// Written to a temporary file and renamed, the readers never see a partial file
+bool WriteBuffer(const QString& filename, const std::vector<unsigned char>& buffer);
+
+// Selects the JPEG quality for a size budget. The quality is predicted from the size of the
+// previous frame and the change of the high-frequency energy, a second encode is needed only
+// if the prediction overshoots the budget.
+class AdaptiveJpegEncoder
+{
+public:
+  explicit AdaptiveJpegEncoder(int target_bytes);
+
+  ImageBuffer Encode(const MEImage& image);
+  int GetQuality() const { return LastQuality; }
+
+  int MinQuality { 30 };
+  int MaxQuality { 95 };
+  // Relative overshoot of the budget accepted without a second encode
+  float Tolerance { 0.15f };
+  bool Progressive { false };
+
+protected:
+  int PredictQuality(double energy) const;
+  void Update(int quality, int bytes, double energy);
+
+  int TargetBytes { 0 };
+  int LastQuality { 85 };
+  int LastBytes { 0 };
+  double LastEnergy { 0 };
+  // Growth of log(size) per quality step
+  double Slope { 0.035 };
+};
+
+// Sum of the absolute horizontal and vertical differences in the green channel
+double MeasureDetail(const MEImage& image);
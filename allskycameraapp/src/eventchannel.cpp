@@ -0,0 +1,235 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+
+#include "eventchannel.h"
+
+#include <MCLog.hpp>
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace
+{
+bool MakeAddress(const QString& path, sockaddr_un& address)
+{
+  const QByteArray Path = path.toLocal8Bit();
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (Path.isEmpty() || Path.size() >= (int)sizeof(address.sun_path))
+    return false;
+
+  memcpy(address.sun_path, Path.constData(), Path.size());
+  return true;
+}
+}
+
+
+EventPublisher::EventPublisher(const QString& path) : Path(path)
+{
+}
+
+
+EventPublisher::~EventPublisher()
+{
+  Stop();
+}
+
+
+bool EventPublisher::Start()
+{
+  sockaddr_un Address;
+
+  Stop();
+  if (!MakeAddress(Path, Address))
+  {
+    MC_WARNING("Invalid event socket path: %s", qPrintable(Path));
+    return false;
+  }
+  // A stale socket of a previous run
+  unlink(Address.sun_path);
+  ListenFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (ListenFd < 0 || bind(ListenFd, reinterpret_cast<sockaddr*>(&Address), sizeof(Address)) != 0 ||
+      listen(ListenFd, (int)MaxSubscribers) != 0)
+  {
+    MC_WARNING("Unable to open the event socket %s (%s)", qPrintable(Path), strerror(errno));
+    Stop();
+    return false;
+  }
+  MC_LOG("Event socket: %s", qPrintable(Path));
+  return true;
+}
+
+
+void EventPublisher::Stop()
+{
+  std::lock_guard<std::mutex> Lock(Mutex);
+
+  for (const Subscriber& Current : Subscribers)
+  {
+    close(Current.Fd);
+  }
+  Subscribers.clear();
+  if (ListenFd >= 0)
+  {
+    close(ListenFd);
+    unlink(qPrintable(Path));
+  }
+  ListenFd = -1;
+}
+
+
+void EventPublisher::Publish(ChannelEvent& event)
+{
+  std::lock_guard<std::mutex> Lock(Mutex);
+
+  if (ListenFd < 0)
+    return;
+
+  // The new subscribers and the mask updates are handled with the events, no thread is needed
+  Accept();
+  event.PublishTime = EventSubscriber::GetMonotonicTime();
+  for (size_t i = 0; i < Subscribers.size();)
+  {
+    Subscriber& Current = Subscribers[i];
+    uint32_t Mask = 0;
+    ssize_t Bytes = 0;
+
+    // Mask updates of the subscriber, a closed connection reads 0 bytes
+    while ((Bytes = recv(Current.Fd, &Mask, sizeof(Mask), MSG_DONTWAIT)) == sizeof(Mask))
+    {
+      Current.Mask = Mask;
+    }
+    bool Closed = Bytes == 0 || (Bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+
+    if (!Closed && (Current.Mask & event.Type) && send(Current.Fd, &event, sizeof(event), MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+    {
+      // A full socket buffer drops the event for this subscriber only
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        Dropped++;
+      else
+        Closed = true;
+    }
+    if (Closed)
+    {
+      close(Current.Fd);
+      Subscribers.erase(Subscribers.begin()+i);
+      continue;
+    }
+    ++i;
+  }
+}
+
+
+int EventPublisher::GetSubscriberCount() const
+{
+  std::lock_guard<std::mutex> Lock(Mutex);
+
+  return (int)Subscribers.size();
+}
+
+
+void EventPublisher::Accept()
+{
+  while (true)
+  {
+    const int Fd = accept4(ListenFd, nullptr, nullptr, SOCK_CLOEXEC);
+
+    if (Fd < 0)
+      return;
+
+    if (Subscribers.size() >= MaxSubscribers)
+    {
+      close(Fd);
+      continue;
+    }
+    Subscribers.push_back({ Fd, ChannelEvent::AllEvents });
+  }
+}
+
+
+EventSubscriber::~EventSubscriber()
+{
+  Close();
+}
+
+
+bool EventSubscriber::Connect(const QString& path, uint32_t mask)
+{
+  sockaddr_un Address;
+
+  Close();
+  if (!MakeAddress(path, Address))
+    return false;
+
+  Fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (Fd < 0 || connect(Fd, reinterpret_cast<sockaddr*>(&Address), sizeof(Address)) != 0 ||
+      send(Fd, &mask, sizeof(mask), MSG_NOSIGNAL) != sizeof(mask))
+  {
+    Close();
+    return false;
+  }
+  return true;
+}
+
+
+void EventSubscriber::Close()
+{
+  if (Fd >= 0)
+    close(Fd);
+
+  Fd = -1;
+}
+
+
+bool EventSubscriber::Receive(ChannelEvent& event, int timeout)
+{
+  pollfd Poll = { Fd, POLLIN, 0 };
+
+  if (Fd < 0 || poll(&Poll, 1, timeout) <= 0)
+    return false;
+
+  const ssize_t Bytes = recv(Fd, &event, sizeof(event), 0);
+
+  if (Bytes == sizeof(event))
+    return true;
+
+  // Closed by the publisher
+  if (Bytes == 0)
+    Close();
+
+  return false;
+}
+
+
+int64_t EventSubscriber::GetMonotonicTime()
+{
+  timespec Time;
+
+  clock_gettime(CLOCK_MONOTONIC, &Time);
+  return (int64_t)Time.tv_sec*1000000000+Time.tv_nsec;
+}
@@ -0,0 +1,113 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+
+#pragma once
+
+#include <QString>
+
+#include <mutex>
+#include <vector>
+
+#include <stdint.h>
+
+// One message of the event channel, the layout is shared with the subscribers
+struct ChannelEvent
+{
+  enum EventType
+  {
+    // Every published frame
+    FrameEvent = 1,
+    // Change of the clear sky verdict
+    LabelEvent = 2,
+    // Change of the shutter time or the ISO
+    ExposureEvent = 4,
+    AllEvents = FrameEvent | LabelEvent | ExposureEvent
+  };
+
+  uint32_t Type;
+  uint32_t Reserved;
+  // Frame of the shared frame ring, 0 when the frame was not published
+  uint64_t Sequence;
+  // Capture time (ms since epoch)
+  int64_t Timestamp;
+  // CLOCK_MONOTONIC of the publishing (ns), the subscribers measure the latency with it
+  int64_t PublishTime;
+  // Clear (0), cloudy (1) or not classified (-1)
+  int32_t Label;
+  float Probabilities[2];
+  int32_t ShutterTime;
+  int32_t Iso;
+  int32_t Brightness;
+  int32_t NightMode;
+};
+
+// Unix domain socket pub/sub of the frame events. The subscribers send the mask
+// of the event types once, the events are sent without blocking the publisher:
+// a subscriber with a full socket buffer misses the events.
+class EventPublisher
+{
+public:
+  explicit EventPublisher(const QString& path);
+  ~EventPublisher();
+
+  bool Start();
+  void Stop();
+  void Publish(ChannelEvent& event);
+  int GetSubscriberCount() const;
+  int GetDroppedCount() const { return Dropped; }
+
+  // Connections beyond this are closed at once
+  size_t MaxSubscribers { 16 };
+
+protected:
+  struct Subscriber
+  {
+    int Fd;
+    uint32_t Mask;
+  };
+
+  void Accept();
+
+  QString Path;
+  int ListenFd { -1 };
+  mutable std::mutex Mutex;
+  std::vector<Subscriber> Subscribers;
+  int Dropped { 0 };
+};
+
+class EventSubscriber
+{
+public:
+  EventSubscriber() = default;
+  ~EventSubscriber();
+
+  bool Connect(const QString& path, uint32_t mask = ChannelEvent::AllEvents);
+  void Close();
+  // False after a timeout (ms) or a closed channel
+  bool Receive(ChannelEvent& event, int timeout);
+  bool IsConnected() const { return Fd >= 0; }
+
+  static int64_t GetMonotonicTime();
+
+protected:
+  int Fd { -1 };
+};
@@ -0,0 +1,384 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+
+#include "filemover.h"
+
+#include <MCLog.hpp>
+
+#include <QDir>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+
+namespace
+{
+bool Exists(const std::string& path)
+{
+  struct stat Stat;
+
+  return lstat(path.c_str(), &Stat) == 0;
+}
+
+
+std::string GetDirectory(const std::string& path)
+{
+  const size_t Slash = path.rfind('/');
+
+  return Slash == std::string::npos ? "." : Slash == 0 ? "/" : path.substr(0, Slash);
+}
+
+
+void SyncDirectory(const std::string& path)
+{
+  const int Fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+  if (Fd >= 0)
+  {
+    fsync(Fd);
+    close(Fd);
+  }
+}
+
+
+// Atomic rename which never replaces an existing file
+int RenameNoReplace(const char* source, const char* target)
+{
+#if defined(SYS_renameat2)
+  if (syscall(SYS_renameat2, AT_FDCWD, source, AT_FDCWD, target, RENAME_NOREPLACE) == 0)
+    return 0;
+
+  if (errno != ENOSYS && errno != EINVAL)
+    return -1;
+#endif
+  // Older kernels and file systems: a hard link fails on an existing target as well
+  if (link(source, target) != 0)
+  {
+    // No hard links on the file system (e.g. FAT)
+    if (errno != EPERM && errno != ENOTSUP)
+      return -1;
+
+    if (access(target, F_OK) == 0)
+    {
+      errno = EEXIST;
+      return -1;
+    }
+    return rename(source, target);
+  }
+
+  unlink(source);
+  return 0;
+}
+}
+
+
+FileMover::FileMover(const QString& journal_path, JournalMode journal_mode) : Mode(journal_mode)
+{
+  char* Path = getcwd(nullptr, 0);
+
+  WorkingDir = Path != nullptr ? Path : "";
+  free(Path);
+  JournalPath = GetAbsolutePath(journal_path);
+}
+
+
+FileMover::~FileMover()
+{
+  Close();
+}
+
+
+bool FileMover::Open(RecoveryMode mode)
+{
+  std::vector<PendingMove> Unresolved;
+
+  Close();
+  if (!Recover(mode, Unresolved))
+    return false;
+
+  // The unresolved moves stay in the journal of the new run
+  if (!Unresolved.empty() && !WriteJournal(Unresolved))
+    return false;
+
+  JournalFd = open(JournalPath.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | (Unresolved.empty() ? O_TRUNC : 0),
+                   0644);
+  if (JournalFd < 0)
+  {
+    MC_WARNING("Unable to create the move journal %s", JournalPath.c_str());
+    return false;
+  }
+  FailedRecords.clear();
+  for (auto& move : Unresolved)
+  {
+    AppendRecord(FailedRecords, move);
+  }
+  Failed = !Unresolved.empty();
+  MoveCount = 0;
+  Elapsed = std::chrono::steady_clock::duration(0);
+  return true;
+}
+
+
+void FileMover::Close()
+{
+  if (JournalFd < 0)
+    return;
+
+  // The journal is kept after a failed move for the next start
+  const bool Success = Flush() && !Failed;
+
+  close(JournalFd);
+  JournalFd = -1;
+  if (Success)
+    unlink(JournalPath.c_str());
+}
+
+
+void FileMover::Move(const QString& source, const QString& target_dir)
+{
+  if (Directories.insert(target_dir).second)
+    QDir().mkpath(target_dir);
+
+  Batch.push_back({ GetAbsolutePath(source), GetAbsolutePath(target_dir+'/'+source.section('/', -1, -1)) });
+  if ((int)Batch.size() >= BatchSize)
+    Flush();
+}
+
+
+bool FileMover::Flush()
+{
+  if (Batch.empty() || JournalFd < 0)
+    return true;
+
+  const auto StartTime = std::chrono::steady_clock::now();
+  std::string Records;
+  std::set<std::string> SyncDirectories;
+  bool Success = true;
+
+  // Zero separated source/target pairs, one write and sync per batch
+  for (auto& move : Batch)
+  {
+    AppendRecord(Records, move);
+  }
+  if (write(JournalFd, Records.data(), Records.size()) != (ssize_t)Records.size() || fdatasync(JournalFd) != 0)
+  {
+    MC_WARNING("Unable to write the move journal %s", JournalPath.c_str());
+    Failed = true;
+    return false;
+  }
+  for (auto& move : Batch)
+  {
+    if (!MoveFile(move.Source, move.Target))
+    {
+      AppendRecord(FailedRecords, move);
+      Success = false;
+      continue;
+    }
+    SyncDirectories.insert(GetDirectory(move.Source));
+    SyncDirectories.insert(GetDirectory(move.Target));
+    MoveCount++;
+  }
+  for (auto& dir : SyncDirectories)
+  {
+    SyncDirectory(dir);
+  }
+  // The batch of a watch is committed with the synced directories, only the failed moves stay
+  if (Mode == PerBatch && (ftruncate(JournalFd, 0) != 0 ||
+                           write(JournalFd, FailedRecords.data(), FailedRecords.size()) != (ssize_t)FailedRecords.size() ||
+                           fdatasync(JournalFd) != 0))
+  {
+    MC_WARNING("Unable to update the move journal %s", JournalPath.c_str());
+    Success = false;
+  }
+  Failed |= !Success;
+  Batch.clear();
+  Elapsed += std::chrono::steady_clock::now()-StartTime;
+  return Success;
+}
+
+
+double FileMover::GetMovesPerSecond() const
+{
+  const double Seconds = std::chrono::duration<double>(Elapsed).count();
+
+  return Seconds > 0 ? MoveCount / Seconds : 0;
+}
+
+
+void FileMover::AppendRecord(std::string& records, const PendingMove& move)
+{
+  records.append(move.Source.c_str(), move.Source.size()+1);
+  records.append(move.Target.c_str(), move.Target.size()+1);
+}
+
+
+std::string FileMover::GetAbsolutePath(const QString& path) const
+{
+  const std::string Path = path.toLocal8Bit().constData();
+
+  return Path.empty() || Path[0] == '/' ? Path : WorkingDir+'/'+Path;
+}
+
+
+bool FileMover::Recover(RecoveryMode mode, std::vector<PendingMove>& unresolved)
+{
+  FILE* Journal = fopen(JournalPath.c_str(), "r");
+
+  RecoveredCount = 0;
+  unresolved.clear();
+  if (Journal == nullptr)
+    return true;
+
+  char* Line = nullptr;
+  size_t LineSize = 0;
+  std::vector<PendingMove> Moves;
+  std::string Source;
+
+  // An incomplete record at the end belongs to a batch which was not started
+  while (getdelim(&Line, &LineSize, '\0', Journal) > 0)
+  {
+    if (Source.empty())
+    {
+      Source = Line;
+      continue;
+    }
+    Moves.push_back({ Source, Line });
+    Source.clear();
+  }
+  free(Line);
+  fclose(Journal);
+
+  // The state of every move is read from the file system, the recovery can be repeated
+  for (auto& move : Moves)
+  {
+    const bool SourceExists = Exists(move.Source);
+    const bool TargetExists = Exists(move.Target);
+
+    const bool Pending = mode == Resume ? SourceExists : TargetExists;
+    const bool Done = mode == Resume ? TargetExists : SourceExists;
+
+    // Finished moves are dropped, both files are kept when they exist (the target may be
+    // an earlier file with the same name) and the move stays unresolved
+    if (!Pending)
+      continue;
+
+    if (!Done && (mode == Resume ? MoveFile(move.Source, move.Target) : MoveFile(move.Target, move.Source)))
+    {
+      RecoveredCount++;
+      continue;
+    }
+    unresolved.push_back(move);
+  }
+  if (!Moves.empty())
+  {
+    MC_LOG("%s %d interrupted moves from %s", mode == Resume ? "Finished" : "Rolled back", RecoveredCount,
+           JournalPath.c_str());
+  }
+  // The journal is kept for the moves which were not recovered
+  if (!unresolved.empty())
+  {
+    MC_WARNING("%d moves were not recovered and stay in %s", (int)unresolved.size(), JournalPath.c_str());
+    return true;
+  }
+  return unlink(JournalPath.c_str()) == 0 || errno == ENOENT;
+}
+
+
+bool FileMover::WriteJournal(const std::vector<PendingMove>& moves)
+{
+  const std::string TempPath = JournalPath+".tmp";
+  const int Fd = open(TempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  std::string Records;
+  bool Success = Fd >= 0;
+
+  for (auto& move : moves)
+  {
+    AppendRecord(Records, move);
+  }
+  // The old journal is replaced atomically, it stays valid until the new one is synced
+  Success = Success && write(Fd, Records.data(), Records.size()) == (ssize_t)Records.size() && fdatasync(Fd) == 0;
+  if (Fd >= 0)
+    close(Fd);
+
+  if (!Success || rename(TempPath.c_str(), JournalPath.c_str()) != 0)
+  {
+    MC_WARNING("Unable to write the move journal %s", JournalPath.c_str());
+    unlink(TempPath.c_str());
+    return false;
+  }
+  SyncDirectory(GetDirectory(JournalPath));
+  return true;
+}
+
+
+bool FileMover::MoveFile(const std::string& source, const std::string& target)
+{
+  if (RenameNoReplace(source.c_str(), target.c_str()) == 0)
+    return true;
+
+  if (errno == EXDEV && CopyFile(source, target))
+  {
+    unlink(source.c_str());
+    return true;
+  }
+  MC_WARNING("Unable to move %s to %s", source.c_str(), target.c_str());
+  return false;
+}
+
+
+bool FileMover::CopyFile(const std::string& source, const std::string& target)
+{
+  const std::string TempTarget = target+".tmp";
+  const int SourceFd = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+  const int TargetFd = open(TempTarget.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  struct stat Stat;
+  bool Success = SourceFd >= 0 && TargetFd >= 0 && fstat(SourceFd, &Stat) == 0;
+  off_t Offset = 0;
+
+  // In-kernel copy, the target appears under its final name only when it is complete
+  while (Success && Offset < Stat.st_size)
+  {
+    Success = sendfile(TargetFd, SourceFd, &Offset, Stat.st_size-Offset) > 0;
+  }
+  Success = Success && fsync(TargetFd) == 0;
+  if (SourceFd >= 0)
+    close(SourceFd);
+
+  if (TargetFd >= 0)
+    close(TargetFd);
+
+  if (!Success || RenameNoReplace(TempTarget.c_str(), target.c_str()) != 0)
+  {
+    unlink(TempTarget.c_str());
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,94 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+
+#pragma once
+
+#include <QString>
+
+#include <chrono>
+#include <set>
+#include <string>
+#include <vector>
+
+// Moves the sorted files in batches. Every batch is written to a journal
+// before the renames, an interrupted run is finished or rolled back at the next
+// start. The journal holds the whole run, or only the last batch and the failed
+// moves of a long-running watch. A clean Close() removes the journal.
+class FileMover
+{
+public:
+  enum RecoveryMode
+  {
+    Resume = 0,
+    Rollback
+  };
+
+  enum JournalMode
+  {
+    WholeRun = 0,
+    PerBatch
+  };
+
+  explicit FileMover(const QString& journal_path, JournalMode journal_mode = WholeRun);
+  ~FileMover();
+
+  // Recovers an interrupted run from the journal
+  bool Open(RecoveryMode mode = Resume);
+  void Close();
+  void Move(const QString& source, const QString& target_dir);
+  bool Flush();
+  int GetMoveCount() const { return MoveCount; }
+  int GetRecoveredCount() const { return RecoveredCount; }
+  double GetMovesPerSecond() const;
+
+protected:
+  struct PendingMove
+  {
+    std::string Source;
+    std::string Target;
+  };
+
+  static void AppendRecord(std::string& records, const PendingMove& move);
+  std::string GetAbsolutePath(const QString& path) const;
+  // The moves which are neither finished nor rolled back are returned
+  bool Recover(RecoveryMode mode, std::vector<PendingMove>& unresolved);
+  bool WriteJournal(const std::vector<PendingMove>& moves);
+  bool MoveFile(const std::string& source, const std::string& target);
+  bool CopyFile(const std::string& source, const std::string& target);
+
+  static const int BatchSize = 256;
+
+  // The journal is valid from any working directory
+  std::string WorkingDir;
+  std::string JournalPath;
+  JournalMode Mode { WholeRun };
+  int JournalFd { -1 };
+  std::vector<PendingMove> Batch;
+  // Failed moves of the per-batch journal, they are kept for the next start
+  std::string FailedRecords;
+  bool Failed { false };
+  // The target directories are created once per run
+  std::set<QString> Directories;
+  int MoveCount { 0 };
+  int RecoveredCount { 0 };
+  std::chrono::steady_clock::duration Elapsed { 0 };
+};
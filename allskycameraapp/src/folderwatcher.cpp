@@ -0,0 +1,122 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "folderwatcher.h"
+
+#include <MCLog.hpp>
+
+#include <QDateTime>
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+FolderWatcher::~FolderWatcher()
+{
+  if (Fd >= 0)
+    close(Fd);
+}
+
+
+bool FolderWatcher::Add(const QString& path)
+{
+  if (Fd < 0)
+    Fd = inotify_init1(IN_CLOEXEC);
+
+  // Written files and the files renamed into the directory
+  const int Watch = Fd < 0 ? -1 : inotify_add_watch(Fd, qPrintable(path), IN_CLOSE_WRITE | IN_MOVED_TO);
+
+  if (Watch < 0)
+  {
+    MC_WARNING("Unable to watch %s", qPrintable(path));
+    return false;
+  }
+  Watches[Watch] = path;
+  MC_LOG("Watching %s", qPrintable(path));
+  return true;
+}
+
+
+bool FolderWatcher::WaitForFiles(QStringList& files, int batch_window, int max_batch)
+{
+  files.clear();
+  if (Fd < 0)
+    return false;
+
+  // The first image of the batch
+  while (Pending.isEmpty())
+  {
+    if (!ReadEvents(-1))
+      return false;
+  }
+  const qint64 Deadline = QDateTime::currentMSecsSinceEpoch()+batch_window;
+
+  while (Pending.size() < max_batch)
+  {
+    const qint64 Remaining = Deadline-QDateTime::currentMSecsSinceEpoch();
+
+    if (Remaining <= 0 || !ReadEvents((int)Remaining))
+      break;
+  }
+  // The rest of a large burst is the next batch
+  while (!Pending.isEmpty() && files.size() < max_batch)
+    files << Pending.takeFirst();
+
+  return true;
+}
+
+
+bool FolderWatcher::ReadEvents(int timeout)
+{
+  struct pollfd Poll = { Fd, POLLIN, 0 };
+  // The buffer has to be aligned for the event structures
+  alignas(struct inotify_event) char Buffer[4096];
+
+  const int Ready = poll(&Poll, 1, timeout);
+
+  if (Ready < 0 && errno == EINTR)
+    return true;
+
+  if (Ready <= 0)
+    return false;
+
+  const ssize_t Length = read(Fd, Buffer, sizeof(Buffer));
+
+  if (Length <= 0)
+    return false;
+
+  for (ssize_t Offset = 0; Offset < Length;)
+  {
+    const struct inotify_event* Event = reinterpret_cast<const struct inotify_event*>(Buffer+Offset);
+
+    Offset += sizeof(struct inotify_event)+Event->len;
+    if (Event->len == 0 || Watches.find(Event->wd) == Watches.end())
+      continue;
+
+    const QString Name = QString::fromLocal8Bit(Event->name);
+    const QString Suffix = Name.section('.', -1).toLower();
+
+    if (Suffix == "png" || Suffix == "jpg" || Suffix == "jpeg")
+      Pending << Watches[Event->wd]+'/'+Name;
+  }
+  return true;
+}
@@ -0,0 +1,49 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <QString>
+#include <QStringList>
+
+#include <map>
+
+// Reports the images completed in the watched directories with inotify, the
+// directories are never rescanned
+class FolderWatcher
+{
+public:
+  FolderWatcher() = default;
+  ~FolderWatcher();
+
+  bool Add(const QString& path);
+  // Blocks until a new image arrives, then collects the images of the burst which arrive
+  // within batch_window ms, at most max_batch images
+  bool WaitForFiles(QStringList& files, int batch_window, int max_batch);
+
+protected:
+  bool ReadEvents(int timeout);
+
+  int Fd { -1 };
+  std::map<int, QString> Watches;
+  // Images reported by the kernel, but not returned yet
+  QStringList Pending;
+};
@@ -0,0 +1,270 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "framearchive.h"
+
+#include <MCLog.hpp>
+
+#include <QDateTime>
+#include <QDir>
+
+#include <algorithm>
+
+#include <string.h>
+
+namespace
+{
+struct ArchiveFileHeader
+{
+  char Magic[4];
+  uint32_t Version;
+  uint32_t RecordSize;
+  uint32_t Flags;
+};
+
+const char SegmentMagic[4] = { 'A', 'S', 'F', 'S' };
+const char IndexMagic[4] = { 'A', 'S', 'F', 'I' };
+const uint32_t ArchiveVersion = 1;
+const int64_t HeaderSize = sizeof(ArchiveFileHeader);
+const int64_t RecordSize = sizeof(ArchiveRecord);
+
+
+// The flags are written into a new file and read from an existing one
+bool CheckHeader(QFile& file, const char* magic, uint32_t& flags)
+{
+  ArchiveFileHeader Header;
+
+  // New file
+  if (file.size() == 0)
+  {
+    memcpy(Header.Magic, magic, 4);
+    Header.Version = ArchiveVersion;
+    Header.RecordSize = (uint32_t)RecordSize;
+    Header.Flags = flags;
+    return file.seek(0) && file.write(reinterpret_cast<const char*>(&Header), HeaderSize) == HeaderSize;
+  }
+  if (!file.seek(0) || file.read(reinterpret_cast<char*>(&Header), HeaderSize) != HeaderSize ||
+      memcmp(Header.Magic, magic, 4) != 0 || Header.Version != ArchiveVersion || Header.RecordSize != RecordSize)
+  {
+    MC_WARNING("Invalid archive file: %s", qPrintable(file.fileName()));
+    return false;
+  }
+  flags = Header.Flags;
+  return true;
+}
+}
+
+
+FrameArchive::FrameArchive(const QString& path) : Path(path)
+{
+}
+
+
+FrameArchive::~FrameArchive()
+{
+  Close();
+}
+
+
+bool FrameArchive::Append(const ArchiveRecord& record, const std::vector<unsigned char>& data)
+{
+  const QString FrameNight = GetNightName(record.Timestamp);
+
+  if (FrameNight != Night && !Open(FrameNight))
+    return false;
+
+  ArchiveRecord Record = record;
+
+  // The record in the segment allows to rebuild the index after a crash
+  Record.Offset = Segment.pos()+RecordSize;
+  Record.Size = (uint32_t)data.size();
+  if (Segment.write(reinterpret_cast<const char*>(&Record), RecordSize) != RecordSize ||
+      Segment.write(reinterpret_cast<const char*>(data.data()), data.size()) != (qint64)data.size() ||
+      !Segment.flush())
+  {
+    MC_WARNING("Unable to write the archive segment %s", qPrintable(Segment.fileName()));
+    Close();
+    return false;
+  }
+  // The index entry is written after the frame, it never points to missing data
+  if (Index.write(reinterpret_cast<const char*>(&Record), RecordSize) != RecordSize || !Index.flush())
+  {
+    MC_WARNING("Unable to write the archive index %s", qPrintable(Index.fileName()));
+    Close();
+    return false;
+  }
+  return true;
+}
+
+
+void FrameArchive::Close()
+{
+  if (Segment.isOpen())
+    Segment.close();
+
+  if (Index.isOpen())
+    Index.close();
+
+  Night.clear();
+}
+
+
+QString FrameArchive::GetNightName(int64_t timestamp)
+{
+  return QDateTime::fromMSecsSinceEpoch(timestamp).addSecs(-12*3600).toString("yyyyMMdd");
+}
+
+
+bool FrameArchive::Open(const QString& night)
+{
+  Close();
+  QDir().mkpath(Path);
+  Segment.setFileName(Path+"/allskycam_"+night+".frames");
+  Index.setFileName(Path+"/allskycam_"+night+".index");
+  uint32_t SegmentFlags = Flags;
+  uint32_t IndexFlags = Flags;
+
+  if (!Segment.open(QIODevice::ReadWrite) || !Index.open(QIODevice::ReadWrite) ||
+      !CheckHeader(Segment, SegmentMagic, SegmentFlags) || !CheckHeader(Index, IndexMagic, IndexFlags) || !Recover())
+  {
+    MC_WARNING("Unable to open the frame archive of %s", qPrintable(night));
+    Close();
+    return false;
+  }
+  Night = night;
+  MC_LOG("Frame archive: %s (%d frames)", qPrintable(Index.fileName()), (int)((Index.size()-HeaderSize) / RecordSize));
+  return true;
+}
+
+
+bool FrameArchive::Recover()
+{
+  // Drop a partially written index record and the entries beyond the segment
+  int64_t Count = (Index.size()-HeaderSize) / RecordSize;
+  int64_t End = HeaderSize;
+  ArchiveRecord Record;
+
+  while (Count > 0)
+  {
+    if (!Index.seek(HeaderSize+(Count-1)*RecordSize) ||
+        Index.read(reinterpret_cast<char*>(&Record), RecordSize) != RecordSize)
+    {
+      return false;
+    }
+    if ((int64_t)(Record.Offset+Record.Size) <= Segment.size())
+    {
+      End = Record.Offset+Record.Size;
+      break;
+    }
+    Count--;
+  }
+  if (!Index.resize(HeaderSize+Count*RecordSize) || !Index.seek(Index.size()))
+    return false;
+
+  // Index the frames written after the last index entry, cut a torn frame
+  while (Segment.seek(End) && Segment.read(reinterpret_cast<char*>(&Record), RecordSize) == RecordSize &&
+         (int64_t)Record.Offset == End+RecordSize && (int64_t)(Record.Offset+Record.Size) <= Segment.size())
+  {
+    if (Index.write(reinterpret_cast<const char*>(&Record), RecordSize) != RecordSize)
+      return false;
+
+    End = Record.Offset+Record.Size;
+  }
+  if (End < Segment.size())
+    MC_WARNING("Drop %d bytes from the end of %s", (int)(Segment.size()-End), qPrintable(Segment.fileName()));
+
+  return Segment.resize(End) && Segment.seek(End) && Index.flush();
+}
+
+
+FrameArchiveReader::~FrameArchiveReader()
+{
+  Close();
+}
+
+
+bool FrameArchiveReader::Open(const QString& index_filename)
+{
+  uint32_t SegmentFlags = 0;
+
+  Close();
+  Index.setFileName(index_filename);
+  Segment.setFileName(index_filename.left(index_filename.size()-6)+".frames");
+  if (!index_filename.endsWith(".index") || !Index.open(QIODevice::ReadOnly) || !Segment.open(QIODevice::ReadOnly) ||
+      !CheckHeader(Index, IndexMagic, Flags) || !CheckHeader(Segment, SegmentMagic, SegmentFlags))
+  {
+    Close();
+    return false;
+  }
+  Count = (int)((Index.size()-HeaderSize) / RecordSize);
+  if (Count > 0)
+  {
+    Mapping = Index.map(0, HeaderSize+Count*RecordSize);
+    if (Mapping == nullptr)
+    {
+      Close();
+      return false;
+    }
+    Records = reinterpret_cast<const ArchiveRecord*>(Mapping+HeaderSize);
+  }
+  return true;
+}
+
+
+void FrameArchiveReader::Close()
+{
+  if (Mapping != nullptr)
+    Index.unmap(Mapping);
+
+  if (Index.isOpen())
+    Index.close();
+
+  if (Segment.isOpen())
+    Segment.close();
+
+  Mapping = nullptr;
+  Records = nullptr;
+  Count = 0;
+  Flags = 0;
+}
+
+
+void FrameArchiveReader::FindRange(int64_t start, int64_t end, int& first, int& last) const
+{
+  // The frames are appended in time order
+  auto Compare = [](const ArchiveRecord& record, int64_t timestamp) { return record.Timestamp < timestamp; };
+
+  first = std::lower_bound(Records, Records+Count, start, Compare)-Records;
+  last = std::lower_bound(Records+first, Records+Count, end, Compare)-Records;
+}
+
+
+bool FrameArchiveReader::ReadFrame(int index, std::vector<unsigned char>& data)
+{
+  if (index < 0 || index >= Count)
+    return false;
+
+  const ArchiveRecord& Record = Records[index];
+
+  data.resize(Record.Size);
+  return Segment.seek(Record.Offset) &&
+         Segment.read(reinterpret_cast<char*>(data.data()), Record.Size) == (qint64)Record.Size;
+}
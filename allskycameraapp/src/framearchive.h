@@ -0,0 +1,115 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <QFile>
+#include <QString>
+
+#include <vector>
+
+#include <stdint.h>
+
+// Metadata of an archived frame, stored in the segment before the frame and in the index
+struct ArchiveRecord
+{
+  enum FrameLabel
+  {
+    Unlabeled = -1,
+    Clear = 0,
+    Clouds = 1,
+    Invalid = 2
+  };
+
+  // Milliseconds since the epoch
+  int64_t Timestamp;
+  // Position of the JPEG data in the segment
+  uint64_t Offset;
+  uint32_t Size;
+  int32_t Label;
+  float Probabilities[2];
+  int32_t ShutterTime;
+  int32_t Iso;
+  int32_t Brightness;
+  float SunArea;
+};
+
+// Flags of the night files
+enum ArchiveFlags
+{
+  // Downsized and recompressed by the housekeeping
+  ArchiveCompacted = 1
+};
+
+// Append-only archive with one segment and one index file per night:
+// allskycam_<night>.frames and allskycam_<night>.index in the archive directory.
+class FrameArchive
+{
+public:
+  explicit FrameArchive(const QString& path);
+  ~FrameArchive();
+
+  // Flags of the nights created from now on
+  void SetFlags(uint32_t flags) { Flags = flags; }
+
+  // The frame is appended to the segment of its night
+  bool Append(const ArchiveRecord& record, const std::vector<unsigned char>& data);
+  void Close();
+
+  // The night is named after its evening
+  static QString GetNightName(int64_t timestamp);
+
+protected:
+  bool Open(const QString& night);
+  bool Recover();
+
+  QString Path;
+  QString Night;
+  QFile Segment;
+  QFile Index;
+  uint32_t Flags { 0 };
+};
+
+// Read access to a night: the index is mapped into memory and searched by time
+class FrameArchiveReader
+{
+public:
+  FrameArchiveReader() = default;
+  ~FrameArchiveReader();
+
+  // The segment is opened next to the index file
+  bool Open(const QString& index_filename);
+  void Close();
+  int GetCount() const { return Count; }
+  uint32_t GetFlags() const { return Flags; }
+  const ArchiveRecord& GetRecord(int index) const { return Records[index]; }
+  // Frames in the [start, end) time range: first..last-1
+  void FindRange(int64_t start, int64_t end, int& first, int& last) const;
+  bool ReadFrame(int index, std::vector<unsigned char>& data);
+
+protected:
+  QFile Index;
+  QFile Segment;
+  uchar* Mapping { nullptr };
+  const ArchiveRecord* Records { nullptr };
+  int Count { 0 };
+  uint32_t Flags { 0 };
+};
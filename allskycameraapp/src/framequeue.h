@@ -0,0 +1,94 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+// Bounded queue between two pipeline stages. A full queue drops its oldest item,
+// the producer stage never waits for a slow consumer.
+template <typename T>
+class FrameQueue
+{
+public:
+  explicit FrameQueue(size_t capacity = 2) : Capacity(capacity) {}
+
+  // False if the oldest item was dropped for the new one
+  bool Push(T item)
+  {
+    bool Dropped = false;
+
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+
+      if (Items.size() >= Capacity)
+      {
+        Items.pop_front();
+        DropCount++;
+        Dropped = true;
+      }
+      Items.push_back(std::move(item));
+    }
+    Condition.notify_one();
+    return !Dropped;
+  }
+
+  // Blocks until an item arrives, false if the queue was closed
+  bool Pop(T& item)
+  {
+    std::unique_lock<std::mutex> Lock(Mutex);
+
+    Condition.wait(Lock, [this]() { return !Items.empty() || Closed; });
+    if (Items.empty())
+      return false;
+
+    item = std::move(Items.front());
+    Items.pop_front();
+    return true;
+  }
+
+  void Close()
+  {
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+
+      Closed = true;
+    }
+    Condition.notify_all();
+  }
+
+  int GetDropCount() const
+  {
+    std::lock_guard<std::mutex> Lock(Mutex);
+
+    return DropCount;
+  }
+
+protected:
+  mutable std::mutex Mutex;
+  std::condition_variable Condition;
+  std::deque<T> Items;
+  size_t Capacity;
+  bool Closed { false };
+  int DropCount { 0 };
+};
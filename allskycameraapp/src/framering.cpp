@@ -0,0 +1,325 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "framering.h"
+
+#include <MEImage.hpp>
+
+#include <MCLog.hpp>
+
+#include <new>
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace
+{
+const char RingMagic[4] = { 'A', 'S', 'C', 'R' };
+const uint32_t RingVersion = 1;
+// Every header and slot starts on its own cache line
+const size_t CacheLineSize = 64;
+
+
+size_t AlignToCacheLine(size_t size)
+{
+  return (size+CacheLineSize-1) / CacheLineSize*CacheLineSize;
+}
+
+
+int CreateAnonymousMemory()
+{
+  int Fd = -1;
+
+#if defined(SYS_memfd_create)
+  Fd = (int)syscall(SYS_memfd_create, "allskycam_frames", 0);
+  if (Fd >= 0)
+    return Fd;
+#endif
+  // Older kernels: unlinked POSIX shared memory
+  const QByteArray Name = QString("/allskycam_frames_%1").arg((int)getpid()).toLocal8Bit();
+
+  Fd = shm_open(Name.constData(), O_CREAT | O_EXCL | O_RDWR, 0600);
+
+  if (Fd >= 0)
+    shm_unlink(Name.constData());
+
+  return Fd;
+}
+}
+
+
+FrameRing::~FrameRing()
+{
+  Close();
+}
+
+
+bool FrameRing::Create(int slot_count, int slot_size, const QString& name)
+{
+  Close();
+  if (slot_count <= 0 || slot_size <= 0)
+    return false;
+
+  const size_t SlotStride = AlignToCacheLine(sizeof(FrameHeader))+AlignToCacheLine(slot_size);
+
+  Name = name;
+  Owner = true;
+  MappingSize = AlignToCacheLine(sizeof(RingHeader))+SlotStride*slot_count;
+  if (Name.isEmpty())
+  {
+    Fd = CreateAnonymousMemory();
+  } else {
+    // The segment of a crashed run is replaced, its readers keep the old mapping until they reopen the ring
+    shm_unlink(qPrintable("/"+Name));
+    Fd = shm_open(qPrintable("/"+Name), O_CREAT | O_EXCL | O_RDWR, 0644);
+  }
+  if (Fd < 0 || ftruncate(Fd, MappingSize) != 0)
+  {
+    MC_WARNING("Unable to create the shared frame memory (%d bytes)", (int)MappingSize);
+    Close();
+    return false;
+  }
+  void* Mapping = mmap(nullptr, MappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, Fd, 0);
+
+  if (Mapping == MAP_FAILED)
+  {
+    MC_WARNING("Unable to map the shared frame memory");
+    Close();
+    return false;
+  }
+  Memory = static_cast<unsigned char*>(Mapping);
+  memset(Memory, 0, AlignToCacheLine(sizeof(RingHeader)));
+  Header = new (Memory) RingHeader;
+  memcpy(Header->Magic, RingMagic, sizeof(RingMagic));
+  Header->Version = RingVersion;
+  Header->SlotCount = slot_count;
+  Header->SlotSize = slot_size;
+  Header->SlotStride = (uint32_t)SlotStride;
+  Header->WriteSequence.store(0);
+  for (int i = 0; i < slot_count; ++i)
+  {
+    new (GetSlot(i)) FrameHeader();
+  }
+  return true;
+}
+
+
+bool FrameRing::Open(const QString& name)
+{
+  struct stat Status;
+
+  Close();
+  Name = name;
+  Fd = shm_open(qPrintable("/"+Name), O_RDONLY, 0);
+  if (Fd < 0 || fstat(Fd, &Status) != 0 || Status.st_size < (off_t)AlignToCacheLine(sizeof(RingHeader)))
+  {
+    Close();
+    return false;
+  }
+  MappingSize = Status.st_size;
+  void* Mapping = mmap(nullptr, MappingSize, PROT_READ, MAP_SHARED, Fd, 0);
+
+  if (Mapping == MAP_FAILED)
+  {
+    Close();
+    return false;
+  }
+  Memory = static_cast<unsigned char*>(Mapping);
+  Header = reinterpret_cast<RingHeader*>(Memory);
+  if (memcmp(Header->Magic, RingMagic, sizeof(RingMagic)) != 0 || Header->Version != RingVersion ||
+      Header->SlotCount == 0 || AlignToCacheLine(sizeof(RingHeader))+(size_t)Header->SlotStride*Header->SlotCount > MappingSize)
+  {
+    MC_WARNING("Invalid shared frame memory: %s", qPrintable(name));
+    Close();
+    return false;
+  }
+  return true;
+}
+
+
+void FrameRing::Close()
+{
+  if (Memory != nullptr)
+    munmap(Memory, MappingSize);
+
+  if (Fd >= 0)
+    close(Fd);
+
+  if (Owner && !Name.isEmpty())
+    shm_unlink(qPrintable("/"+Name));
+
+  Name.clear();
+  Owner = false;
+  Fd = -1;
+  MappingSize = 0;
+  Memory = nullptr;
+  Header = nullptr;
+}
+
+
+FrameHeader* FrameRing::BeginWrite()
+{
+  if (!IsOpen())
+    return nullptr;
+
+  FrameHeader* Frame = GetSlot(Header->WriteSequence.load(std::memory_order_relaxed)+1);
+
+  // The slot is invalid until it is published, the data is written after the mark
+  Frame->Sequence.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  return Frame;
+}
+
+
+void FrameRing::EndWrite(FrameHeader* frame)
+{
+  const uint64_t Sequence = Header->WriteSequence.load(std::memory_order_relaxed)+1;
+
+  frame->Sequence.store(Sequence, std::memory_order_release);
+  Header->WriteSequence.store(Sequence, std::memory_order_release);
+}
+
+
+bool FrameRing::Publish(const MEImage& image, int64_t timestamp, int shutter_time, int iso)
+{
+  const int RowSize = image.GetWidth()*image.GetLayerCount();
+
+  if (!IsOpen() || image.GetLayerCount() != 3 || RowSize*image.GetHeight() > GetSlotSize())
+    return false;
+
+  const IplImage* Image = const_cast<MEImage&>(image).GetIplImage();
+  FrameHeader* Frame = BeginWrite();
+  unsigned char* Target = GetData(Frame);
+
+  for (int y = 0; y < image.GetHeight(); ++y)
+  {
+    memcpy(Target+y*RowSize, Image->imageData+y*Image->widthStep, RowSize);
+  }
+  Frame->Timestamp = timestamp;
+  Frame->Width = image.GetWidth();
+  Frame->Height = image.GetHeight();
+  Frame->Layers = 3;
+  Frame->Stride = RowSize;
+  Frame->Format = FrameHeader::Bgr;
+  Frame->ShutterTime = shutter_time;
+  Frame->Iso = iso;
+  Frame->DataSize = RowSize*image.GetHeight();
+  EndWrite(Frame);
+  return true;
+}
+
+
+const FrameHeader* FrameRing::GetLatest() const
+{
+  return GetFrame(GetSequence());
+}
+
+
+const FrameHeader* FrameRing::GetFrame(uint64_t sequence) const
+{
+  if (!IsOpen() || sequence == 0)
+    return nullptr;
+
+  const FrameHeader* Frame = GetSlot(sequence);
+
+  // Overwritten by a newer frame
+  return Frame->Sequence.load(std::memory_order_acquire) == sequence ? Frame : nullptr;
+}
+
+
+bool FrameRing::CheckFrame(const FrameHeader* frame, uint64_t sequence) const
+{
+  // The reads of the slot complete before the sequence is loaded again
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return frame->Sequence.load(std::memory_order_relaxed) == sequence;
+}
+
+
+unsigned char* FrameRing::GetData(FrameHeader* frame) const
+{
+  return reinterpret_cast<unsigned char*>(frame)+AlignToCacheLine(sizeof(FrameHeader));
+}
+
+
+const unsigned char* FrameRing::GetData(const FrameHeader* frame) const
+{
+  return reinterpret_cast<const unsigned char*>(frame)+AlignToCacheLine(sizeof(FrameHeader));
+}
+
+
+bool FrameRing::CopyToImage(const FrameHeader* frame, MEImage& image) const
+{
+  const uint64_t Sequence = frame != nullptr ? frame->Sequence.load(std::memory_order_acquire) : 0;
+
+  if (Sequence == 0 || frame->Layers != 3 || frame->Width <= 0 || frame->Height <= 0 ||
+      frame->Height*frame->Stride > GetSlotSize())
+  {
+    return false;
+  }
+  if (image.GetWidth() != frame->Width || image.GetHeight() != frame->Height || image.GetLayerCount() != frame->Layers)
+    image = MEImage(frame->Width, frame->Height, frame->Layers);
+
+  IplImage* Image = image.GetIplImage();
+  const unsigned char* Data = GetData(frame);
+
+  for (int y = 0; y < frame->Height; ++y)
+  {
+    const unsigned char* Source = Data+y*frame->Stride;
+    unsigned char* Target = reinterpret_cast<unsigned char*>(Image->imageData)+y*Image->widthStep;
+
+    if (frame->Format == FrameHeader::Bgr)
+    {
+      memcpy(Target, Source, frame->Width*3);
+      continue;
+    }
+    for (int x = 0; x < frame->Width*3; x += 3)
+    {
+      Target[x] = Source[x+2];
+      Target[x+1] = Source[x+1];
+      Target[x+2] = Source[x];
+    }
+  }
+  return CheckFrame(frame, Sequence);
+}
+
+
+uint64_t FrameRing::GetSequence() const
+{
+  return IsOpen() ? Header->WriteSequence.load(std::memory_order_acquire) : 0;
+}
+
+
+int FrameRing::GetSlotSize() const
+{
+  return IsOpen() ? (int)Header->SlotSize : 0;
+}
+
+
+FrameHeader* FrameRing::GetSlot(uint64_t sequence) const
+{
+  const size_t Offset = AlignToCacheLine(sizeof(RingHeader))+(sequence % Header->SlotCount)*Header->SlotStride;
+
+  return reinterpret_cast<FrameHeader*>(Memory+Offset);
+}
@@ -0,0 +1,107 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <QString>
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+class MEImage;
+
+// Header of one frame slot in the shared memory. The sequence number works as a
+// seqlock: it is 0 while the slot is written and the readers check it again after
+// they used the slot.
+struct FrameHeader
+{
+  enum PixelFormat
+  {
+    Bgr = 0,
+    Rgb = 1
+  };
+
+  std::atomic<uint64_t> Sequence;
+  int64_t Timestamp;
+  int32_t Width;
+  int32_t Height;
+  int32_t Layers;
+  int32_t Stride;
+  int32_t Format;
+  int32_t ShutterTime;
+  int32_t Iso;
+  int32_t DataSize;
+};
+
+// Ring of frame slots in a memfd/shm mapping. The producer fills the slot of
+// the next sequence number in place, the consumers map the same memory.
+class FrameRing
+{
+public:
+  FrameRing() = default;
+  ~FrameRing();
+
+  bool Create(int slot_count, int slot_size, const QString& name = QString());
+  // Read-only mapping of a named ring in another process
+  bool Open(const QString& name);
+  void Close();
+  bool IsOpen() const { return Header != nullptr; }
+
+  // The slot of the next frame, it is published by EndWrite()
+  FrameHeader* BeginWrite();
+  void EndWrite(FrameHeader* frame);
+  // BGR copy of the image in the next slot
+  bool Publish(const MEImage& image, int64_t timestamp, int shutter_time, int iso);
+  // Latest published frame or nullptr
+  const FrameHeader* GetLatest() const;
+  const FrameHeader* GetFrame(uint64_t sequence) const;
+  // Zero-copy reads: the header and the data of the frame were not overwritten while they were used
+  bool CheckFrame(const FrameHeader* frame, uint64_t sequence) const;
+  unsigned char* GetData(FrameHeader* frame) const;
+  const unsigned char* GetData(const FrameHeader* frame) const;
+  bool CopyToImage(const FrameHeader* frame, MEImage& image) const;
+  uint64_t GetSequence() const;
+  int GetSlotSize() const;
+  int GetFileDescriptor() const { return Fd; }
+
+protected:
+  struct RingHeader
+  {
+    char Magic[4];
+    uint32_t Version;
+    uint32_t SlotCount;
+    uint32_t SlotSize;
+    uint32_t SlotStride;
+    uint32_t Reserved;
+    std::atomic<uint64_t> WriteSequence;
+  };
+
+  FrameHeader* GetSlot(uint64_t sequence) const;
+
+  QString Name;
+  // The creator removes the named memory
+  bool Owner { false };
+  int Fd { -1 };
+  size_t MappingSize { 0 };
+  unsigned char* Memory { nullptr };
+  RingHeader* Header { nullptr };
+};
@@ -0,0 +1,304 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "ftpuploader.h"
+
+#include <MCLog.hpp>
+
+#include <QDateTime>
+#include <QStringList>
+#include <QTcpSocket>
+
+#include <algorithm>
+
+FtpUploader::FtpUploader(const QString& server, const QString& user, const QString& password, const QString& remote_file) :
+  Host(server.section(':', 0, 0)), User(user), Password(password), RemoteFile(remote_file)
+{
+  if (server.contains(':'))
+    Port = server.section(':', 1, 1).toInt();
+}
+
+
+FtpUploader::~FtpUploader()
+{
+  Stop();
+}
+
+
+void FtpUploader::Start()
+{
+  if (Running)
+    return;
+
+  Running = true;
+  Worker = std::thread(&FtpUploader::Run, this);
+}
+
+
+void FtpUploader::Stop()
+{
+  {
+    std::lock_guard<std::mutex> Lock(Mutex);
+
+    if (!Running)
+      return;
+
+    Running = false;
+  }
+  Condition.notify_all();
+  Worker.join();
+}
+
+
+void FtpUploader::Upload(const ImageBuffer& data)
+{
+  {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    Frame NewFrame;
+
+    // A failed frame is stale when a newer one is available
+    while (!Frames.empty() && (Frames.front().Attempts > 0 || Frames.size() >= MaxQueued))
+    {
+      Frames.pop_front();
+      Dropped++;
+    }
+    NewFrame.Data = data;
+    NewFrame.QueueTime = QDateTime::currentMSecsSinceEpoch();
+    NewFrame.Attempts = 0;
+    Frames.push_back(std::move(NewFrame));
+  }
+  Condition.notify_all();
+}
+
+
+void FtpUploader::LogStats() const
+{
+  std::lock_guard<std::mutex> Lock(Mutex);
+
+  MC_LOG("FTP uploads: %d failures: %d dropped: %d connections: %d bytes: %lld", Uploads, Failures, Dropped, Connections,
+         (long long)Bytes);
+  if (Uploads > 0)
+  {
+    MC_LOG("FTP upload latency - last: %d ms average: %d ms max: %d ms", LastLatency, (int)(TotalLatency / Uploads),
+           MaxLatency);
+  }
+}
+
+
+void FtpUploader::Run()
+{
+  // The socket belongs to the thread which uses it
+  Control.reset(new QTcpSocket());
+  while (true)
+  {
+    Frame Current;
+
+    {
+      std::unique_lock<std::mutex> Lock(Mutex);
+
+      Condition.wait(Lock, [this]() { return !Frames.empty() || !Running; });
+      if (!Running)
+        break;
+
+      // Wait before a retry unless a newer frame arrives
+      if (Frames.front().Attempts > 0)
+      {
+        Condition.wait_for(Lock, std::chrono::milliseconds(RetryDelay), [this]() { return Frames.size() > 1 || !Running; });
+        if (!Running)
+          break;
+
+        while (Frames.size() > 1)
+        {
+          Frames.pop_front();
+          Dropped++;
+        }
+      }
+      Current = std::move(Frames.front());
+      Frames.pop_front();
+    }
+    const bool Success = Send(Current);
+    const int Latency = (int)(QDateTime::currentMSecsSinceEpoch()-Current.QueueTime);
+    std::lock_guard<std::mutex> Lock(Mutex);
+
+    if (Success)
+    {
+      Uploads++;
+      Bytes += Current.Data->size();
+      LastLatency = Latency;
+      TotalLatency += Latency;
+      MaxLatency = std::max(MaxLatency, Latency);
+      MC_LOG("Image uploaded (%d bytes, %d ms)", (int)Current.Data->size(), Latency);
+      continue;
+    }
+    Failures++;
+    Current.Attempts++;
+    // Retry only if there is no newer frame
+    if (Current.Attempts < MaxAttempts && Frames.empty())
+    {
+      MC_WARNING("Upload failed, retry in %d ms (attempt %d)", RetryDelay, Current.Attempts);
+      Frames.push_front(std::move(Current));
+    } else {
+      MC_WARNING("Upload failed, frame dropped");
+      Dropped++;
+    }
+  }
+  Disconnect();
+  Control.reset();
+}
+
+
+bool FtpUploader::Send(const Frame& frame)
+{
+  // Reconnect once if the server closed the idle connection
+  if (Control->state() == QAbstractSocket::ConnectedState && !SendCommand("NOOP", 2))
+    Disconnect();
+
+  if (Control->state() != QAbstractSocket::ConnectedState && !Login())
+  {
+    Disconnect();
+    return false;
+  }
+  QByteArray Reply;
+
+  // Passive mode: 227 Entering Passive Mode (h1,h2,h3,h4,p1,p2)
+  if (!SendCommand("PASV", 2, &Reply))
+  {
+    Disconnect();
+    return false;
+  }
+  const QStringList Address = QString::fromLatin1(Reply.mid(Reply.indexOf('(')+1, Reply.indexOf(')')-Reply.indexOf('(')-1)).split(',');
+
+  if (Address.size() != 6)
+  {
+    MC_WARNING("Invalid FTP passive reply: %s", Reply.constData());
+    Disconnect();
+    return false;
+  }
+  QTcpSocket Data;
+
+  Data.connectToHost(QStringList(Address.mid(0, 4)).join('.'), (quint16)(Address[4].toInt()*256+Address[5].toInt()));
+  if (!Data.waitForConnected(Timeout))
+  {
+    MC_WARNING("Unable to open the FTP data connection: %s", qPrintable(Data.errorString()));
+    Disconnect();
+    return false;
+  }
+  if (!SendCommand("STOR "+RemoteFile.toUtf8(), 1))
+  {
+    Data.abort();
+    Disconnect();
+    return false;
+  }
+  Data.write(reinterpret_cast<const char*>(frame.Data->data()), frame.Data->size());
+  while (Data.bytesToWrite() > 0)
+  {
+    if (!Data.waitForBytesWritten(Timeout))
+    {
+      MC_WARNING("FTP data transfer timeout");
+      Data.abort();
+      Disconnect();
+      return false;
+    }
+  }
+  // The end of the file is the end of the data connection
+  Data.disconnectFromHost();
+  if (Data.state() != QAbstractSocket::UnconnectedState)
+    Data.waitForDisconnected(Timeout);
+
+  // 226 Transfer complete
+  if (ReadReply() / 100 != 2)
+  {
+    Disconnect();
+    return false;
+  }
+  return true;
+}
+
+
+bool FtpUploader::Login()
+{
+  Control->connectToHost(Host, (quint16)Port);
+  if (!Control->waitForConnected(Timeout))
+  {
+    MC_WARNING("Unable to connect to %s:%d: %s", qPrintable(Host), Port, qPrintable(Control->errorString()));
+    return false;
+  }
+  // 220 greeting, 331 password required, 230 logged in, 200 binary mode
+  if (ReadReply() / 100 != 2 || !SendCommand("USER "+User.toUtf8(), 3) || !SendCommand("PASS "+Password.toUtf8(), 2) ||
+      !SendCommand("TYPE I", 2))
+  {
+    MC_WARNING("FTP login failed on %s", qPrintable(Host));
+    return false;
+  }
+  Connections++;
+  return true;
+}
+
+
+void FtpUploader::Disconnect()
+{
+  if (Control->state() == QAbstractSocket::ConnectedState)
+  {
+    Control->write("QUIT\r\n");
+    Control->waitForBytesWritten(1000);
+  }
+  Control->abort();
+}
+
+
+bool FtpUploader::SendCommand(const QByteArray& command, int expected_class, QByteArray* reply)
+{
+  Control->write(command+"\r\n");
+  if (!Control->waitForBytesWritten(Timeout))
+    return false;
+
+  const int Code = ReadReply(reply);
+
+  if (Code / 100 != expected_class)
+  {
+    // Do not log the password
+    MC_WARNING("FTP command %s failed (%d)", command.startsWith("PASS") ? "PASS" : command.constData(), Code);
+    return false;
+  }
+  return true;
+}
+
+
+int FtpUploader::ReadReply(QByteArray* reply)
+{
+  while (true)
+  {
+    while (!Control->canReadLine())
+    {
+      if (!Control->waitForReadyRead(Timeout))
+        return -1;
+    }
+    const QByteArray Line = Control->readLine();
+
+    // The multi-line replies end with "<code> <text>"
+    if (Line.size() >= 4 && Line[3] == ' ')
+    {
+      if (reply != nullptr)
+        *reply = Line;
+      return Line.left(3).toInt();
+    }
+  }
+}
@@ -0,0 +1,101 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include "encoder.h"
+
+#include <QByteArray>
+#include <QString>
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+
+class QTcpSocket;
+
+// Passive mode FTP upload in a background thread. The control connection is kept
+// open between the frames and it is reopened only after an error.
+class FtpUploader
+{
+public:
+  // host[:port]
+  FtpUploader(const QString& server, const QString& user, const QString& password, const QString& remote_file);
+  ~FtpUploader();
+
+  void Start();
+  void Stop();
+  // Queue a compressed frame, the pending retries of older frames are dropped
+  void Upload(const ImageBuffer& data);
+  void LogStats() const;
+
+  // Frames waiting for the upload
+  size_t MaxQueued { 2 };
+  // Uploads of a frame before it is dropped
+  int MaxAttempts { 3 };
+  // Delay before a retry (ms)
+  int RetryDelay { 5000 };
+  // Timeout of the connection and the replies (ms)
+  int Timeout { 20000 };
+
+protected:
+  struct Frame
+  {
+    ImageBuffer Data;
+    int64_t QueueTime;
+    int Attempts;
+  };
+
+  void Run();
+  bool Send(const Frame& frame);
+  bool Login();
+  void Disconnect();
+  bool SendCommand(const QByteArray& command, int expected_class, QByteArray* reply = nullptr);
+  int ReadReply(QByteArray* reply = nullptr);
+
+  QString Host;
+  int Port { 21 };
+  QString User;
+  QString Password;
+  QString RemoteFile;
+  std::unique_ptr<QTcpSocket> Control;
+
+  mutable std::mutex Mutex;
+  std::condition_variable Condition;
+  std::deque<Frame> Frames;
+  std::thread Worker;
+  bool Running { false };
+
+  // Statistics
+  int Uploads { 0 };
+  int Failures { 0 };
+  int Dropped { 0 };
+  int Connections { 0 };
+  int64_t Bytes { 0 };
+  int64_t TotalLatency { 0 };
+  int LastLatency { 0 };
+  int MaxLatency { 0 };
+};
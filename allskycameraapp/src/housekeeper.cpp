@@ -0,0 +1,434 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+
+#include "housekeeper.h"
+#include "direnumerator.h"
+#include "framearchive.h"
+
+#include <MCLog.hpp>
+
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/statvfs.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace
+{
+// ioprio_set() has no glibc wrapper
+const int IoprioWhoProcess = 1;
+const int IoprioClassIdle = 3;
+const int IoprioClassShift = 13;
+// The frames wider than this are halved in the JPEG decoder
+const int MinCompactWidth = 320;
+const int CompactQuality = 75;
+
+
+int64_t GetTime()
+{
+  return QDateTime::currentMSecsSinceEpoch();
+}
+
+
+void SyncFile(const QString& filename)
+{
+  const int Fd = open(qPrintable(filename), O_RDONLY | O_CLOEXEC);
+
+  if (Fd >= 0)
+  {
+    fsync(Fd);
+    close(Fd);
+  }
+}
+}
+
+
+Housekeeper::Housekeeper(const QString& path, int age_days, int bytes_per_second) :
+  Path(path), TempPath(path+"/.housekeeping"), AgeDays(std::max(age_days, 1)), BytesPerSecond(std::max(bytes_per_second, 4096))
+{
+}
+
+
+Housekeeper::~Housekeeper()
+{
+  Stop();
+}
+
+
+void Housekeeper::Start()
+{
+  Stopping = false;
+  Worker = std::thread(&Housekeeper::Run, this);
+}
+
+
+void Housekeeper::Stop()
+{
+  {
+    std::lock_guard<std::mutex> Lock(Mutex);
+
+    Stopping = true;
+  }
+  Condition.notify_all();
+  if (Worker.joinable())
+    Worker.join();
+}
+
+
+void Housekeeper::Trigger()
+{
+  {
+    std::lock_guard<std::mutex> Lock(Mutex);
+
+    Triggered = true;
+  }
+  Condition.notify_all();
+}
+
+
+void Housekeeper::SetBusy(bool busy)
+{
+  {
+    std::lock_guard<std::mutex> Lock(Mutex);
+
+    BusyCount += busy ? 1 : -1;
+  }
+  Condition.notify_all();
+}
+
+
+void Housekeeper::Run()
+{
+  // The thread gets disk time only when no other process needs it
+  if (syscall(SYS_ioprio_set, IoprioWhoProcess, 0, IoprioClassIdle << IoprioClassShift) != 0)
+    MC_WARNING("Unable to set the idle I/O priority of the housekeeping");
+
+  while (true)
+  {
+    {
+      std::unique_lock<std::mutex> Lock(Mutex);
+
+      Condition.wait(Lock, [this]() { return Triggered || Stopping; });
+      if (Stopping)
+        return;
+
+      Triggered = false;
+    }
+    RunPass();
+  }
+}
+
+
+void Housekeeper::RunPass()
+{
+  const int64_t StartTime = GetTime();
+  const QString OldestNight = FrameArchive::GetNightName(StartTime-(int64_t)AgeDays*24*3600*1000);
+  const QStringList Indexes = QDir(Path).entryList(QStringList() << "allskycam_*.index", QDir::Files, QDir::Name);
+  const char* LabelDirs[] = { "", "/clear", "/clouds", "/invalid" };
+  const int Labels[] = { ArchiveRecord::Unlabeled, ArchiveRecord::Clear, ArchiveRecord::Clouds, ArchiveRecord::Invalid };
+  std::map<QString, std::vector<LooseFrame>> LooseNights;
+
+  BytesRead = 0;
+  BytesWritten = 0;
+  CompactedNights = 0;
+  MigratedFiles = 0;
+  BudgetStart = StartTime;
+  BudgetBytes = 0;
+  // Complete the commit of an interrupted pass, the unfinished nights are done again
+  for (auto& filename : QDir(Path).entryList(QStringList() << "allskycam_*.compacted", QDir::Files, QDir::Name))
+  {
+    FinishCommit(Path+'/'+filename.section('.', 0, 0));
+  }
+  QDir(TempPath).removeRecursively();
+
+  // A night with an unreadable frame is skipped, a stop or a write error ends the pass
+  for (auto& filename : Indexes)
+  {
+    const QString Night = filename.mid(10, 8);
+
+    if (Night >= OldestNight)
+      break;
+
+    if (!CompactNight(Night))
+      break;
+  }
+  // Loose files of the older versions and of the exports
+  for (int i = 0; i < 4; ++i)
+  {
+    DirectoryEnumerator Files;
+    QString Filename;
+
+    if (!QDir(Path+LabelDirs[i]).exists() || !Files.Open(Path+LabelDirs[i]))
+      continue;
+
+    while (Files.Next(Filename))
+    {
+      const QString Name = Filename.section('/', -1, -1);
+      const QDateTime Time = QDateTime::fromString(Name.mid(10, 13), "yyyyMMdd_HHmm");
+      const QString Night = Time.isValid() ? FrameArchive::GetNightName(Time.toMSecsSinceEpoch()) : QString();
+
+      // New frames are not appended to an existing night, the index would not be ordered by time
+      if (!Name.startsWith("allskycam_") || Night.isEmpty() || Night >= OldestNight ||
+          QFile::exists(Path+"/allskycam_"+Night+".index"))
+        continue;
+
+      LooseNights[Night].push_back({ Time.toMSecsSinceEpoch(), Filename, Labels[i] });
+    }
+  }
+  for (auto& night : LooseNights)
+  {
+    if (!MigrateNight(night.first, night.second))
+      break;
+  }
+  if (CompactedNights > 0 || MigratedFiles > 0)
+    LogDiskUsage(GetTime()-StartTime);
+}
+
+
+bool Housekeeper::CompactNight(const QString& night)
+{
+  FrameArchiveReader Reader;
+  FrameArchive Target(TempPath);
+  std::vector<unsigned char> Data;
+
+  if (!Reader.Open(Path+"/allskycam_"+night+".index"))
+    return true;
+
+  if (Reader.GetFlags() & ArchiveCompacted)
+    return true;
+
+  Target.SetFlags(ArchiveCompacted);
+  for (int i = 0; i < Reader.GetCount(); ++i)
+  {
+    if (!WaitForIdle())
+      return false;
+
+    if (!Reader.ReadFrame(i, Data))
+    {
+      MC_WARNING("Unable to read frame %d of night %s, the night is skipped", i, qPrintable(night));
+      Target.Close();
+      QFile::remove(TempPath+"/allskycam_"+night+".frames");
+      QFile::remove(TempPath+"/allskycam_"+night+".index");
+      return true;
+    }
+    Throttle(Data.size());
+    BytesRead += Data.size();
+
+    const std::vector<unsigned char>& Frame = CompactFrame(Data);
+
+    if (!Target.Append(Reader.GetRecord(i), Frame))
+      return false;
+
+    Throttle(Frame.size());
+    BytesWritten += Frame.size();
+  }
+  Target.Close();
+  Reader.Close();
+  if (!CommitNight(night))
+    return false;
+
+  CompactedNights++;
+  return true;
+}
+
+
+bool Housekeeper::MigrateNight(const QString& night, std::vector<LooseFrame>& frames)
+{
+  FrameArchive Target(TempPath);
+  std::vector<unsigned char> Data;
+  // The original names of the migrated frames in the record order, the dataset
+  // packer does not pack a frame again which it packed as a file
+  QFile Sources(TempPath+"/allskycam_"+night+".sources");
+  QStringList Migrated;
+
+  std::sort(frames.begin(), frames.end(), [](const LooseFrame& frame1, const LooseFrame& frame2)
+  {
+    return frame1.Timestamp < frame2.Timestamp;
+  });
+  Target.SetFlags(ArchiveCompacted);
+  if (!QDir().mkpath(TempPath) || !Sources.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    return false;
+
+  for (auto& frame : frames)
+  {
+    QFile File(frame.Filename);
+    ArchiveRecord Record = {};
+
+    if (!WaitForIdle())
+      return false;
+
+    // An unreadable file stays in place
+    if (!File.open(QIODevice::ReadOnly))
+      continue;
+
+    const QByteArray Content = File.readAll();
+
+    Data.assign(Content.constData(), Content.constData()+Content.size());
+    Throttle(Data.size());
+    BytesRead += Data.size();
+    Record.Timestamp = frame.Timestamp;
+    Record.Label = frame.Label;
+
+    const std::vector<unsigned char>& Frame = CompactFrame(Data);
+
+    if (!Target.Append(Record, Frame) ||
+        Sources.write(QDir(Path).relativeFilePath(frame.Filename).toLocal8Bit()+'\n') < 0)
+      return false;
+
+    Throttle(Frame.size());
+    BytesWritten += Frame.size();
+    Migrated << frame.Filename;
+  }
+  Target.Close();
+  Sources.close();
+  // No readable file, the night is skipped
+  if (Migrated.isEmpty())
+  {
+    QFile::remove(Sources.fileName());
+    return true;
+  }
+  if (!CommitNight(night))
+    return false;
+
+  // The files are removed only after the archive of the night is in place
+  for (auto& filename : Migrated)
+  {
+    QFile::remove(filename);
+  }
+  MigratedFiles += Migrated.size();
+  return true;
+}
+
+
+bool Housekeeper::CommitNight(const QString& night)
+{
+  const QString TempBase = TempPath+"/allskycam_"+night;
+  const QString Base = Path+"/allskycam_"+night;
+
+  // The segment and the index appear complete next to the night, the index last
+  SyncFile(TempBase+".frames");
+  SyncFile(TempBase+".index");
+  // The names of the migrated frames are in place before the index
+  if (QFile::exists(TempBase+".sources"))
+  {
+    SyncFile(TempBase+".sources");
+    if (rename(qPrintable(TempBase+".sources"), qPrintable(Base+".sources")) != 0)
+    {
+      MC_WARNING("Unable to commit the housekeeping of night %s", qPrintable(night));
+      return false;
+    }
+  }
+  if (rename(qPrintable(TempBase+".frames"), qPrintable(Base+".frames.compacted")) != 0 ||
+      rename(qPrintable(TempBase+".index"), qPrintable(Base+".index.compacted")) != 0)
+  {
+    MC_WARNING("Unable to commit the housekeeping of night %s", qPrintable(night));
+    return false;
+  }
+  FinishCommit(Base);
+  return true;
+}
+
+
+void Housekeeper::FinishCommit(const QString& base)
+{
+  // Without the index the segment is incomplete
+  if (!QFile::exists(base+".index.compacted"))
+  {
+    QFile::remove(base+".frames.compacted");
+    return;
+  }
+  if (QFile::exists(base+".frames.compacted"))
+    rename(qPrintable(base+".frames.compacted"), qPrintable(base+".frames"));
+
+  rename(qPrintable(base+".index.compacted"), qPrintable(base+".index"));
+}
+
+
+const std::vector<unsigned char>& Housekeeper::CompactFrame(const std::vector<unsigned char>& data)
+{
+  // Half resolution directly from the DCT coefficients
+  const cv::Mat Frame = cv::imdecode(data, cv::IMREAD_REDUCED_COLOR_2);
+  const std::vector<int> Parameters = { cv::IMWRITE_JPEG_QUALITY, CompactQuality };
+
+  // The thumbnails and the small frames are kept
+  if (Frame.empty() || Frame.cols*2 <= MinCompactWidth || !cv::imencode(".jpg", Frame, Compacted, Parameters) ||
+      Compacted.size() >= data.size())
+    return data;
+
+  return Compacted;
+}
+
+
+bool Housekeeper::WaitForIdle()
+{
+  std::unique_lock<std::mutex> Lock(Mutex);
+
+  if (BusyCount > 0)
+  {
+    Condition.wait(Lock, [this]() { return BusyCount == 0 || Stopping; });
+    // The budget does not accumulate during a pause
+    BudgetStart = GetTime();
+    BudgetBytes = 0;
+  }
+  return !Stopping;
+}
+
+
+void Housekeeper::Throttle(int64_t bytes)
+{
+  BudgetBytes += bytes;
+
+  const int64_t Wait = BudgetBytes*1000 / BytesPerSecond-(GetTime()-BudgetStart);
+  std::unique_lock<std::mutex> Lock(Mutex);
+
+  if (Wait > 0)
+    Condition.wait_for(Lock, std::chrono::milliseconds(Wait), [this]() { return Stopping; });
+}
+
+
+void Housekeeper::LogDiskUsage(int64_t elapsed)
+{
+  struct statvfs Stat;
+
+  MC_LOG("Housekeeping: %d nights compacted, %d files migrated, %lld bytes read, %lld bytes written in %d s (%1.1f KB/s)",
+         CompactedNights, MigratedFiles, (long long)BytesRead, (long long)BytesWritten, (int)(elapsed / 1000),
+         elapsed > 0 ? (float)(BytesRead+BytesWritten) / elapsed*1000 / 1024 : 0.0);
+  if (statvfs(qPrintable(Path), &Stat) == 0)
+  {
+    const double Total = (double)Stat.f_blocks*Stat.f_frsize;
+    const double Free = (double)Stat.f_bavail*Stat.f_frsize;
+
+    MC_LOG("Disk usage of %s: %1.0f MB free of %1.0f MB (%1.1f %% used)", qPrintable(Path), Free / 1048576,
+           Total / 1048576, Total > 0 ? (1-Free / Total)*100 : 0.0);
+  }
+}
@@ -0,0 +1,108 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+
+#pragma once
+
+#include <QString>
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+
+// Background housekeeping of the image path with the idle I/O priority: the
+// night archives older than the given age are downsized and recompressed, the
+// loose JPEG files of the older versions are moved into night archives. The
+// disk I/O is limited to a byte budget and waits during the captures and the
+// encoding.
+class Housekeeper
+{
+public:
+  Housekeeper(const QString& path, int age_days, int bytes_per_second);
+  ~Housekeeper();
+
+  void Start();
+  void Stop();
+  // Starts a housekeeping pass in the background
+  void Trigger();
+  void SetBusy(bool busy);
+
+protected:
+  struct LooseFrame
+  {
+    int64_t Timestamp;
+    QString Filename;
+    int Label;
+  };
+
+  void Run();
+  void RunPass();
+  bool CompactNight(const QString& night);
+  bool MigrateNight(const QString& night, std::vector<LooseFrame>& frames);
+  bool CommitNight(const QString& night);
+  void FinishCommit(const QString& base);
+  const std::vector<unsigned char>& CompactFrame(const std::vector<unsigned char>& data);
+  bool WaitForIdle();
+  void Throttle(int64_t bytes);
+  void LogDiskUsage(int64_t elapsed);
+
+  QString Path;
+  QString TempPath;
+  int AgeDays { 30 };
+  int BytesPerSecond { 1048576 };
+  std::thread Worker;
+  std::mutex Mutex;
+  std::condition_variable Condition;
+  bool Triggered { false };
+  bool Stopping { false };
+  int BusyCount { 0 };
+  // Byte budget since the last pause
+  int64_t BudgetStart { 0 };
+  int64_t BudgetBytes { 0 };
+  // Statistics of the current pass
+  int64_t BytesRead { 0 };
+  int64_t BytesWritten { 0 };
+  int CompactedNights { 0 };
+  int MigratedFiles { 0 };
+  std::vector<unsigned char> Compacted;
+};
+
+// Marks a capture or an encoding for the housekeeping
+class HousekeepingPause
+{
+public:
+  explicit HousekeepingPause(Housekeeper* keeper) : Keeper(keeper)
+  {
+    if (Keeper != nullptr)
+      Keeper->SetBusy(true);
+  }
+  ~HousekeepingPause()
+  {
+    if (Keeper != nullptr)
+      Keeper->SetBusy(false);
+  }
+
+protected:
+  Housekeeper* Keeper;
+};
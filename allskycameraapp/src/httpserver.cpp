@@ -0,0 +1,432 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+
+#include "httpserver.h"
+
+#include <MCLog.hpp>
+
+#include <QDateTime>
+
+#include <vector>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace
+{
+const int MaxEvents = 64;
+// Period of the timeout checks (ms)
+const int SweepPeriod = 1000;
+const int MaxRequestSize = 8192;
+const char Boundary[] = "allskyframe";
+
+
+void AddPart(iovec* parts, int& count, size_t& offset, const void* data, size_t size)
+{
+  if (offset >= size)
+  {
+    offset -= size;
+    return;
+  }
+  parts[count].iov_base = const_cast<char*>(static_cast<const char*>(data))+offset;
+  parts[count].iov_len = size-offset;
+  count++;
+  offset = 0;
+}
+}
+
+
+HttpServer::HttpServer(int port) : Port(port)
+{
+}
+
+
+HttpServer::~HttpServer()
+{
+  Stop();
+}
+
+
+bool HttpServer::Start()
+{
+  if (Running)
+    return true;
+
+  sockaddr_in Address;
+  const int ReuseAddress = 1;
+  epoll_event Event = {};
+
+  memset(&Address, 0, sizeof(Address));
+  Address.sin_family = AF_INET;
+  Address.sin_addr.s_addr = htonl(INADDR_ANY);
+  Address.sin_port = htons((uint16_t)Port);
+  ListenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  EpollFd = epoll_create1(EPOLL_CLOEXEC);
+  WakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (ListenFd < 0 || EpollFd < 0 || WakeFd < 0 ||
+      setsockopt(ListenFd, SOL_SOCKET, SO_REUSEADDR, &ReuseAddress, sizeof(ReuseAddress)) != 0 ||
+      bind(ListenFd, reinterpret_cast<sockaddr*>(&Address), sizeof(Address)) != 0 || listen(ListenFd, SOMAXCONN) != 0)
+  {
+    MC_WARNING("Unable to start the HTTP server on port %d (%s)", Port, strerror(errno));
+    Stop();
+    return false;
+  }
+  Event.events = EPOLLIN;
+  Event.data.fd = ListenFd;
+  epoll_ctl(EpollFd, EPOLL_CTL_ADD, ListenFd, &Event);
+  Event.data.fd = WakeFd;
+  epoll_ctl(EpollFd, EPOLL_CTL_ADD, WakeFd, &Event);
+  Running = true;
+  Worker = std::thread(&HttpServer::Run, this);
+  MC_LOG("HTTP server on port %d", Port);
+  return true;
+}
+
+
+void HttpServer::Stop()
+{
+  const uint64_t Wake = 1;
+
+  if (Running)
+  {
+    Running = false;
+    if (write(WakeFd, &Wake, sizeof(Wake)) != sizeof(Wake))
+      MC_WARNING("Unable to wake up the HTTP server");
+
+    Worker.join();
+  }
+  while (!Clients.empty())
+  {
+    CloseClient(Clients.begin()->first);
+  }
+  for (int* Fd : { &ListenFd, &EpollFd, &WakeFd })
+  {
+    if (*Fd >= 0)
+      close(*Fd);
+
+    *Fd = -1;
+  }
+}
+
+
+void HttpServer::Publish(const ImageBuffer& jpeg, const QByteArray& status)
+{
+  const uint64_t Wake = 1;
+
+  {
+    std::lock_guard<std::mutex> Lock(Mutex);
+
+    Latest = jpeg;
+    Status = status;
+    Sequence++;
+  }
+  if (Running && write(WakeFd, &Wake, sizeof(Wake)) != sizeof(Wake))
+    MC_WARNING("Unable to wake up the HTTP server");
+}
+
+
+void HttpServer::Run()
+{
+  epoll_event Events[MaxEvents];
+
+  while (Running)
+  {
+    const int Count = epoll_wait(EpollFd, Events, MaxEvents, SweepPeriod);
+
+    if (Count < 0 && errno != EINTR)
+    {
+      MC_WARNING("HTTP server stopped (%s)", strerror(errno));
+      break;
+    }
+    for (int i = 0; i < Count; ++i)
+    {
+      const int Fd = Events[i].data.fd;
+
+      if (Fd == ListenFd)
+      {
+        Accept();
+        continue;
+      }
+      if (Fd == WakeFd)
+      {
+        uint64_t Value = 0;
+
+        if (read(WakeFd, &Value, sizeof(Value)) != sizeof(Value))
+          continue;
+
+        // The idle stream clients get the new frame, the busy ones continue with it later
+        for (auto& Item : Clients)
+        {
+          if (Item.second.Streaming && !Item.second.Writing && !Item.second.Closed && !Flush(Item.second))
+            Item.second.Closed = true;
+        }
+        continue;
+      }
+      auto Item = Clients.find(Fd);
+
+      if (Item == Clients.end() || Item->second.Closed)
+        continue;
+
+      if ((Events[i].events & (EPOLLERR | EPOLLHUP)) ||
+          ((Events[i].events & (EPOLLIN | EPOLLRDHUP)) && !Read(Item->second)) ||
+          ((Events[i].events & EPOLLOUT) && !Flush(Item->second)))
+      {
+        Item->second.Closed = true;
+      }
+    }
+    // Stuck requests and stalled stream clients
+    const int64_t Now = QDateTime::currentMSecsSinceEpoch();
+
+    std::vector<int> Closed;
+
+    for (auto& Item : Clients)
+    {
+      const Client& Current = Item.second;
+
+      if (Current.Closed || (Current.Writing && Now-Current.LastActivity > StreamTimeout) ||
+          (!Current.Streaming && Current.Head.isEmpty() && Now-Current.LastActivity > RequestTimeout))
+      {
+        Closed.push_back(Item.first);
+      }
+    }
+    // The descriptors are closed after the batch, accept4 cannot reuse one of them for a later event of it
+    for (int Fd : Closed)
+    {
+      CloseClient(Fd);
+    }
+  }
+}
+
+
+void HttpServer::Accept()
+{
+  while (true)
+  {
+    const int Fd = accept4(ListenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if (Fd < 0)
+      return;
+
+    if ((int)Clients.size() >= MaxClients)
+    {
+      close(Fd);
+      continue;
+    }
+    epoll_event Event = {};
+    Client& NewClient = Clients[Fd];
+
+    Event.events = EPOLLIN | EPOLLRDHUP;
+    Event.data.fd = Fd;
+    epoll_ctl(EpollFd, EPOLL_CTL_ADD, Fd, &Event);
+    NewClient.Fd = Fd;
+    NewClient.LastActivity = QDateTime::currentMSecsSinceEpoch();
+    ClientCount = (int)Clients.size();
+  }
+}
+
+
+bool HttpServer::Read(Client& client)
+{
+  char Buffer[4096];
+
+  while (true)
+  {
+    const ssize_t Bytes = recv(client.Fd, Buffer, sizeof(Buffer), 0);
+
+    if (Bytes == 0)
+      return false;
+
+    if (Bytes < 0)
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+    // Only one request per connection, the rest is ignored
+    if (client.Streaming || !client.Head.isEmpty())
+      continue;
+
+    client.Request.append(Buffer, (int)Bytes);
+    if (client.Request.indexOf("\r\n\r\n") >= 0)
+      return HandleRequest(client);
+
+    if (client.Request.size() > MaxRequestSize)
+      return false;
+  }
+}
+
+
+bool HttpServer::Flush(Client& client)
+{
+  while (true)
+  {
+    const size_t BodySize = client.Body.get() ? client.Body->size() : 0;
+    const size_t TailSize = strlen(client.Tail);
+
+    if (client.Sent >= client.Head.size()+BodySize+TailSize)
+    {
+      client.Head.clear();
+      client.Body.reset();
+      client.Tail = "";
+      client.Sent = 0;
+      // The single responses close the connection
+      if (!client.Streaming)
+        return false;
+
+      SendFrame(client);
+      if (client.Head.isEmpty())
+      {
+        SetWriting(client, false);
+        return true;
+      }
+    }
+    iovec Parts[3];
+    msghdr Message = {};
+    int Count = 0;
+    size_t Offset = client.Sent;
+
+    AddPart(Parts, Count, Offset, client.Head.constData(), client.Head.size());
+    if (BodySize > 0)
+      AddPart(Parts, Count, Offset, client.Body->data(), BodySize);
+    AddPart(Parts, Count, Offset, client.Tail, TailSize);
+    Message.msg_iov = Parts;
+    Message.msg_iovlen = Count;
+    const ssize_t Bytes = sendmsg(client.Fd, &Message, MSG_NOSIGNAL);
+
+    if (Bytes < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        return false;
+
+      SetWriting(client, true);
+      return true;
+    }
+    client.Sent += Bytes;
+    client.LastActivity = QDateTime::currentMSecsSinceEpoch();
+  }
+}
+
+
+bool HttpServer::HandleRequest(Client& client)
+{
+  const int LineEnd = client.Request.indexOf("\r\n");
+  const QByteArray Line = client.Request.left(LineEnd);
+  const int MethodEnd = Line.indexOf(' ');
+  const int PathEnd = Line.indexOf(' ', MethodEnd+1);
+  QByteArray Path = Line.mid(MethodEnd+1, PathEnd < 0 ? -1 : PathEnd-MethodEnd-1);
+
+  if (Path.indexOf('?') >= 0)
+    Path = Path.left(Path.indexOf('?'));
+
+  client.Request.clear();
+  if (MethodEnd < 0 || Line.left(MethodEnd) != "GET")
+  {
+    Respond(client, "405 Method Not Allowed", "text/plain", "Method not allowed\n");
+  } else
+  if (Path == "/latest.jpg")
+  {
+    std::lock_guard<std::mutex> Lock(Mutex);
+
+    if (Latest.get())
+    {
+      Respond(client, "200 OK", "image/jpeg", QByteArray(), Latest);
+    } else {
+      Respond(client, "503 Service Unavailable", "text/plain", "No frame yet\n");
+    }
+  } else
+  if (Path == "/stream")
+  {
+    // A small socket buffer keeps the frames in the server where they can be skipped
+    setsockopt(client.Fd, SOL_SOCKET, SO_SNDBUF, &StreamBufferSize, sizeof(StreamBufferSize));
+    client.Streaming = true;
+    client.Head = QByteArray("HTTP/1.0 200 OK\r\nContent-Type: multipart/x-mixed-replace; boundary=")+Boundary+
+                  "\r\nCache-Control: no-cache\r\nConnection: close\r\n\r\n";
+  } else
+  if (Path == "/status")
+  {
+    std::lock_guard<std::mutex> Lock(Mutex);
+
+    Respond(client, "200 OK", "application/json", Status.isEmpty() ? QByteArray("{}\n") : Status);
+  } else {
+    Respond(client, "404 Not Found", "text/plain", "Not found\n");
+  }
+  return Flush(client);
+}
+
+
+void HttpServer::SendFrame(Client& client)
+{
+  std::lock_guard<std::mutex> Lock(Mutex);
+
+  // Only the newest frame is sent after a slow transfer
+  if (!Latest.get() || client.Sequence == Sequence)
+    return;
+
+  client.Head = QByteArray("--")+Boundary+"\r\nContent-Type: image/jpeg\r\nContent-Length: "+
+                QByteArray::number((qulonglong)Latest->size())+"\r\n\r\n";
+  client.Body = Latest;
+  client.Tail = "\r\n";
+  client.Sequence = Sequence;
+}
+
+
+void HttpServer::Respond(Client& client, const char* status, const char* content_type, const QByteArray& body,
+                         const ImageBuffer& buffer)
+{
+  const size_t Size = body.size()+(buffer.get() ? buffer->size() : 0);
+
+  client.Body = buffer;
+  client.Head = QByteArray("HTTP/1.0 ")+status+"\r\nContent-Type: "+content_type+"\r\nContent-Length: "+
+                QByteArray::number((qulonglong)Size)+"\r\nCache-Control: no-cache\r\nConnection: close\r\n\r\n"+body;
+}
+
+
+void HttpServer::CloseClient(int fd)
+{
+  epoll_ctl(EpollFd, EPOLL_CTL_DEL, fd, nullptr);
+  close(fd);
+  Clients.erase(fd);
+  ClientCount = (int)Clients.size();
+}
+
+
+void HttpServer::SetWriting(Client& client, bool writing)
+{
+  if (client.Writing == writing)
+    return;
+
+  epoll_event Event = {};
+
+  Event.events = EPOLLIN | EPOLLRDHUP;
+  if (writing)
+    Event.events |= EPOLLOUT;
+  Event.data.fd = client.Fd;
+  epoll_ctl(EpollFd, EPOLL_CTL_MOD, client.Fd, &Event);
+  client.Writing = writing;
+}
@@ -0,0 +1,109 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+
+#pragma once
+
+#include "encoder.h"
+
+#include <QByteArray>
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include <stdint.h>
+
+// Single-threaded epoll HTTP server of the latest frame. The compressed frame is
+// shared by all clients, the stream clients skip the frames published while
+// they are still receiving an older one.
+//
+// GET /latest.jpg  the latest frame
+// GET /stream      multipart/x-mixed-replace MJPEG stream
+// GET /status      JSON status of the latest frame
+class HttpServer
+{
+public:
+  explicit HttpServer(int port);
+  ~HttpServer();
+
+  bool Start();
+  void Stop();
+  // The frame and its status are sent to the waiting stream clients
+  void Publish(const ImageBuffer& jpeg, const QByteArray& status);
+  int GetClientCount() const { return ClientCount; }
+
+  // Connections beyond this are closed at once
+  int MaxClients { 64 };
+  // Clients without a request or without progress in the stream are closed (ms)
+  int RequestTimeout { 10000 };
+  int StreamTimeout { 60000 };
+  // Socket send buffer of the stream clients (bytes)
+  int StreamBufferSize { 131072 };
+
+protected:
+  struct Client
+  {
+    int Fd { -1 };
+    QByteArray Request;
+    bool Streaming { false };
+    bool Writing { false };
+    // Closed at the end of the event batch
+    bool Closed { false };
+    // Sequence number of the last frame sent to the stream client
+    uint64_t Sequence { 0 };
+    // Pending output: header, shared body and trailer
+    QByteArray Head;
+    ImageBuffer Body;
+    const char* Tail { "" };
+    size_t Sent { 0 };
+    int64_t LastActivity { 0 };
+  };
+
+  void Run();
+  void Accept();
+  bool Read(Client& client);
+  bool Flush(Client& client);
+  bool HandleRequest(Client& client);
+  void SendFrame(Client& client);
+  // The body is followed by the shared buffer
+  void Respond(Client& client, const char* status, const char* content_type, const QByteArray& body,
+               const ImageBuffer& buffer = ImageBuffer());
+  void CloseClient(int fd);
+  void SetWriting(Client& client, bool writing);
+
+  int Port { 0 };
+  int ListenFd { -1 };
+  int EpollFd { -1 };
+  int WakeFd { -1 };
+  std::thread Worker;
+  std::atomic<bool> Running { false };
+  std::atomic<int> ClientCount { 0 };
+  // Used only by the server thread
+  std::map<int, Client> Clients;
+
+  // Latest published frame
+  std::mutex Mutex;
+  ImageBuffer Latest;
+  QByteArray Status;
+  uint64_t Sequence { 0 };
+};
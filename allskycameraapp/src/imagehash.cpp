@@ -0,0 +1,129 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "imagehash.h"
+
+#include <MEImage.hpp>
+
+#include <MCLog.hpp>
+
+#include <algorithm>
+
+namespace
+{
+const int HashGrid = 8;
+}
+
+
+uint64_t ComputeImageHash(const MEImage& image)
+{
+  const IplImage* Image = image.GetIplImage();
+  const int Layers = image.GetLayerCount();
+  const int Width = image.GetWidth();
+  const int Height = image.GetHeight();
+  int Means[HashGrid*HashGrid];
+
+  if (Width < HashGrid || Height < HashGrid)
+    return 0;
+
+  for (int by = 0; by < HashGrid; ++by)
+  {
+    for (int bx = 0; bx < HashGrid; ++bx)
+    {
+      const int StartX = bx*Width / HashGrid;
+      const int EndX = (bx+1)*Width / HashGrid;
+      const int StartY = by*Height / HashGrid;
+      const int EndY = (by+1)*Height / HashGrid;
+      int Sum = 0;
+
+      for (int y = StartY; y < EndY; ++y)
+      {
+        const unsigned char* Row = reinterpret_cast<const unsigned char*>(Image->imageData)+y*Image->widthStep;
+
+        for (int x = StartX; x < EndX; ++x)
+        {
+          Sum += Row[x*Layers];
+        }
+      }
+      Means[by*HashGrid+bx] = Sum / ((EndX-StartX)*(EndY-StartY));
+    }
+  }
+  int Sorted[HashGrid*HashGrid];
+
+  std::copy(Means, Means+HashGrid*HashGrid, Sorted);
+  std::nth_element(Sorted, Sorted+HashGrid*HashGrid / 2, Sorted+HashGrid*HashGrid);
+
+  const int Median = Sorted[HashGrid*HashGrid / 2];
+  uint64_t Hash = 0;
+
+  for (int i = 0; i < HashGrid*HashGrid; ++i)
+  {
+    if (Means[i] > Median)
+      Hash |= (uint64_t)1 << i;
+  }
+  return Hash;
+}
+
+
+int GetHammingDistance(uint64_t hash1, uint64_t hash2)
+{
+  return __builtin_popcountll(hash1 ^ hash2);
+}
+
+
+DuplicateFilter::DuplicateFilter(int threshold) : Threshold(threshold)
+{
+}
+
+
+bool DuplicateFilter::IsDuplicate(uint64_t hash, int label, bool keep)
+{
+  if (!keep && HasReference && label == ReferenceLabel && GetHammingDistance(hash, Reference) <= Threshold)
+  {
+    Duplicates++;
+    return true;
+  }
+  Reference = hash;
+  ReferenceLabel = label;
+  HasReference = true;
+  return false;
+}
+
+
+void DuplicateFilter::AddSuppressedWrite(int bytes)
+{
+  SuppressedWrites++;
+  BytesSaved += bytes;
+}
+
+
+void DuplicateFilter::AddSuppressedUpload(int bytes)
+{
+  SuppressedUploads++;
+  BytesSaved += bytes;
+}
+
+
+void DuplicateFilter::LogStats() const
+{
+  MC_LOG("Duplicate frames: %d suppressed writes: %d suppressed uploads: %d saved: %lld bytes", Duplicates.load(),
+         SuppressedWrites.load(), SuppressedUploads.load(), BytesSaved.load());
+}
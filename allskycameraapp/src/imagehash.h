@@ -0,0 +1,56 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <atomic>
+
+#include <stdint.h>
+
+class MEImage;
+
+// Block-mean hash of the first layer: 8x8 block averages compared to their median
+uint64_t ComputeImageHash(const MEImage& image);
+int GetHammingDistance(uint64_t hash1, uint64_t hash2);
+
+// Detects the near-duplicate frames of an unchanged sky
+class DuplicateFilter
+{
+public:
+  explicit DuplicateFilter(int threshold = 4);
+
+  // The frames are compared to the last distinct frame of the same label, a slow change
+  // is not lost. A label change or a kept frame starts a new reference.
+  bool IsDuplicate(uint64_t hash, int label, bool keep = false);
+  void AddSuppressedWrite(int bytes);
+  void AddSuppressedUpload(int bytes);
+  void LogStats() const;
+
+protected:
+  int Threshold { 4 };
+  uint64_t Reference { 0 };
+  int ReferenceLabel { -1 };
+  bool HasReference { false };
+  std::atomic<int> Duplicates { 0 };
+  std::atomic<int> SuppressedWrites { 0 };
+  std::atomic<int> SuppressedUploads { 0 };
+  std::atomic<long long> BytesSaved { 0 };
+};
@@ -116,20 +116,16 @@ bool CppInference::Load(const QString& model_str)
 }
 
 
-int CppInference::Predict(MEImage& image)
+int CppInference::Predict(MEImage& image, float* probabilities)
 {
-  if (Session == nullptr || image.GetWidth() != 160 || image.GetHeight() != 96 || image.GetLayerCount() != 1)
+  if (Session == nullptr || image.GetWidth() != InputWidth || image.GetHeight() != InputHeight || image.GetLayerCount() != 1)
     return -1;
 
-  tensorflow::Tensor X(tensorflow::DT_FLOAT, tensorflow::TensorShape({ 1, 96, 160, 1 }));
+  tensorflow::Tensor X(tensorflow::DT_FLOAT, tensorflow::TensorShape({ 1, InputHeight, InputWidth, 1 }));
   std::vector<std::pair<std::string, tensorflow::Tensor>> Input = { { "conv1_input", X } };
   std::vector<tensorflow::Tensor> Outputs;
-  float* XData = X.flat<float>().data();
 
-  for (int i = 0; i < image.GetImageDataSize(); ++i)
-  {
-    XData[i] = (float)reinterpret_cast<unsigned char*>(image.GetIplImage()->imageData)[i];
-  }
+  CopyInput(image, X.flat<float>().data());
   tensorflow::Status Status = Session->Run(Input, { "output/Softmax" }, {}, &Outputs);
 
   if (!Status.ok())
@@ -146,6 +142,11 @@ int CppInference::Predict(MEImage& image)
   auto Item = Outputs[0].shaped<float, 2>({ 1, 2 }); // { 1, 2 } -> One sample+2 label classes
 
   // printf("Debug inference output: %1.4f %1.4f\n", (float)Item(0, 0), (float)Item(0, 1));
+  if (probabilities != nullptr)
+  {
+    probabilities[0] = (float)Item(0, 0);
+    probabilities[1] = (float)Item(0, 1);
+  }
   if ((float)Item(0, 0) < (float)Item(0, 1))
     return 1;
 
@@ -153,6 +154,85 @@ int CppInference::Predict(MEImage& image)
 }
 
 
+std::vector<int> CppInference::PredictBatch(const std::vector<MEImage*>& images, std::vector<float>* probabilities)
+{
+  std::vector<int> Labels(images.size(), -1);
+
+  if (Session == nullptr || images.empty())
+    return Labels;
+
+  for (auto image : images)
+  {
+    if (image->GetWidth() != InputWidth || image->GetHeight() != InputHeight || image->GetLayerCount() != 1)
+      return Labels;
+  }
+  const int BatchSize = (int)images.size();
+  tensorflow::Tensor X(tensorflow::DT_FLOAT, tensorflow::TensorShape({ BatchSize, InputHeight, InputWidth, 1 }));
+  std::vector<std::pair<std::string, tensorflow::Tensor>> Input = { { "conv1_input", X } };
+  std::vector<tensorflow::Tensor> Outputs;
+  float* XData = X.flat<float>().data();
+
+  for (int n = 0; n < BatchSize; ++n)
+  {
+    CopyInput(*images[n], XData+n*InputWidth*InputHeight);
+  }
+  tensorflow::Status Status = Session->Run(Input, { "output/Softmax" }, {}, &Outputs);
+
+  if (!Status.ok())
+  {
+    printf("Error in prediction: %s\n", Status.ToString().c_str());
+    return Labels;
+  }
+  if (Outputs.size() != 1)
+  {
+    printf("Missing prediction! (%d)\n", (int)Outputs.size());
+    return Labels;
+  }
+
+  auto Items = Outputs[0].shaped<float, 2>({ BatchSize, 2 });
+
+  for (int n = 0; n < BatchSize; ++n)
+  {
+    if (probabilities != nullptr)
+    {
+      probabilities->push_back((float)Items(n, 0));
+      probabilities->push_back((float)Items(n, 1));
+    }
+    Labels[n] = (float)Items(n, 0) < (float)Items(n, 1) ? 1 : 0;
+  }
+  return Labels;
+}
+
+
+MEImage* CppInference::PrepareImage(MEImage& image)
+{
+  if (image.GetWidth() <= 0 || image.GetHeight() <= 0)
+    return nullptr;
+
+  if (image.GetLayerCount() == 1)
+    image.ConvertToRGB();
+
+  if (image.GetLayerCount() != 3)
+    return nullptr;
+
+  MEImage* Input = image.GetLayer(2);
+
+  Input->Resize(InputWidth, InputHeight, true);
+  return Input;
+}
+
+
+void CppInference::CopyInput(MEImage& image, float* data)
+{
+  const unsigned char* ImageData = reinterpret_cast<unsigned char*>(image.GetIplImage()->imageData);
+
+  for (int i = 0; i < InputWidth*InputHeight; ++i)
+  {
+    data[i] = (float)ImageData[i];
+  }
+}
+
+
 CInference::~CInference()
 {
   if (Graph == nullptr)
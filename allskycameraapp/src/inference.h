@@ -28,6 +28,7 @@
 #include <QString>
 
 #include <memory>
+#include <vector>
 
 class MEImage;
 
@@ -37,7 +38,17 @@ public:
   CppInference() = default;
 
   bool Load(const QString& model_str);
-  int Predict(MEImage& image);
+  // The softmax outputs of the clear/cloud classes are stored to probabilities[2] if it is given
+  int Predict(MEImage& image, float* probabilities = nullptr);
+  // One session run for several images, two probabilities per image are appended to probabilities
+  std::vector<int> PredictBatch(const std::vector<MEImage*>& images, std::vector<float>* probabilities = nullptr);
+
+  // Red layer of the image in the input size, the training data is prepared with the same functions
+  static MEImage* PrepareImage(MEImage& image);
+  static void CopyInput(MEImage& image, float* data);
+
+  static const int InputWidth = 160;
+  static const int InputHeight = 96;
 
   tensorflow::Session* Session { nullptr };
   tensorflow::GraphDef GraphDef;
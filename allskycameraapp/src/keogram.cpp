@@ -0,0 +1,229 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "keogram.h"
+
+#include <MEImage.hpp>
+
+#include <MCLog.hpp>
+
+#include <QDir>
+#include <QFile>
+#include <QStringList>
+
+#include <string.h>
+
+namespace
+{
+// Strip colours (BGR): clear sky, clouds
+const unsigned char ClearColor[3] = { 0, 180, 0 };
+const unsigned char CloudColor[3] = { 110, 110, 110 };
+const unsigned char UnknownColor[3] = { 0, 0, 0 };
+
+
+// The row count has a fixed width, so the header can be updated in place
+QByteArray GetPpmHeader(int width, int rows)
+{
+  return QString("P6\n%1 %2\n255\n").arg(width).arg(rows, 10).toLocal8Bit();
+}
+}
+
+
+bool Keogram::Start(const QString& path, const QString& night_name)
+{
+  if (!QDir().mkpath(path))
+  {
+    MC_WARNING("Unable to create keogram directory: %s", qPrintable(path));
+    return false;
+  }
+  Path = path+'/';
+  NightName = night_name;
+  Height = 0;
+  FrameCount = 0;
+  Slices.clear();
+  Labels.clear();
+  if (Load())
+  {
+    MC_LOG("Keogram resumed (%d frames)", FrameCount);
+  }
+  return true;
+}
+
+
+bool Keogram::Add(MEImage& image, int label)
+{
+  if (!IsActive() || image.GetLayerCount() != 3)
+    return false;
+
+  if (FrameCount == 0)
+    Height = image.GetHeight();
+
+  if (image.GetHeight() != Height)
+  {
+    MC_WARNING("Frame height differs from the keogram height, frame skipped");
+    return false;
+  }
+  const IplImage* Image = image.GetIplImage();
+  const int X = (CenterX < 0 || CenterX >= image.GetWidth()) ? image.GetWidth() / 2 : CenterX;
+  const unsigned char* Data = reinterpret_cast<unsigned char*>(Image->imageData)+X*3;
+  const size_t Offset = Slices.size();
+
+  // O(height) meridian slice
+  Slices.resize(Offset+Height*3);
+  for (int y = 0; y < Height; ++y)
+  {
+    memcpy(&Slices[Offset+y*3], Data+y*Image->widthStep, 3);
+  }
+  const unsigned char* Color = label == 0 ? ClearColor : (label == 1 ? CloudColor : UnknownColor);
+  std::vector<unsigned char> StripRow(StripHeight*3);
+
+  Labels.insert(Labels.end(), Color, Color+3);
+  for (int i = 0; i < StripHeight; ++i)
+  {
+    memcpy(&StripRow[i*3], Color, 3);
+  }
+  if (!AppendRow(GetFileName(".ppm"), &Slices[Offset], Height) ||
+      !AppendRow(GetFileName("_labels.ppm"), StripRow.data(), StripHeight))
+  {
+    MC_WARNING("Unable to append to the keogram: %s", qPrintable(GetFileName(".ppm")));
+  }
+  FrameCount++;
+  return true;
+}
+
+
+bool Keogram::Finish()
+{
+  if (!IsActive())
+    return false;
+
+  bool Success = true;
+
+  if (FrameCount > 0)
+  {
+    MEImage Final(FrameCount, Height+StripHeight, 3);
+    IplImage* Image = Final.GetIplImage();
+
+    // Transpose the slices into columns
+    for (int y = 0; y < Height+StripHeight; ++y)
+    {
+      unsigned char* Row = reinterpret_cast<unsigned char*>(Image->imageData)+y*Image->widthStep;
+
+      for (int x = 0; x < FrameCount; ++x)
+      {
+        memcpy(Row+x*3, y < Height ? &Slices[(x*Height+y)*3] : &Labels[x*3], 3);
+      }
+    }
+    Final.SaveToFile(GetFileName(".png").toStdString());
+    Success = QFile::exists(GetFileName(".png"));
+    if (Success)
+    {
+      QFile::remove(GetFileName(".ppm"));
+      QFile::remove(GetFileName("_labels.ppm"));
+    }
+    MC_LOG("Keogram saved: %s (%d frames)", qPrintable(GetFileName(".png")), FrameCount);
+  }
+  NightName.clear();
+  std::vector<unsigned char>().swap(Slices);
+  std::vector<unsigned char>().swap(Labels);
+  return Success;
+}
+
+
+bool Keogram::Load()
+{
+  QFile SliceFile(GetFileName(".ppm"));
+  QFile LabelFile(GetFileName("_labels.ppm"));
+
+  if (!SliceFile.open(QIODevice::ReadOnly) || !LabelFile.open(QIODevice::ReadOnly))
+    return false;
+
+  // Header: P6, width and row count, maximum value
+  QStringList Size = QString(SliceFile.readLine()+SliceFile.readLine()).simplified().split(' ');
+  SliceFile.readLine();
+  if (Size.size() != 3 || Size[0] != "P6")
+    return false;
+
+  const int Width = Size[1].toInt();
+  const int Rows = Size[2].toInt();
+  const QByteArray StripData = LabelFile.readAll();
+  const int StripRowSize = StripHeight*3;
+  const int StripHeaderSize = GetPpmHeader(StripHeight, Rows).size();
+
+  if (Width <= 0 || Rows <= 0 || StripData.size() < StripHeaderSize+Rows*StripRowSize)
+    return false;
+
+  QByteArray SliceData = SliceFile.read((qint64)Width*Rows*3);
+
+  if (SliceData.size() != Width*Rows*3)
+    return false;
+
+  Height = Width;
+  FrameCount = Rows;
+  Slices.resize(SliceData.size());
+  Labels.resize(Rows*3);
+  // Stored as RGB in the file
+  for (int i = 0; i < SliceData.size(); i += 3)
+  {
+    Slices[i] = SliceData[i+2];
+    Slices[i+1] = SliceData[i+1];
+    Slices[i+2] = SliceData[i];
+  }
+  for (int i = 0; i < Rows; ++i)
+  {
+    const char* Pixel = StripData.constData()+StripHeaderSize+i*StripRowSize;
+
+    Labels[i*3] = Pixel[2];
+    Labels[i*3+1] = Pixel[1];
+    Labels[i*3+2] = Pixel[0];
+  }
+  return true;
+}
+
+
+bool Keogram::AppendRow(const QString& filename, const unsigned char* row, int width)
+{
+  QFile CurrentFile(filename);
+  const QByteArray Header = GetPpmHeader(width, FrameCount+1);
+  QByteArray Row(width*3, 0);
+
+  if (!CurrentFile.open(QIODevice::ReadWrite))
+    return false;
+
+  for (int i = 0; i < width*3; i += 3)
+  {
+    Row[i] = row[i+2];
+    Row[i+1] = row[i+1];
+    Row[i+2] = row[i];
+  }
+  // Append the row first, the header makes it visible afterwards
+  CurrentFile.seek(Header.size()+(qint64)FrameCount*width*3);
+  CurrentFile.write(Row);
+  CurrentFile.seek(0);
+  CurrentFile.write(Header);
+  return CurrentFile.flush();
+}
+
+
+QString Keogram::GetFileName(const QString& suffix) const
+{
+  return Path+"keogram_"+NightName+suffix;
+}
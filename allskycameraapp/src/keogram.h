@@ -0,0 +1,61 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <QString>
+
+#include <vector>
+
+class MEImage;
+
+// Keogram of one night built from the meridian slice of every frame.
+// The slices are appended as rows of a PPM file, so the file is always complete
+// and the final image is only transposed at the end of the night.
+class Keogram
+{
+public:
+  Keogram() = default;
+
+  bool Start(const QString& path, const QString& night_name);
+  bool Add(MEImage& image, int label);
+  bool Finish();
+  bool IsActive() const { return !NightName.isEmpty(); }
+
+  // Column of the meridian, -1 is the image centre
+  int CenterX { -1 };
+  // Height of the clear/cloud strip under the keogram
+  int StripHeight { 16 };
+
+protected:
+  bool Load();
+  bool AppendRow(const QString& filename, const unsigned char* row, int width);
+  QString GetFileName(const QString& suffix) const;
+
+  QString Path;
+  QString NightName;
+  int Height { 0 };
+  int FrameCount { 0 };
+  // Meridian slices in BGR order, one per frame
+  std::vector<unsigned char> Slices;
+  // Strip colours in BGR order, one per frame
+  std::vector<unsigned char> Labels;
+};
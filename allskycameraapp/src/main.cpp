@@ -19,7 +19,34 @@
  *
  */
 
+#include "archivepolicy.h"
+#include "calibration.h"
+#include "capturesource.h"
+#include "datasetpacker.h"
+#include "denoiser.h"
+#include "direnumerator.h"
+#include "encoder.h"
+#include "eventchannel.h"
+#include "filemover.h"
+#include "folderwatcher.h"
+#include "framearchive.h"
+#include "framequeue.h"
+#include "framering.h"
+#include "housekeeper.h"
+#include "httpserver.h"
+#include "ftpuploader.h"
+#include "imagehash.h"
 #include "inference.h"
+#include "keogram.h"
+#include "outputwriter.h"
+#include "rawframes.h"
+#include "reprojection.h"
+#include "scheduler.h"
+#include "selftest.h"
+#include "stacker.h"
+#include "stagestats.h"
+#include "telemetry.h"
+#include "timelapse.h"
 
 #include <core/MANum.hpp>
 
@@ -35,18 +62,67 @@
 #include <QDateTime>
 #include <QDir>
 #include <QFile>
-#include <QProcess>
+#include <QFileInfo>
 #include <QTime>
 
 #include <opencv2/core.hpp>
 
 #include <geoclue.h>
 
+#include <functional>
+#include <thread>
+#include <vector>
+
 #include <stdio.h>
 #include <time.h>
 #include <math.h>
 #include <unistd.h>
 
+// Time between the starts of two exposures (ms)
+const int FramePeriod = 40000;
+// Additional delay of the daylight exposures, long after direct sunlight (ms)
+const int DaylightWait = 30000;
+const int DaylightLongWait = 1200000;
+const int CaptureRetryDelay = 30000;
+const int SunRefreshPeriod = 3600000;
+const int StatisticsPeriod = 600000;
+const int HousekeepingPeriod = 3600000;
+const int TimelapseFps = 25;
+
+// Captured frame on its way through the analysis and encode stages
+struct CaptureJob
+{
+  MEImage Image;
+  QDateTime Timestamp;
+  int NightMode { 0 };
+  int ShutterTime { 0 };
+  int Iso { 0 };
+  int Brightness { 0 };
+  float SunArea { 0 };
+  // Clear (0), cloudy (1) or not classified (-1)
+  int Label { -1 };
+  float Probabilities[2] { 0, 0 };
+  // Near-duplicate of the last distinct frame
+  bool Duplicate { false };
+};
+
+
+// JSON status of the HTTP server
+QByteArray FormatStatus(const CaptureJob& job, int jpeg_size)
+{
+  const char* Labels[] = { "clear", "clouds" };
+  char Buffer[512];
+
+  snprintf(Buffer, sizeof(Buffer), "{\"timestamp\": %lld, \"time\": \"%s\", \"night\": %s, \"label\": \"%s\", "
+           "\"probabilities\": [%1.4f, %1.4f], \"shutter\": %d, \"iso\": %d, \"brightness\": %d, \"sunarea\": %1.4f, "
+           "\"duplicate\": %s, \"jpegsize\": %d}\n", (long long)job.Timestamp.toMSecsSinceEpoch(),
+           qPrintable(job.Timestamp.toString("yyyy-MM-dd'T'HH:mm:ss")), job.NightMode == 1 ? "true" : "false",
+           job.Label == 0 || job.Label == 1 ? Labels[job.Label] : "unknown", job.Probabilities[0], job.Probabilities[1],
+           job.ShutterTime, job.Iso, job.Brightness, job.SunArea, job.Duplicate ? "true" : "false", jpeg_size);
+  return QByteArray(Buffer);
+}
+
+
 int GetGmtOffset()
 {
   time_t UtcTime = time(nullptr);
@@ -182,6 +258,48 @@ int main(int argc, char* argv[])
   QCommandLineOption SmtpUserOption({"U", "smtpuser"}, "GMail SMTP username", "smtpuser");
   QCommandLineOption SmtpPassOption({"P", "smtppass"}, "GMail SMTP password", "smtppass");
   QCommandLineOption EmailOption({"e", "email"}, "Notification e-mail address", "email");
+  QCommandLineOption CalibrationOption("calibration", "Directory of the master dark/flat frames", "calibration");
+  QCommandLineOption MakeDarkOption("makedark", "Build a master dark frame from a directory of dark frames", "makedark");
+  QCommandLineOption MakeFlatOption("makeflat", "Build a flat field from a directory of flat frames", "makeflat");
+  QCommandLineOption ShutterOption("shutter", "Shutter time of the dark frames (us)", "shutter", "4500000");
+  QCommandLineOption IsoOption("iso", "ISO of the dark frames", "iso", "800");
+  QCommandLineOption StackOption("stack", "Directory of the night stacks (star trails, mean)", "stack");
+  QCommandLineOption KeogramOption("keogram", "Directory of the night keograms", "keogram");
+  QCommandLineOption DenoiseOption("denoise", "Temporal denoising of the uploaded night images (median, mean)", "denoise");
+  QCommandLineOption CaptureOption("capture", "Capture source (raspistill, stream, files:<directory>)", "capture", "raspistill");
+  QCommandLineOption PanoramaOption("panorama", "Save an azimuth/altitude panorama next to the static web image");
+  QCommandLineOption LensOption("lens", "Fisheye lens calibration (centerx,centery,radius[,azimuth[,mirrored]])", "lens");
+  QCommandLineOption FtpServerOption("ftpserver", "FTP server of the image upload (host[:port])", "ftpserver",
+                                    "webcam.wunderground.com");
+  QCommandLineOption JpegBudgetOption("jpegbudget", "Target size of the uploaded JPEG images (bytes)", "jpegbudget");
+  QCommandLineOption ProgressiveOption("progressive", "Progressive JPEG encoding with the size budget");
+  QCommandLineOption DedupOption("dedup", "Skip the near-duplicate frames, maximum hash distance (bits)", "dedup");
+  QCommandLineOption DedupUploadOption("dedupupload", "Upload every Nth near-duplicate frame", "dedupupload", "10");
+  QCommandLineOption ExportOption("export", "Export the frames of an archive index into JPEG files", "export");
+  QCommandLineOption ExportPathOption("exportpath", "Target directory of the exported frames", "exportpath", ".");
+  QCommandLineOption FromOption("from", "Start time of the export or the telemetry query (yyyyMMddHHmm)", "from");
+  QCommandLineOption ToOption("to", "End time of the export or the telemetry query (yyyyMMddHHmm)", "to");
+  QCommandLineOption TelemetryOption("telemetry", "Directory of the per-frame telemetry", "telemetry");
+  QCommandLineOption QueryOption("query", "Aggregate the telemetry and exit (nights, exposure)", "query");
+  QCommandLineOption WatchOption("watch", "Classify the new images of the directories until stopped (dir1,dir2,...)", "watch");
+  QCommandLineOption BatchWindowOption("batchwindow", "Collect the new images of a burst into one batch (ms)", "batchwindow", "200");
+  QCommandLineOption RecursiveOption("recursive", "Classify the test images of the subdirectories too");
+  QCommandLineOption OrderedOption("ordered", "Classify the test images in file name order");
+  QCommandLineOption RollbackOption("rollback", "Undo an interrupted sorting of a directory and exit", "rollback");
+  QCommandLineOption PackOption("pack", "Pack the images of the clear/clouds directories and the labelled archived frames into a training dataset and exit", "pack");
+  QCommandLineOption DatasetOption("dataset", "Prefix of the training dataset files", "dataset", "skycam_dataset");
+  QCommandLineOption ArchiveMarginOption("archivemargin", "Archive thumbnails of the frames classified with a larger softmax margin (0-1)",
+                                         "archivemargin");
+  QCommandLineOption HousekeepingOption("housekeeping", "Compact the archived nights older than the given days", "housekeeping");
+  QCommandLineOption IoBudgetOption("iobudget", "Disk I/O budget of the housekeeping (bytes/s)", "iobudget", "1048576");
+  QCommandLineOption TimelapseOption("timelapse", "Directory of the night timelapse videos (MJPEG AVI)", "timelapse");
+  QCommandLineOption RawFramesOption("rawframes", "Directory of the lossless raw night frames", "rawframes");
+  QCommandLineOption ExportRawOption("exportraw", "Export the frames of a raw night file into PNG files", "exportraw");
+  QCommandLineOption HttpPortOption("httpport", "Port of the HTTP server (/latest.jpg, /stream, /status)", "httpport");
+  QCommandLineOption FrameRingOption("framering", "Publish the processed frames in a named shared memory ring", "framering");
+  QCommandLineOption EventsOption("events", "Unix socket of the frame, label and exposure events", "events");
+  QCommandLineOption SelfTestOption("selftest", "Run the checks of the scheduler, the file formats and the FTP upload and exit");
+  QCommandLineOption DenoiseDepthOption("denoisedepth", "Number of frames in the temporal denoising (3-9)", "denoisedepth", "5");
 
   Parser.addHelpOption();
   Parser.addOption(CameraIDOption);
@@ -194,6 +312,46 @@ int main(int argc, char* argv[])
   Parser.addOption(SmtpUserOption);
   Parser.addOption(SmtpPassOption);
   Parser.addOption(EmailOption);
+  Parser.addOption(CalibrationOption);
+  Parser.addOption(MakeDarkOption);
+  Parser.addOption(MakeFlatOption);
+  Parser.addOption(ShutterOption);
+  Parser.addOption(IsoOption);
+  Parser.addOption(StackOption);
+  Parser.addOption(KeogramOption);
+  Parser.addOption(DenoiseOption);
+  Parser.addOption(DenoiseDepthOption);
+  Parser.addOption(CaptureOption);
+  Parser.addOption(PanoramaOption);
+  Parser.addOption(LensOption);
+  Parser.addOption(FtpServerOption);
+  Parser.addOption(JpegBudgetOption);
+  Parser.addOption(ProgressiveOption);
+  Parser.addOption(DedupOption);
+  Parser.addOption(DedupUploadOption);
+  Parser.addOption(ExportOption);
+  Parser.addOption(ExportPathOption);
+  Parser.addOption(FromOption);
+  Parser.addOption(ToOption);
+  Parser.addOption(TelemetryOption);
+  Parser.addOption(QueryOption);
+  Parser.addOption(WatchOption);
+  Parser.addOption(BatchWindowOption);
+  Parser.addOption(RecursiveOption);
+  Parser.addOption(OrderedOption);
+  Parser.addOption(RollbackOption);
+  Parser.addOption(PackOption);
+  Parser.addOption(DatasetOption);
+  Parser.addOption(ArchiveMarginOption);
+  Parser.addOption(HousekeepingOption);
+  Parser.addOption(IoBudgetOption);
+  Parser.addOption(TimelapseOption);
+  Parser.addOption(RawFramesOption);
+  Parser.addOption(ExportRawOption);
+  Parser.addOption(HttpPortOption);
+  Parser.addOption(FrameRingOption);
+  Parser.addOption(EventsOption);
+  Parser.addOption(SelfTestOption);
   Parser.process(App);
 
 
@@ -212,6 +370,12 @@ int main(int argc, char* argv[])
   MEImage InfoLayerImage;
   bool InfoLayer = false;
   bool LongWait = false;
+  Calibration FrameCalibration;
+  NightStacker Stacker;
+  Keogram NightKeogram;
+  std::unique_ptr<TemporalDenoiser> Denoiser;
+  LensModel Lens;
+  SkyProjection Projection;
 
   GetLocation(Longitude, Latitude);
   MC_LOG("Current location - longitude: %1.4f latitude: %1.4f", Longitude, Latitude);
@@ -226,6 +390,154 @@ int main(int argc, char* argv[])
     InfoLayerImage.LoadFromFile("info_layer.jpg");
     InfoLayer = true;
   }
+  if (Parser.isSet("lens") && !Lens.Parse(Parser.value(LensOption)))
+  {
+    MC_WARNING("Invalid lens calibration: %s", qPrintable(Parser.value(LensOption)));
+  }
+  if (Parser.isSet("denoise"))
+  {
+    Denoiser.reset(new TemporalDenoiser(Parser.value(DenoiseDepthOption).toInt(),
+                                        Parser.value(DenoiseOption) == "mean" ? TemporalDenoiser::TrimmedMean :
+                                                                                TemporalDenoiser::Median));
+    MC_LOG("Temporal denoising over %d frames", Denoiser->GetDepth());
+  }
+  if (Parser.isSet("calibration"))
+  {
+    FrameCalibration.Open(Parser.value(CalibrationOption));
+    // Build the master frames and exit
+    if (Parser.isSet("makedark") || Parser.isSet("makeflat"))
+    {
+      const QString SourcePath = Parser.isSet("makedark") ? Parser.value(MakeDarkOption) : Parser.value(MakeFlatOption);
+      QStringList Files;
+      bool Success = false;
+
+      for (auto filename : QDir(SourcePath).entryList(QStringList() << "*.png" << "*.jpg" << "*.jpeg",
+                                                      QDir::Files | QDir::NoDotAndDotDot, QDir::Name))
+        Files += SourcePath+'/'+filename;
+
+      if (Parser.isSet("makedark"))
+        Success = FrameCalibration.BuildDark(Files, Parser.value(ShutterOption).toInt(), Parser.value(IsoOption).toInt());
+      else
+        Success = FrameCalibration.BuildFlat(Files);
+
+      if (!Success)
+        printf("Unable to build the master frame from %s\n", qPrintable(SourcePath));
+      return Success ? 0 : 1;
+    }
+  }
+
+  if (Parser.isSet("selftest"))
+    return RunSelfTest() ? 0 : 1;
+
+  // Telemetry statistics in the [from, to) range and exit
+  if (Parser.isSet("query"))
+  {
+    if (!Parser.isSet("telemetry"))
+    {
+      printf("The telemetry directory is not set\n");
+      return 1;
+    }
+    return RunTelemetryQuery(Parser.value(TelemetryOption), Parser.value(QueryOption),
+                             Parser.isSet("from") ? QDateTime::fromString(Parser.value(FromOption), "yyyyMMddHHmm").toMSecsSinceEpoch() : 0,
+                             Parser.isSet("to") ? QDateTime::fromString(Parser.value(ToOption), "yyyyMMddHHmm").toMSecsSinceEpoch() : INT64_MAX) ? 0 : 1;
+  }
+  // Export archived frames into the directory layout of the classification and exit
+  if (Parser.isSet("export"))
+  {
+    FrameArchiveReader Reader;
+    const QString ExportPath = Parser.value(ExportPathOption)+'/';
+    const char* LabelDirs[] = { "clear/", "clouds/", "invalid/" };
+    int First = 0;
+    int Last = 0;
+    std::vector<unsigned char> Data;
+
+    if (!Reader.Open(Parser.value(ExportOption)))
+    {
+      printf("Unable to open the frame archive %s\n", qPrintable(Parser.value(ExportOption)));
+      return 1;
+    }
+    Reader.FindRange(Parser.isSet("from") ? QDateTime::fromString(Parser.value(FromOption), "yyyyMMddHHmm").toMSecsSinceEpoch() : 0,
+                     Parser.isSet("to") ? QDateTime::fromString(Parser.value(ToOption), "yyyyMMddHHmm").toMSecsSinceEpoch() : INT64_MAX,
+                     First, Last);
+    for (int i = First; i < Last; ++i)
+    {
+      const ArchiveRecord& Record = Reader.GetRecord(i);
+      const QDateTime Time = QDateTime::fromMSecsSinceEpoch(Record.Timestamp);
+      const QString Dir = ExportPath+(Record.Label >= 0 && Record.Label <= 2 ? LabelDirs[Record.Label] : "");
+      const QString FileName = QString("allskycam_%1_%2.jpg").arg(Time.toString("yyyyMMdd")).arg(Time.toString("HHmm"));
+
+      QDir().mkpath(Dir);
+      if (!Reader.ReadFrame(i, Data) || !WriteBuffer(Dir+FileName, Data))
+      {
+        printf("Unable to export frame %d\n", i);
+        return 1;
+      }
+    }
+    printf("%d frames exported to %s\n", Last-First, qPrintable(ExportPath));
+    return 0;
+  }
+  // Decode the frames of a raw night file and exit
+  if (Parser.isSet("exportraw"))
+  {
+    RawFrameReader Reader;
+    const QString ExportPath = Parser.value(ExportPathOption)+'/';
+    const int64_t From = Parser.isSet("from") ? QDateTime::fromString(Parser.value(FromOption), "yyyyMMddHHmm").toMSecsSinceEpoch() : 0;
+    const int64_t To = Parser.isSet("to") ? QDateTime::fromString(Parser.value(ToOption), "yyyyMMddHHmm").toMSecsSinceEpoch() : INT64_MAX;
+    int Count = 0;
+    MEImage Image;
+
+    if (!Reader.Open(Parser.value(ExportRawOption)))
+    {
+      printf("Unable to open the raw frames %s\n", qPrintable(Parser.value(ExportRawOption)));
+      return 1;
+    }
+    QDir().mkpath(ExportPath);
+    for (int i = 0; i < Reader.GetCount(); ++i)
+    {
+      if (Reader.GetTimestamp(i) < From || Reader.GetTimestamp(i) >= To)
+        continue;
+
+      const QDateTime Time = QDateTime::fromMSecsSinceEpoch(Reader.GetTimestamp(i));
+
+      if (!Reader.ReadFrame(i, Image))
+      {
+        printf("Unable to export raw frame %d\n", i);
+        return 1;
+      }
+      Image.SaveToFile((ExportPath+QString("allskycam_%1.png").arg(Time.toString("yyyyMMdd_HHmmss"))).toStdString());
+      Count++;
+    }
+    printf("%d raw frames exported to %s\n", Count, qPrintable(ExportPath));
+    return 0;
+  }
+
+  // Append the new labelled images to the training dataset and exit
+  if (Parser.isSet("pack"))
+  {
+    DatasetPacker Packer(Parser.value(DatasetOption));
+
+    if (!Packer.Open() || !Packer.Pack(Parser.value(PackOption), (int)std::thread::hardware_concurrency()))
+    {
+      printf("Unable to pack the images of %s\n", qPrintable(Parser.value(PackOption)));
+      return 1;
+    }
+    printf("%d images added to %s (%d images)\n", Packer.GetAddedCount(), qPrintable(Parser.value(DatasetOption)),
+           Packer.GetCount());
+    return 0;
+  }
+  // Undo the moves of an interrupted sorting and exit
+  if (Parser.isSet("rollback"))
+  {
+    FileMover Mover(Parser.value(RollbackOption)+"/.allskycam_sort.journal");
+
+    if (!Mover.Open(FileMover::Rollback))
+    {
+      printf("Unable to roll back the sorting in %s\n", qPrintable(Parser.value(RollbackOption)));
+      return 1;
+    }
+    printf("%d moves rolled back in %s\n", Mover.GetRecoveredCount(), qPrintable(Parser.value(RollbackOption)));
+    return 0;
+  }
 
   if (Parser.isSet("modelprefix"))
   {
@@ -234,27 +546,31 @@ int main(int argc, char* argv[])
     if (Parser.isSet("testimage") &&
         (QFile(Parser.value(TestImageOption)).exists() || QDir(Parser.value(TestImageOption)).exists()))
     {
-      QStringList Files;
+      DirectoryEnumerator Files;
       int FilesCount = 0;
-      bool PathMode = true;
+      const bool PathMode = QDir(Parser.value(TestImageOption)).exists();
+      QString filename = PathMode ? QString() : Parser.value(TestImageOption);
+      FileMover Mover(Parser.value(TestImageOption)+"/.allskycam_sort.journal");
 
-      if (QDir(Parser.value(TestImageOption)).exists())
-      {
-        QStringList Filenames = QDir(Parser.value(TestImageOption)).entryList(QStringList() << "*.png" << "*.jpg" << "*.jpeg",
-                                                                              QDir::Files | QDir::NoDotAndDotDot, QDir::Name);
+      // An interrupted sorting is finished first
+      if (PathMode && Parser.isSet("sort") && !Mover.Open())
+        return 1;
+
+      // The output of an earlier sorting is not classified again
+      Files.SetSkippedDirs(QStringList({ "clear", "clouds", "invalid" }));
+      // The images are classified while the directory is read
+      if (PathMode && !Files.Open(Parser.value(TestImageOption), Parser.isSet("recursive"), Parser.isSet("ordered")))
+        return 1;
 
-        for (auto filename : Filenames)
-          Files += Parser.value(TestImageOption)+'/'+filename;
-      } else {
-        PathMode = false;
-        Files << Parser.value(TestImageOption);
-      }
       int Hits = 0;
 
-      for (auto filename : Files)
+      for (bool Next = PathMode ? Files.Next(filename) : true; Next; Next = PathMode && Files.Next(filename))
       {
         MEImage TestImage;
         std::unique_ptr<MEImage> TempImage;
+        // The subdirectories are kept under the label directories, equal names do not collide
+        const QString Subdir = QDir(Parser.value(TestImageOption)).relativeFilePath(filename.section('/', 0, -2));
+        const QString Target = PathMode && !Subdir.isEmpty() && Subdir != "." ? '/'+Subdir : QString();
 
         TestImage.LoadFromFile(filename.toStdString());
         if (TestImage.GetLayerCount() == 3)
@@ -265,18 +581,15 @@ int main(int argc, char* argv[])
           {
             if (PathMode && Parser.isSet("sort"))
             {
-              QDir().mkpath(Parser.value(TestImageOption)+"/invalid");
-              QFile(filename).rename(Parser.value(TestImageOption)+"/invalid/"+filename.section('/', -1, -1));
+              Mover.Move(filename, Parser.value(TestImageOption)+"/invalid"+Target);
             }
             continue;
           }
         }
-        if (TestImage.GetLayerCount() == 1)
-        {
-          TestImage.ConvertToRGB();
-        }
-        TempImage.reset(TestImage.GetLayer(2));
-        TempImage->Resize(160, 96, true);
+        TempImage.reset(CppInference::PrepareImage(TestImage));
+        if (!TempImage.get())
+          continue;
+
         int Label = SkyModel->Predict(*TempImage);
 
         if (Label == 0)
@@ -286,8 +599,7 @@ int main(int argc, char* argv[])
           printf("%s -> Clear\n", qPrintable(filename.section('/', -1, -1)));
           if (PathMode && Parser.isSet("sort"))
           {
-            QDir().mkpath(Parser.value(TestImageOption)+"/clear");
-            QFile(filename).rename(Parser.value(TestImageOption)+"/clear/"+filename.section('/', -1, -1));
+            Mover.Move(filename, Parser.value(TestImageOption)+"/clear"+Target);
           }
         }
         if (Label == 1)
@@ -296,11 +608,14 @@ int main(int argc, char* argv[])
           printf("%s -> Cloud\n", qPrintable(filename.section('/', -1, -1)));
           if (PathMode && Parser.isSet("sort"))
           {
-            QDir().mkpath(Parser.value(TestImageOption)+"/clouds");
-            QFile(filename).rename(Parser.value(TestImageOption)+"/clouds/"+filename.section('/', -1, -1));
+            Mover.Move(filename, Parser.value(TestImageOption)+"/clouds"+Target);
           }
         }
       }
+      Mover.Close();
+      if (Mover.GetMoveCount() > 0)
+        printf("%d images moved (%1.0f moves/s)\n", Mover.GetMoveCount(), Mover.GetMovesPerSecond());
+
       if (FilesCount > 0)
       {
         printf("Results: Clear: %1.3f %% - Clouds: %1.3f %% (%d/%d/%d)\n", (float)Hits / FilesCount*100,
@@ -310,19 +625,534 @@ int main(int argc, char* argv[])
       }
       return 0;
     }
+    // Classify the images written into the watched directories, the model stays loaded between the batches
+    if (Parser.isSet("watch"))
+    {
+      FolderWatcher Watcher;
+      const int BatchWindow = Parser.value(BatchWindowOption).toInt();
+      const int MaxBatch = 16;
+      QStringList Files;
+      FileMover Mover(Parser.value(WatchOption).section(',', 0, 0)+"/.allskycam_sort.journal", FileMover::PerBatch);
+
+      if (Parser.isSet("sort") && !Mover.Open())
+        return 1;
+
+      for (auto path : Parser.value(WatchOption).split(','))
+      {
+        if (!Watcher.Add(path))
+          return 1;
+      }
+      while (Watcher.WaitForFiles(Files, BatchWindow, MaxBatch))
+      {
+        std::vector<std::unique_ptr<MEImage>> Images;
+        std::vector<MEImage*> Batch;
+        QStringList BatchFiles;
+
+        for (auto filename : Files)
+        {
+          const QString Dir = filename.section('/', 0, -2);
+          MEImage TestImage;
+
+          TestImage.LoadFromFile(filename.toStdString());
+          if (TestImage.GetLayerCount() == 3)
+          {
+            MEImage TempImage(TestImage);
+
+            TempImage.Resize(160, 96, true);
+            if (!ValidateImage(TempImage, filename))
+            {
+              if (Parser.isSet("sort"))
+              {
+                Mover.Move(filename, Dir+"/invalid");
+              }
+              continue;
+            }
+          }
+          Images.emplace_back(CppInference::PrepareImage(TestImage));
+          if (!Images.back().get())
+          {
+            printf("%s -> Unreadable\n", qPrintable(filename.section('/', -1, -1)));
+            Images.pop_back();
+            continue;
+          }
+          Batch.push_back(Images.back().get());
+          BatchFiles << filename;
+        }
+        if (Batch.empty())
+          continue;
+
+        const std::vector<int> Labels = SkyModel->PredictBatch(Batch);
+
+        for (int i = 0; i < (int)Labels.size(); ++i)
+        {
+          const QString Dir = BatchFiles[i].section('/', 0, -2);
+          const QString Name = BatchFiles[i].section('/', -1, -1);
+
+          if (Labels[i] != 0 && Labels[i] != 1)
+            continue;
+
+          printf("%s -> %s\n", qPrintable(Name), Labels[i] == 0 ? "Clear" : "Cloud");
+          fflush(stdout);
+          if (Parser.isSet("sort"))
+          {
+            Mover.Move(BatchFiles[i], Dir+(Labels[i] == 0 ? "/clear" : "/clouds"));
+          }
+        }
+        Mover.Flush();
+      }
+      return 0;
+    }
   }
 
-  while (true)
+  std::unique_ptr<CaptureSource> Camera(CaptureSource::Create(Parser.value(CaptureOption)));
+
+  if (!Camera.get())
+    return 1;
+
+  // The captured frames are handed over in shared memory instead of temporary files
+  FrameRing Frames;
+
+  if (!Frames.Create(4, CaptureSource::GetFrameBufferSize(640, 384)))
+    return 1;
+
+  // The stages run in their own threads, a slow stage drops the oldest queued frame
+  // instead of delaying the next exposure
+  FrameQueue<std::unique_ptr<CaptureJob>> AnalysisQueue(2);
+  FrameQueue<std::unique_ptr<CaptureJob>> EncodeQueue(2);
+  PipelineStats Stats;
+  // The archive, web and panorama files are written in the background
+  OutputWriter Writer;
+  std::unique_ptr<AdaptiveJpegEncoder> BudgetEncoder;
+  std::unique_ptr<DuplicateFilter> Dedup;
+  // Per-frame telemetry, it is appended by the analysis stage
+  TelemetryLog Telemetry;
+
+  if (Parser.isSet("telemetry"))
+    Telemetry.Open(Parser.value(TelemetryOption));
+  // Night segments of the archived frames in the image path
+  std::unique_ptr<FrameArchive> Archive;
+
+  if (Parser.isSet("imagepath") && QDir(Parser.value(PathOption)).exists())
+    Archive.reset(new FrameArchive(Parser.value(PathOption)));
+  // Full quality archiving of the uncertain frames only
+  std::unique_ptr<ArchivePolicy> Policy;
+
+  if (Parser.isSet("archivemargin"))
+    Policy.reset(new ArchivePolicy(Parser.value(ArchiveMarginOption).toFloat()));
+  const int DuplicateUploadCadence = Parser.value(DedupUploadOption).toInt();
+
+  if (Parser.isSet("dedup"))
+    Dedup.reset(new DuplicateFilter(Parser.value(DedupOption).toInt()));
+
+  if (Parser.isSet("jpegbudget"))
   {
-    QTime CurrentTime = QTime::currentTime();
-    QTime Sunrise, Sunset;
-    static int ClearSkyCount = 0;
+    const int JpegBudget = Parser.value(JpegBudgetOption).toInt();
+
+    // The quality prediction needs a positive size
+    if (JpegBudget <= 0)
+    {
+      MC_WARNING("Invalid JPEG budget: %s", qPrintable(Parser.value(JpegBudgetOption)));
+      return 1;
+    }
+    BudgetEncoder.reset(new AdaptiveJpegEncoder(JpegBudget));
+    BudgetEncoder->Progressive = Parser.isSet("progressive");
+  }
+  std::unique_ptr<FtpUploader> Uploader;
+  // Live view of the latest frame from memory
+  std::unique_ptr<HttpServer> Http;
+
+  if (Parser.isSet("httpport"))
+  {
+    Http.reset(new HttpServer(Parser.value(HttpPortOption).toInt()));
+    if (!Http->Start())
+      Http.reset();
+  }
+  // Timelapse video of the night, it is written by the writer thread
+  TimelapseWriter Timelapse;
+
+  if (Parser.isSet("timelapse"))
+  {
+    // The videos of the earlier nights are finished, the one of this night is continued at night
+    QDir().mkpath(Parser.value(TimelapseOption));
+    TimelapseWriter::FinishStale(Parser.value(TimelapseOption), Parser.value(TimelapseOption)+"/timelapse_"+
+                                 FrameArchive::GetNightName(QDateTime::currentMSecsSinceEpoch())+".avi");
+  }
+  // Lossless raw night frames before the calibration, they are encoded by the writer thread
+  std::unique_ptr<RawFrameWriter> RawFrames;
+
+  if (Parser.isSet("rawframes"))
+    RawFrames.reset(new RawFrameWriter(Parser.value(RawFramesOption)));
+  // Processed frames and events for the other processes of the host
+  FrameRing PublishedFrames;
+  std::unique_ptr<EventPublisher> Events;
+
+  if (Parser.isSet("framering") &&
+      !PublishedFrames.Create(4, CaptureSource::GetFrameBufferSize(640, 384), Parser.value(FrameRingOption)))
+  {
+    MC_WARNING("Unable to create the frame ring %s", qPrintable(Parser.value(FrameRingOption)));
+  }
+  if (Parser.isSet("events"))
+  {
+    Events.reset(new EventPublisher(Parser.value(EventsOption)));
+    if (!Events->Start())
+      Events.reset();
+  }
+  // Compaction of the old nights in the image path
+  std::unique_ptr<Housekeeper> Keeper;
+
+  Writer.Start();
+  if (Archive.get() && Parser.isSet("housekeeping"))
+  {
+    Keeper.reset(new Housekeeper(Parser.value(PathOption), Parser.value(HousekeepingOption).toInt(),
+                                 Parser.value(IoBudgetOption).toInt()));
+    Keeper->Start();
+  }
+
+  if (Parser.isSet("cameraid") && Parser.isSet("password"))
+  {
+    Uploader.reset(new FtpUploader(Parser.value(FtpServerOption), Parser.value(CameraIDOption), Parser.value(PasswordOption),
+                                   "capture.jpg"));
+    Uploader->Start();
+  }
+
+  // Capture, notification and maintenance events, the stages add their events from their threads
+  EventScheduler Scheduler;
+
+  // Classification, night products and the composition of the published image
+  std::thread AnalysisThread([&]()
+  {
+    std::unique_ptr<CaptureJob> Job;
+    int CurrentNightMode = -1;
+    int ClearSkyCount = 0;
+    int LastArchiveBytes = 0;
+
+    while (AnalysisQueue.Pop(Job))
+    {
+      StageTimer Timer(Stats, PipelineStats::Analysis);
+      MEImage& CapturedImage = Job->Image;
+
+      // Start or finish the night products at the mode changes of the capture stage
+      if (Job->NightMode != CurrentNightMode)
+      {
+        ClearSkyCount = 0;
+        if (Job->NightMode == 1)
+        {
+          // The night products are named after the evening of the night
+          const QString NightName = Job->Timestamp.addSecs(-12*3600).toString("yyyyMMdd");
+
+          if (Parser.isSet("stack"))
+            Stacker.Start(Parser.value(StackOption), NightName);
+          if (Parser.isSet("keogram"))
+            NightKeogram.Start(Parser.value(KeogramOption), NightName);
+        } else {
+          if (Stacker.IsActive())
+            Stacker.Finish();
+          if (NightKeogram.IsActive())
+            NightKeogram.Finish();
+          if (Denoiser.get())
+            Denoiser->Reset();
+          if (Policy.get())
+            Policy->LogNight();
+        }
+        CurrentNightMode = Job->NightMode;
+      }
+      // Downsampled red layer for the classification and the duplicate detection
+      std::unique_ptr<MEImage> SmallImage(CppInference::PrepareImage(CapturedImage));
+
+      const uint64_t Hash = Dedup.get() ? ComputeImageHash(*SmallImage) : 0;
+      bool DuplicateChecked = false;
+      // The near-duplicates of an unchanged sky are not archived, a label change or a frame
+      // archived in full quality is never suppressed
+      auto ArchiveFrame = [&](int label, const float* probabilities)
+      {
+        const bool FullQuality = !Policy.get() || Policy->IsFullQuality(label, probabilities);
+
+        DuplicateChecked = true;
+        Job->Duplicate = Dedup.get() && Dedup->IsDuplicate(Hash, label, Policy.get() && FullQuality);
+        if (Job->Duplicate)
+        {
+          Dedup->AddSuppressedWrite(LastArchiveBytes);
+          return;
+        }
+        ImageBuffer Jpeg;
+        ArchiveRecord Record = {};
+
+        if (FullQuality)
+        {
+          Jpeg = EncodeJpeg(CapturedImage);
+        } else {
+          MEImage Thumbnail(CapturedImage);
+
+          Thumbnail.Resize(CppInference::InputWidth, CppInference::InputHeight, true);
+          Jpeg = EncodeJpeg(Thumbnail, 85);
+        }
+
+        if (!Jpeg.get())
+          return;
+
+        Record.Timestamp = Job->Timestamp.toMSecsSinceEpoch();
+        Record.Label = label;
+        if (probabilities != nullptr)
+        {
+          Record.Probabilities[0] = probabilities[0];
+          Record.Probabilities[1] = probabilities[1];
+        }
+        Record.ShutterTime = Job->ShutterTime;
+        Record.Iso = Job->Iso;
+        Record.Brightness = Job->Brightness;
+        Record.SunArea = Job->SunArea;
+        LastArchiveBytes = (int)Jpeg->size();
+        if (Policy.get())
+          Policy->AddWritten(FullQuality, LastArchiveBytes);
+        // The archive is appended in the writer thread
+        Writer.Post([&Archive, Record, Jpeg]() { Archive->Append(Record, *Jpeg); });
+      };
+      // Clear sky detection with deep learning
+      int Clouds = -1;
+
+      if (Archive.get() && Job->NightMode == 1)
+      {
+        if (SkyModel.get())
+        {
+          std::unique_ptr<MEImage> TempImage(new MEImage(CapturedImage));
+
+          TempImage->Resize(160, 96, true);
+          if (ValidateImage(*TempImage))
+          {
+            float Probabilities[2] = { 0, 0 };
+            int Label = SkyModel->Predict(*SmallImage, Probabilities);
+
+            if (Label == 0 || Label == 1)
+            {
+              Job->Probabilities[0] = Probabilities[0];
+              Job->Probabilities[1] = Probabilities[1];
+              ArchiveFrame(Label, Probabilities);
+              Clouds = Label;
+            }
+          } else {
+            ArchiveFrame(ArchiveRecord::Invalid, nullptr);
+          }
+        } else {
+          ArchiveFrame(ArchiveRecord::Unlabeled, nullptr);
+        }
+      }
+      // The frames which are not archived are compared for the upload only
+      if (Dedup.get() && !DuplicateChecked)
+        Job->Duplicate = Dedup->IsDuplicate(Hash, ArchiveRecord::Unlabeled);
+
+      // Accumulate the night stacks from the calibrated frame
+      if (Job->NightMode == 1 && Stacker.IsActive())
+        Stacker.Add(CapturedImage);
+
+      // Create an image for upload
+      ME::ImageSPtr RedLayer;
+      MEImage TempImage;
+      QString Text;
+
+      TempImage = CapturedImage;
+      TempImage.GammaCorrection(0.3);
+      TempImage.Threshold(140);
+      RedLayer.reset(TempImage.GetLayer(2));
+      TempImage = *RedLayer;
+      TempImage.ConvertToRGB();
+      // Do gamma correction if the shutter speed is very short because of direct sunlight
+      if (Job->NightMode == 0 && Job->Brightness < 100)
+        CapturedImage.GammaCorrection(0.5);
+
+      // Clear sky detection and info layer composition in night mode
+      int Label = Clouds;
+
+      if (Job->NightMode == 1)
+      {
+        const bool Cloudy = Clouds == 1 ||
+                            (Clouds == -1 && (float)TempImage.GetWhitePixelCount() / CapturedImage.GetHeight() / CapturedImage.GetWidth() / 3 > 5);
+
+        Label = Cloudy ? 1 : 0;
+
+        // Only the published image is denoised, the raw frame was used for the classification
+        if (Denoiser.get())
+          Denoiser->Process(CapturedImage, Job->ShutterTime, Job->Iso);
+        CapturedImage.GammaCorrection(0.5);
+        if (NightKeogram.IsActive())
+          NightKeogram.Add(CapturedImage, Cloudy ? 1 : 0);
+        if (Cloudy)
+        {
+          Text = QString("Clouds");
+        } else {
+          ClearSkyCount++;
+          if (ClearSkyCount == 30 && Parser.isSet("smtpuser") && Parser.isSet("smtppass") && Parser.isSet("email"))
+          {
+            const QString SmtpUser = Parser.value(SmtpUserOption);
+            const QString SmtpPass = Parser.value(SmtpPassOption);
+            const QString Email = Parser.value(EmailOption);
+
+            // The SMTP session blocks, it runs in the writer thread instead of the capture or the analysis
+            Scheduler.ScheduleIn("notification", 0, [&Writer, SmtpUser, SmtpPass, Email](int64_t)
+            {
+              Writer.Post([SmtpUser, SmtpPass, Email]() { SendEmailNotification(SmtpUser, SmtpPass, Email); });
+            });
+          }
+          Text = QString("Clear Sky");
+          if (InfoLayer)
+            CapturedImage.Addition(InfoLayerImage, ME::NonNegativeSumAddition);
+        }
+        CapturedImage.DrawText(CapturedImage.GetWidth()-220, CapturedImage.GetHeight()-25, Text.toStdString(),
+                               0.8, MEColor(255, 255, 255));
+      }
+      // Exposure and classification state of the frame
+      if (Telemetry.IsOpen())
+      {
+        TelemetryRecord Record = {};
+
+        Record.Timestamp = Job->Timestamp.toMSecsSinceEpoch();
+        Record.ShutterTime = Job->ShutterTime;
+        Record.Iso = Job->Iso;
+        Record.Brightness = Job->Brightness;
+        Record.SunArea = Job->SunArea;
+        Record.ClearSkyCount = ClearSkyCount;
+        Record.NightMode = (int8_t)Job->NightMode;
+        Record.Label = (int8_t)Label;
+        Telemetry.Append(Record);
+      }
+      Job->Label = Label;
+      if (!EncodeQueue.Push(std::move(Job)))
+        Stats.AddDropped(PipelineStats::Encode);
+    }
+  });
+
+  // Compression of the final image, the local copies and the upload
+  std::thread EncodeThread([&]()
+  {
+    std::unique_ptr<CaptureJob> Job;
+    int SkippedUploads = 0;
+    // The first day frame after a restart finishes the video of the night
+    bool TimelapseNight = true;
+    ChannelEvent LastEvent = {};
+
+    while (EncodeQueue.Pop(Job))
+    {
+      StageTimer Timer(Stats, PipelineStats::Encode);
+      HousekeepingPause Pause(Keeper.get());
+
+      // The shared frame and its events go out before the compression
+      const bool Published = PublishedFrames.IsOpen() &&
+                             PublishedFrames.Publish(Job->Image, Job->Timestamp.toMSecsSinceEpoch(), Job->ShutterTime, Job->Iso);
+
+      if (Events.get())
+      {
+        ChannelEvent Event = {};
+
+        // The previous frame is still in the ring, its sequence would point the subscribers to it
+        Event.Sequence = Published ? PublishedFrames.GetSequence() : 0;
+        Event.Timestamp = Job->Timestamp.toMSecsSinceEpoch();
+        Event.Label = Job->Label;
+        Event.Probabilities[0] = Job->Probabilities[0];
+        Event.Probabilities[1] = Job->Probabilities[1];
+        Event.ShutterTime = Job->ShutterTime;
+        Event.Iso = Job->Iso;
+        Event.Brightness = Job->Brightness;
+        Event.NightMode = Job->NightMode;
+        if (Event.Label != LastEvent.Label || LastEvent.Type == 0)
+        {
+          Event.Type = ChannelEvent::LabelEvent;
+          Events->Publish(Event);
+        }
+        if (Event.ShutterTime != LastEvent.ShutterTime || Event.Iso != LastEvent.Iso)
+        {
+          Event.Type = ChannelEvent::ExposureEvent;
+          Events->Publish(Event);
+        }
+        Event.Type = ChannelEvent::FrameEvent;
+        Events->Publish(Event);
+        LastEvent = Event;
+      }
+      // The final image is compressed only once for the web image and the upload
+      const ImageBuffer Jpeg = BudgetEncoder.get() ? BudgetEncoder->Encode(Job->Image) : EncodeJpeg(Job->Image);
+
+      if (!Jpeg.get())
+      {
+        MC_WARNING("Unable to compress the captured image");
+        continue;
+      }
+      if (Http.get())
+        Http->Publish(Jpeg, FormatStatus(*Job, (int)Jpeg->size()));
+      if (Parser.isSet("webfile"))
+      {
+        Writer.Write(Parser.value(WebFileOption), Jpeg);
+        // Optional azimuth/altitude panorama next to the web image
+        if (Parser.isSet("panorama"))
+        {
+          const QFileInfo WebFileInfo(Parser.value(WebFileOption));
+
+          if (!Projection.IsValid(Job->Image))
+            Projection.Init(Lens, Job->Image.GetWidth(), Job->Image.GetHeight(), 720, 180);
 
-    // Check the current time and select daytime or night shutter mode based on sunset/sunrise
+          MEImage Panorama(Projection.GetWidth(), Projection.GetHeight(), Job->Image.GetLayerCount());
+
+          if (Projection.Apply(Job->Image, Panorama))
+          {
+            Writer.Write(WebFileInfo.path()+'/'+WebFileInfo.completeBaseName()+"_panorama."+WebFileInfo.suffix(),
+                         EncodeJpeg(Panorama));
+          }
+        }
+      }
+      // The night frames are appended to the timelapse video in the writer thread, it is finished at sunrise
+      if (Parser.isSet("timelapse") && (Job->NightMode == 1 || TimelapseNight))
+      {
+        const QString Filename = Parser.value(TimelapseOption)+"/timelapse_"+
+                                 FrameArchive::GetNightName(Job->Timestamp.toMSecsSinceEpoch())+".avi";
+        const int Width = Job->Image.GetWidth();
+        const int Height = Job->Image.GetHeight();
+
+        TimelapseNight = Job->NightMode == 1;
+        Writer.Post([&Timelapse, Filename, Width, Height, Jpeg, TimelapseNight]()
+        {
+          if (!TimelapseNight)
+          {
+            Timelapse.Finish();
+            TimelapseWriter::FinishStale(QFileInfo(Filename).path(), QString());
+            return;
+          }
+          // A new night without a day in between
+          if (Timelapse.IsOpen() && Timelapse.GetFilename() != Filename)
+            Timelapse.Finish();
+          if ((Timelapse.IsOpen() && Timelapse.GetFilename() == Filename) || Timelapse.Open(Filename, Width, Height, TimelapseFps))
+            Timelapse.Append(*Jpeg);
+        });
+      }
+      // Upload the image to Wunderground in the background, the near-duplicates less frequently
+      if (Uploader.get())
+      {
+        if (Job->Duplicate && SkippedUploads+1 < DuplicateUploadCadence)
+        {
+          SkippedUploads++;
+          Dedup->AddSuppressedUpload((int)Jpeg->size());
+        } else {
+          SkippedUploads = 0;
+          Uploader->Upload(Jpeg);
+        }
+      }
+      MC_LOG("Image captured (brightness: %d, sunarea: %1.4f)", Job->Brightness, Job->SunArea);
+    }
+  });
+
+  std::function<void(int64_t)> CaptureFrame;
+  QTime Sunrise, Sunset;
+
+  // Sunset/sunrise of the current day
+  Scheduler.Schedule("sun", Scheduler.Now(), [&](int64_t)
+  {
     SunriseTime = GetTime(SunCalc.get_sunrise());
     Sunrise = QTime(SunriseTime.tm_hour, SunriseTime.tm_min);
     SunsetTime = GetTime(SunCalc.get_sunset());
     Sunset = QTime(SunsetTime.tm_hour+GmtCorrection, SunsetTime.tm_min);
+  }, SunRefreshPeriod);
+  // Capture stage: day/night mode, exposure control and the frame period
+  CaptureFrame = [&](int64_t deadline)
+  {
+    QTime CurrentTime = QTime::currentTime();
+
+    // Select daytime or night shutter mode based on sunset/sunrise
     if ((NightMode == -1 || NightMode == 0) && (CurrentTime > Sunset || CurrentTime < Sunrise) &&
         // No night mode in too sunny summer locations
         SunsetTime.tm_hour+GmtCorrection <= 23)
@@ -331,7 +1161,6 @@ int main(int argc, char* argv[])
       ShutterTime = 4500000;
       Iso = 800;
       NightMode = 1;
-      ClearSkyCount = 0;
     } else
     if ((NightMode == -1 || NightMode == 1) &&
         ((CurrentTime > Sunrise && CurrentTime < Sunset) || SunsetTime.tm_hour+GmtCorrection > 23))
@@ -340,170 +1169,134 @@ int main(int argc, char* argv[])
       ShutterTime = (NightMode == -1 ? 500 : 4500000);
       Iso = 100;
       NightMode = 0;
-      ClearSkyCount = 0;
     } else
     if (NightMode == 0 && Iso == 100 && CurrentTime > QTime(Sunset.hour()-1, Sunset.minute()) && CurrentTime < Sunset)
     {
       MC_LOG("Change to daylight mode (high ISO mode)");
       Iso = 800;
     }
-    if (NightMode == 0)
-    {
-      printf("Wait %d\n", LongWait);
-      sleep(LongWait ? 1200 : 30);
-      LongWait = false;
-    }
     // Capture an image
-    QString CommandStr;
+    std::unique_ptr<CaptureJob> Job(new CaptureJob);
+    CaptureSettings Settings;
 
-    CommandStr = QString("raspistill -awb cloud -ISO %1 -sa %2 -n -w 640 -h 384 -ss %3 -vf -hf -o /tmp/capture.png").arg((int)Iso).
-                 arg(NightMode == 0 ? 20 : 0).arg((int)ShutterTime);
-    printf("Start capture\n");
-    QProcess::execute(CommandStr);
-    if (!MCFileExists("/tmp/capture.png"))
     {
-      MC_WARNING("Image was not captured!");
-      sleep(30);
-      continue;
-    }
-    // Change the shutter speed if needed
-    MEImage CapturedImage;
+      StageTimer Timer(Stats, PipelineStats::Capture);
+      HousekeepingPause Pause(Keeper.get());
 
-    CapturedImage.LoadFromFile("/tmp/capture.png");
-    // Clear sky detection with deep learning
-    int Clouds = -1;
+      Settings.ShutterTime = ShutterTime;
+      Settings.Iso = Iso;
+      Settings.Saturation = NightMode == 0 ? 20 : 0;
+      printf("Start capture\n");
+      const CaptureError Error = Camera->Capture(Frames, Settings);
 
-    if (Parser.isSet("imagepath") && QDir(Parser.value(PathOption)).exists() && NightMode == 1)
-    {
-      const QString Path = Parser.value(PathOption)+'/';
-      const QString FileName = QString("allskycam_%1_%2.jpg").arg(QDateTime::currentDateTime().toString("yyyyMMdd")).
-                                arg(QDateTime::currentDateTime().toString("HHmm"));
-
-      if (SkyModel.get())
+      if (Error != CaptureOk || !Frames.CopyToImage(Frames.GetLatest(), Job->Image))
       {
-        std::unique_ptr<MEImage> TempImage(new MEImage(CapturedImage));
-
-        TempImage->Resize(160, 96, true);
-        if (ValidateImage(*TempImage))
-        {
-          std::unique_ptr<MEImage> TestImage(CapturedImage.GetLayer(2));
-
-          TestImage->Resize(160, 96, true);
-          int Label = SkyModel->Predict(*TestImage);
-
-          QDir().mkpath(Path+"clear");
-          QDir().mkpath(Path+"clouds");
-          if (Label == 0)
-          {
-            CapturedImage.SaveToFile((Path+"clear/"+FileName).toStdString());
-            Clouds = 0;
-          }
-          if (Label == 1)
-          {
-            CapturedImage.SaveToFile((Path+"clouds/"+FileName).toStdString());
-            Clouds = 1;
-          }
-        } else {
-          QDir().mkpath(Path+"invalid");
-          CapturedImage.SaveToFile((Path+"invalid/"+FileName).toStdString());
-        }
-      } else {
-        CapturedImage.SaveToFile((Path+FileName).toStdString());
+        MC_WARNING("Image was not captured: %s", CaptureSource::GetErrorString(Error != CaptureOk ? Error : CaptureInvalidFrame));
+        Scheduler.ScheduleIn("capture", CaptureRetryDelay, CaptureFrame);
+        return;
       }
-    }
+      MEImage& CapturedImage = Job->Image;
 
-    // Create an image for upload
-    ME::ImageSPtr RedLayer;
-    MEImage TempImage;
-    QString Text;
-
-    TempImage = CapturedImage;
-    TempImage.GammaCorrection(0.3);
-    TempImage.Threshold(140);
-    RedLayer.reset(TempImage.GetLayer(2));
-    TempImage = *RedLayer;
-    TempImage.ConvertToRGB();
-    // Shutter time control
-    int Brightness = 0;
-    float SunArea = 0;
-
-    if (NightMode == 0)
-    {
-      SunArea = GetSunArea(CapturedImage);
-      Brightness = (int)CapturedImage.AverageBrightnessLevel();
-      if (Brightness > 180 || SunArea > 0.007)
+      // The exposure control below changes the settings for the next capture
+      Job->NightMode = NightMode;
+      Job->ShutterTime = ShutterTime;
+      Job->Iso = Iso;
+      Job->Timestamp = QDateTime::currentDateTime();
+      if (RawFrames.get() && NightMode == 1)
       {
-        LongWait = true;
-        ShutterTime = 10;
-//        if (SunArea >= 0.1)
-//          ShutterTime = (int)((float)ShutterTime / 4);
-//        else
-//          ShutterTime = (int)((float)ShutterTime / 2);
-        MC_LOG("Average brightness: %d - Sun area: %1.4f - Decrease shutter time to %d", Brightness, SunArea, (int)ShutterTime);
-      } else
-      if (Brightness < 100 && SunArea < 0.02)
-      {
-        ShutterTime = (int)((float)ShutterTime*1.2);
-        MC_LOG("Average brightness: %d - Increase shutter time to %d", Brightness, (int)ShutterTime);
-      }
-      // Do gamma correction if the shutter speed is very short because of direct sunlight
-      if (Brightness < 100)
-        CapturedImage.GammaCorrection(0.5);
-    } else {
-      Brightness = (int)CapturedImage.AverageBrightnessLevel();
+        std::shared_ptr<MEImage> RawImage(new MEImage(CapturedImage));
+        const int64_t Timestamp = Job->Timestamp.toMSecsSinceEpoch();
 
-//      MC_LOG("Average brightness: %d", Brightness);
-      if (Brightness > 200)
-      {
-        ShutterTime = (int)((float)ShutterTime / 1.3);
-        MC_LOG("Average brightness: %d - Decrease shutter time to %d", Brightness, (int)ShutterTime);
-      } else
-      if (Brightness <= 10)
-      {
-        ShutterTime = 4500000;
-        MC_LOG("Average brightness: %d - Reset shutter time to %d", Brightness, (int)ShutterTime);
+        Writer.Post([&RawFrames, RawImage, Timestamp]() { RawFrames->Append(Timestamp, *RawImage); });
       }
-    }
-    // Clear sky detection and info layer composition in night mode
-    if (NightMode == 1)
-    {
-      CapturedImage.GammaCorrection(0.5);
-      if (Clouds == 1 || (Clouds == -1 && (float)TempImage.GetWhitePixelCount() / CapturedImage.GetHeight() / CapturedImage.GetWidth() / 3 > 5))
+      // Dark frame, hot pixel and flat field correction before any analysis
+      if (FrameCalibration.IsOpen())
+        FrameCalibration.Apply(CapturedImage, Job->ShutterTime, Job->Iso);
+      // Shutter time control
+      int Brightness = 0;
+      float SunArea = 0;
+
+      if (NightMode == 0)
       {
-        Text = QString("Clouds");
+        SunArea = GetSunArea(CapturedImage);
+        Brightness = (int)CapturedImage.AverageBrightnessLevel();
+        if (Brightness > 180 || SunArea > 0.007)
+        {
+          LongWait = true;
+          ShutterTime = 10;
+//          if (SunArea >= 0.1)
+//            ShutterTime = (int)((float)ShutterTime / 4);
+//          else
+//            ShutterTime = (int)((float)ShutterTime / 2);
+          MC_LOG("Average brightness: %d - Sun area: %1.4f - Decrease shutter time to %d", Brightness, SunArea, (int)ShutterTime);
+        } else
+        if (Brightness < 100 && SunArea < 0.02)
+        {
+          ShutterTime = (int)((float)ShutterTime*1.2);
+          MC_LOG("Average brightness: %d - Increase shutter time to %d", Brightness, (int)ShutterTime);
+        }
       } else {
-        ClearSkyCount++;
-        if (ClearSkyCount == 30 && Parser.isSet("smtpuser") && Parser.isSet("smtppass") && Parser.isSet("email"))
+        Brightness = (int)CapturedImage.AverageBrightnessLevel();
+
+//        MC_LOG("Average brightness: %d", Brightness);
+        if (Brightness > 200)
         {
-          SendEmailNotification(Parser.value(SmtpUserOption), Parser.value(SmtpPassOption), Parser.value(EmailOption));
+          ShutterTime = (int)((float)ShutterTime / 1.3);
+          MC_LOG("Average brightness: %d - Decrease shutter time to %d", Brightness, (int)ShutterTime);
+        } else
+        if (Brightness <= 10)
+        {
+          ShutterTime = 4500000;
+          MC_LOG("Average brightness: %d - Reset shutter time to %d", Brightness, (int)ShutterTime);
         }
-        Text = QString("Clear Sky");
-        if (InfoLayer)
-          CapturedImage.Addition(InfoLayerImage, ME::NonNegativeSumAddition);
       }
-      CapturedImage.DrawText(CapturedImage.GetWidth()-220, CapturedImage.GetHeight()-25, Text.toStdString(),
-                             0.8, MEColor(255, 255, 255));
-    }
-    // Save the final image
-    if (Parser.isSet("webfile"))
-    {
-      CapturedImage.SaveToFile(Parser.value(WebFileOption).toStdString());
+      Job->Brightness = Brightness;
+      Job->SunArea = SunArea;
     }
-    CapturedImage.SaveToFile("/tmp/capture.jpg");
-    // Upload the image to Wunderground
-    if (Parser.isSet("cameraid") && Parser.isSet("password"))
-    {
-      QString UploadCommandStr;
+    if (!AnalysisQueue.Push(std::move(Job)))
+      Stats.AddDropped(PipelineStats::Analysis);
 
-      UploadCommandStr = QString("curl -s -S -T /tmp/capture.jpg ftp://webcam.wunderground.com --user %1:%2").
-                             arg(Parser.value(CameraIDOption), Parser.value(PasswordOption));
-      QProcess::execute(UploadCommandStr);
-      MC_LOG("Image uploaded (brightness: %d, sunarea: %1.4f)", Brightness, SunArea);
-    } else {
-      MC_LOG("Image captured (brightness: %d, sunarea: %1.4f)", Brightness, SunArea);
-    }
-    // Wait some time
-    sleep(40);
-  }
+    // The deadlines are measured from the start of the exposures, the previous frame is
+    // processed and uploaded in the meantime. The daylight frames are less frequent.
+    int64_t Delay = FramePeriod;
+
+    if (NightMode == 0)
+      Delay += LongWait ? DaylightLongWait : DaylightWait;
+    LongWait = false;
+    // Start a new phase after a long delay instead of a burst of captures
+    const int64_t Base = Scheduler.Now()-deadline > Scheduler.MissedThreshold ? Scheduler.Now() : deadline;
+
+    Scheduler.Schedule("capture", Base+Delay, CaptureFrame);
+  };
+  // Timing statistics of the pipeline and the scheduler
+  Scheduler.ScheduleIn("statistics", StatisticsPeriod, [&](int64_t)
+  {
+    Stats.Log();
+    Scheduler.LogStats();
+    if (Uploader.get())
+      Uploader->LogStats();
+    if (Dedup.get())
+      Dedup->LogStats();
+  }, StatisticsPeriod);
+  if (Keeper.get())
+    Scheduler.Schedule("housekeeping", Scheduler.Now(), [&](int64_t) { Keeper->Trigger(); }, HousekeepingPeriod);
+
+  MC_LOG("Capture source: %s", qPrintable(Camera->GetName()));
+  Scheduler.Schedule("capture", Scheduler.Now(), CaptureFrame);
+  Scheduler.Run();
+  AnalysisQueue.Close();
+  AnalysisThread.join();
+  EncodeQueue.Close();
+  EncodeThread.join();
+  if (Uploader.get())
+    Uploader->Stop();
+  if (Keeper.get())
+    Keeper->Stop();
+  if (Http.get())
+    Http->Stop();
+  if (Events.get())
+    Events->Stop();
+  Writer.Stop();
+  Archive.reset();
   return 0;
 }
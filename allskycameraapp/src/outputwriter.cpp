@@ -0,0 +1,129 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "outputwriter.h"
+
+#include <MCLog.hpp>
+
+OutputWriter::OutputWriter()
+{
+}
+
+
+OutputWriter::~OutputWriter()
+{
+  Stop();
+}
+
+
+void OutputWriter::Start()
+{
+  if (Worker.joinable())
+    return;
+
+  Stopped = false;
+  Worker = std::thread(&OutputWriter::Run, this);
+}
+
+
+void OutputWriter::Stop()
+{
+  if (!Worker.joinable())
+    return;
+
+  {
+    std::lock_guard<std::mutex> Lock(Mutex);
+
+    Stopped = true;
+  }
+  Condition.notify_all();
+  Worker.join();
+}
+
+
+void OutputWriter::Write(const QString& filename, const ImageBuffer& buffer)
+{
+  if (!buffer.get())
+    return;
+
+  bool Dropped = false;
+
+  {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    WriteRequest Request;
+
+    if (Writes.size() >= MaxWrites)
+    {
+      Writes.pop_front();
+      Dropped = true;
+    }
+    Request.Filename = filename;
+    Request.Buffer = buffer;
+    Writes.push_back(std::move(Request));
+  }
+  Condition.notify_one();
+  if (Dropped)
+    MC_WARNING("Output queue is full, the oldest write was dropped");
+}
+
+
+void OutputWriter::Post(const std::function<void()>& task)
+{
+  {
+    std::lock_guard<std::mutex> Lock(Mutex);
+
+    Tasks.push_back(task);
+  }
+  Condition.notify_one();
+}
+
+
+void OutputWriter::Run()
+{
+  while (true)
+  {
+    std::function<void()> Task;
+    WriteRequest Request;
+
+    {
+      std::unique_lock<std::mutex> Lock(Mutex);
+
+      Condition.wait(Lock, [this]() { return !Tasks.empty() || !Writes.empty() || Stopped; });
+      // The pending tasks and writes are finished after Stop()
+      if (!Tasks.empty())
+      {
+        Task = std::move(Tasks.front());
+        Tasks.pop_front();
+      } else
+      if (!Writes.empty())
+      {
+        Request = std::move(Writes.front());
+        Writes.pop_front();
+      } else {
+        return;
+      }
+    }
+    if (Task)
+      Task();
+    else
+      WriteBuffer(Request.Filename, *Request.Buffer);
+  }
+}
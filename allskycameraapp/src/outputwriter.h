@@ -0,0 +1,68 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include "encoder.h"
+
+#include <QString>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// Writes the compressed images in a background thread. One buffer can be
+// published to several files, every file is replaced atomically.
+class OutputWriter
+{
+public:
+  OutputWriter();
+  ~OutputWriter();
+
+  void Start();
+  void Stop();
+  // The latest frame of a file, a stalled disk drops the oldest writes
+  void Write(const QString& filename, const ImageBuffer& buffer);
+  // Other disk I/O in the order of posting, the tasks are never dropped and they
+  // are finished before Stop() returns
+  void Post(const std::function<void()>& task);
+
+  // Pending writes before the oldest one is dropped
+  size_t MaxWrites { 16 };
+
+protected:
+  struct WriteRequest
+  {
+    QString Filename;
+    ImageBuffer Buffer;
+  };
+
+  void Run();
+
+  std::mutex Mutex;
+  std::condition_variable Condition;
+  std::deque<WriteRequest> Writes;
+  std::deque<std::function<void()>> Tasks;
+  bool Stopped { false };
+  std::thread Worker;
+};
@@ -0,0 +1,564 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+
+#include "rawframes.h"
+#include "framearchive.h"
+#include "simd.h"
+
+#include <MEImage.hpp>
+
+#include <MCLog.hpp>
+
+#include <QDateTime>
+#include <QDir>
+
+#include <algorithm>
+
+#include <string.h>
+
+namespace
+{
+const char FileMagic[4] = { 'A', 'S', 'R', 'W' };
+const char FrameMagic[4] = { 'A', 'S', 'R', 'F' };
+const uint32_t FileVersion = 1;
+// Frame flags
+const uint32_t FrameKeyframe = 1;
+const uint32_t FrameStored = 2;
+// Order-0 rANS with 12 bit probabilities and byte-wise renormalization
+const int ProbabilityBits = 12;
+const uint32_t ProbabilityScale = 1 << ProbabilityBits;
+const uint32_t RansLowerBound = 1 << 23;
+const int SymbolCount = 256;
+const int FrequencyTableSize = SymbolCount*sizeof(uint16_t);
+
+struct FileHeader
+{
+  char Magic[4];
+  uint32_t Version;
+  int32_t Width;
+  int32_t Height;
+  int32_t Layers;
+  uint32_t KeyframeInterval;
+};
+
+struct FrameRecord
+{
+  char Magic[4];
+  uint32_t Flags;
+  int64_t Timestamp;
+  uint32_t Size;
+  uint32_t Reserved;
+};
+
+const qint64 HeaderSize = sizeof(FileHeader);
+const qint64 RecordSize = sizeof(FrameRecord);
+
+// The residuals are folded to 0, -1, 1, -2... -> 0, 1, 2, 3... so the dark, slowly
+// changing sky gives mostly small symbols
+struct ScalarOps
+{
+  typedef unsigned char Type;
+  static const int Width = 1;
+
+  static Type Load(const unsigned char* data) { return *data; }
+  static void Store(unsigned char* data, Type value) { *data = value; }
+  static Type Residual(Type current, Type previous)
+  {
+    const int8_t Delta = (int8_t)(current-previous);
+
+    return (Type)((Delta << 1) ^ (Delta >> 7));
+  }
+};
+
+#if defined(ASC_NEON)
+struct VectorOps
+{
+  typedef uint8x16_t Type;
+  static const int Width = SimdWidth;
+
+  static Type Load(const unsigned char* data) { return vld1q_u8(data); }
+  static void Store(unsigned char* data, Type value) { vst1q_u8(data, value); }
+  static Type Residual(Type current, Type previous)
+  {
+    const int8x16_t Delta = vreinterpretq_s8_u8(vsubq_u8(current, previous));
+
+    return vreinterpretq_u8_s8(veorq_s8(vshlq_n_s8(Delta, 1), vshrq_n_s8(Delta, 7)));
+  }
+};
+#elif defined(ASC_SSE2)
+struct VectorOps
+{
+  typedef __m128i Type;
+  static const int Width = SimdWidth;
+
+  static Type Load(const unsigned char* data) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(data)); }
+  static void Store(unsigned char* data, Type value) { _mm_storeu_si128(reinterpret_cast<__m128i*>(data), value); }
+  static Type Residual(Type current, Type previous)
+  {
+    const __m128i Delta = _mm_sub_epi8(current, previous);
+
+    return _mm_xor_si128(_mm_add_epi8(Delta, Delta), _mm_cmplt_epi8(Delta, _mm_setzero_si128()));
+  }
+};
+#endif
+
+
+// Returns the end of the processed range
+template <class Ops>
+int ComputeResiduals(const unsigned char* current, const unsigned char* previous, unsigned char* residuals, int begin,
+                     int end)
+{
+  int i = begin;
+
+  for (; i+Ops::Width <= end; i += Ops::Width)
+  {
+    Ops::Store(residuals+i, Ops::Residual(Ops::Load(current+i), Ops::Load(previous+i)));
+  }
+  return i;
+}
+
+
+void ComputeResiduals(const unsigned char* current, const unsigned char* previous, unsigned char* residuals, int size)
+{
+  int Processed = 0;
+
+#if defined(ASC_NEON) || defined(ASC_SSE2)
+  Processed = ComputeResiduals<VectorOps>(current, previous, residuals, 0, size);
+#endif
+  ComputeResiduals<ScalarOps>(current, previous, residuals, Processed, size);
+}
+
+
+unsigned char RestoreValue(unsigned char residual, unsigned char previous)
+{
+  return (unsigned char)(previous+((residual >> 1) ^ (unsigned char)-(residual & 1)));
+}
+
+
+// The frequencies sum up to the probability scale, every present symbol keeps at least 1
+void NormalizeFrequencies(const uint32_t* counts, int total, uint16_t* frequencies)
+{
+  int Sum = 0;
+
+  for (int i = 0; i < SymbolCount; ++i)
+  {
+    frequencies[i] = 0;
+    if (counts[i] > 0)
+      frequencies[i] = (uint16_t)std::max<uint64_t>(1, (uint64_t)counts[i]*ProbabilityScale / total);
+
+    Sum += frequencies[i];
+  }
+  // The rounding error goes to the most frequent symbol
+  while (Sum != (int)ProbabilityScale)
+  {
+    int Largest = 0;
+
+    for (int i = 1; i < SymbolCount; ++i)
+    {
+      if (frequencies[i] > frequencies[Largest])
+        Largest = i;
+    }
+    frequencies[Largest] += Sum < (int)ProbabilityScale ? 1 : -1;
+    Sum += Sum < (int)ProbabilityScale ? 1 : -1;
+  }
+}
+
+
+bool BuildStarts(const uint16_t* frequencies, uint32_t* starts)
+{
+  starts[0] = 0;
+  for (int i = 0; i < SymbolCount; ++i)
+  {
+    starts[i+1] = starts[i]+frequencies[i];
+  }
+  return starts[SymbolCount] == ProbabilityScale;
+}
+
+
+// The data is encoded backwards from the end of the output, returns 0 if it does not fit
+int RansEncode(const unsigned char* data, int size, const uint16_t* frequencies, unsigned char* output, int capacity)
+{
+  uint32_t Starts[SymbolCount+1];
+  unsigned char* Pointer = output+capacity;
+  uint32_t State = RansLowerBound;
+
+  if (!BuildStarts(frequencies, Starts))
+    return 0;
+
+  for (int i = size-1; i >= 0; --i)
+  {
+    const uint32_t Frequency = frequencies[data[i]];
+    const uint32_t Limit = ((RansLowerBound >> ProbabilityBits) << 8)*Frequency;
+
+    while (State >= Limit)
+    {
+      if (Pointer == output)
+        return 0;
+
+      *--Pointer = (unsigned char)(State & 0xff);
+      State >>= 8;
+    }
+    State = ((State / Frequency) << ProbabilityBits)+(State % Frequency)+Starts[data[i]];
+  }
+  if (Pointer-output < 4)
+    return 0;
+
+  Pointer -= 4;
+  for (int i = 0; i < 4; ++i)
+  {
+    Pointer[i] = (unsigned char)(State >> (i*8));
+  }
+  const int Size = (int)(output+capacity-Pointer);
+
+  memmove(output, Pointer, Size);
+  return Size;
+}
+
+
+bool RansDecode(const unsigned char* data, int size, const uint16_t* frequencies, unsigned char* output, int output_size)
+{
+  uint32_t Starts[SymbolCount+1];
+  unsigned char Symbols[ProbabilityScale];
+  const unsigned char* End = data+size;
+
+  if (size < 4 || !BuildStarts(frequencies, Starts))
+    return false;
+
+  for (int i = 0; i < SymbolCount; ++i)
+  {
+    memset(Symbols+Starts[i], i, frequencies[i]);
+  }
+  uint32_t State = (uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24;
+
+  data += 4;
+  for (int i = 0; i < output_size; ++i)
+  {
+    const uint32_t Slot = State & (ProbabilityScale-1);
+    const unsigned char Symbol = Symbols[Slot];
+
+    output[i] = Symbol;
+    State = frequencies[Symbol]*(State >> ProbabilityBits)+Slot-Starts[Symbol];
+    while (State < RansLowerBound)
+    {
+      if (data == End)
+        return false;
+
+      State = (State << 8) | *data++;
+    }
+  }
+  return true;
+}
+}
+
+
+RawFrameWriter::RawFrameWriter(const QString& path, int keyframe_interval) : Path(path),
+  KeyframeInterval(keyframe_interval)
+{
+}
+
+
+RawFrameWriter::~RawFrameWriter()
+{
+  Close();
+}
+
+
+bool RawFrameWriter::Append(int64_t timestamp, const MEImage& image)
+{
+  const QString FrameNight = FrameArchive::GetNightName(timestamp);
+  const int Size = image.GetWidth()*image.GetHeight()*image.GetLayerCount();
+
+  if ((FrameNight != Night || image.GetWidth() != Width || image.GetHeight() != Height ||
+       image.GetLayerCount() != Layers) && !Open(FrameNight, image.GetWidth(), image.GetHeight(), image.GetLayerCount()))
+  {
+    return false;
+  }
+  const qint64 StartTime = QDateTime::currentMSecsSinceEpoch();
+  const IplImage* Image = const_cast<MEImage&>(image).GetIplImage();
+  const int RowSize = Width*Layers;
+
+  Current.resize(Size);
+  Residuals.resize(Size);
+  Output.resize(FrequencyTableSize+Size);
+  for (int y = 0; y < Height; ++y)
+  {
+    memcpy(Current.data()+y*RowSize, Image->imageData+y*Image->widthStep, RowSize);
+  }
+  FrameRecord Record;
+
+  memcpy(Record.Magic, FrameMagic, sizeof(FrameMagic));
+  Record.Flags = 0;
+  Record.Timestamp = timestamp;
+  Record.Reserved = 0;
+  // Keyframes predict from the left pixel, the other frames from the previous frame
+  if (Previous.size() != Current.size() || SinceKeyframe >= KeyframeInterval)
+  {
+    const unsigned char Zero[4] = { 0, 0, 0, 0 };
+
+    Record.Flags |= FrameKeyframe;
+    ComputeResiduals(Current.data(), Zero, Residuals.data(), Layers);
+    ComputeResiduals(Current.data()+Layers, Current.data(), Residuals.data()+Layers, Size-Layers);
+    SinceKeyframe = 0;
+  } else {
+    ComputeResiduals(Current.data(), Previous.data(), Residuals.data(), Size);
+  }
+  SinceKeyframe++;
+  uint32_t Counts[SymbolCount] = { 0 };
+  uint16_t* Frequencies = reinterpret_cast<uint16_t*>(Output.data());
+
+  for (int i = 0; i < Size; ++i)
+  {
+    Counts[Residuals[i]]++;
+  }
+  NormalizeFrequencies(Counts, Size, Frequencies);
+  const int DataSize = RansEncode(Residuals.data(), Size, Frequencies, Output.data()+FrequencyTableSize, Size);
+
+  // Noise does not compress, it is stored as is when the table and the coded data are not smaller
+  if (DataSize == 0 || DataSize+FrequencyTableSize >= Size)
+  {
+    Record.Flags |= FrameStored;
+    Record.Size = (uint32_t)Size;
+    memcpy(Output.data(), Residuals.data(), Size);
+  } else {
+    Record.Size = (uint32_t)(DataSize+FrequencyTableSize);
+  }
+  if (File.write(reinterpret_cast<const char*>(&Record), RecordSize) != RecordSize ||
+      File.write(reinterpret_cast<const char*>(Output.data()), Record.Size) != (qint64)Record.Size || !File.flush())
+  {
+    MC_WARNING("Unable to write the raw frames %s", qPrintable(File.fileName()));
+    Close();
+    return false;
+  }
+  Previous.swap(Current);
+  FrameCount++;
+  RawBytes += Size;
+  StoredBytes += RecordSize+Record.Size;
+  EncodeTime += QDateTime::currentMSecsSinceEpoch()-StartTime;
+  return true;
+}
+
+
+void RawFrameWriter::Close()
+{
+  if (File.isOpen())
+  {
+    if (FrameCount > 0)
+    {
+      MC_LOG("Raw frames of %s: %d frames, %1.1f%% of the raw size, %1.1f ms/frame", qPrintable(Night), FrameCount,
+             (double)StoredBytes*100 / RawBytes, EncodeTime / FrameCount);
+    }
+    File.close();
+  }
+  Night.clear();
+  Previous.clear();
+  FrameCount = 0;
+  RawBytes = 0;
+  StoredBytes = 0;
+  EncodeTime = 0;
+}
+
+
+bool RawFrameWriter::Open(const QString& night, int width, int height, int layers)
+{
+  FileHeader Header;
+
+  Close();
+  QDir().mkpath(Path);
+  File.setFileName(Path+"/allskycam_"+night+".rawframes");
+  if (!File.open(QIODevice::ReadWrite))
+  {
+    MC_WARNING("Unable to open the raw frames %s", qPrintable(File.fileName()));
+    return false;
+  }
+  // A new file or a resumed night after a restart
+  if (File.size() < HeaderSize)
+  {
+    memcpy(Header.Magic, FileMagic, sizeof(FileMagic));
+    Header.Version = FileVersion;
+    Header.Width = width;
+    Header.Height = height;
+    Header.Layers = layers;
+    Header.KeyframeInterval = (uint32_t)KeyframeInterval;
+    if (!File.resize(0) || File.write(reinterpret_cast<const char*>(&Header), HeaderSize) != HeaderSize)
+    {
+      MC_WARNING("Unable to write the raw frames %s", qPrintable(File.fileName()));
+      Close();
+      return false;
+    }
+  } else {
+    FrameRecord Record;
+    qint64 End = HeaderSize;
+
+    if (File.read(reinterpret_cast<char*>(&Header), HeaderSize) != HeaderSize ||
+        memcmp(Header.Magic, FileMagic, sizeof(FileMagic)) != 0 || Header.Version != FileVersion ||
+        Header.Width != width || Header.Height != height || Header.Layers != layers)
+    {
+      MC_WARNING("Incompatible raw frames %s", qPrintable(File.fileName()));
+      Close();
+      return false;
+    }
+    // Cut a torn frame at the end
+    while (File.seek(End) && File.read(reinterpret_cast<char*>(&Record), RecordSize) == RecordSize &&
+           memcmp(Record.Magic, FrameMagic, sizeof(FrameMagic)) == 0 && End+RecordSize+Record.Size <= File.size())
+    {
+      End += RecordSize+Record.Size;
+    }
+    if (End < File.size())
+      MC_WARNING("Drop %d bytes from the end of %s", (int)(File.size()-End), qPrintable(File.fileName()));
+
+    if (!File.resize(End))
+    {
+      Close();
+      return false;
+    }
+  }
+  if (!File.seek(File.size()))
+  {
+    Close();
+    return false;
+  }
+  Night = night;
+  Width = width;
+  Height = height;
+  Layers = layers;
+  // The previous frame of a resumed night is not known
+  SinceKeyframe = KeyframeInterval;
+  return true;
+}
+
+
+bool RawFrameReader::Open(const QString& filename)
+{
+  FileHeader Header;
+  FrameRecord Record;
+  qint64 End = HeaderSize;
+
+  File.close();
+  Frames.clear();
+  Decoded = -1;
+  File.setFileName(filename);
+  if (!File.open(QIODevice::ReadOnly) || File.read(reinterpret_cast<char*>(&Header), HeaderSize) != HeaderSize ||
+      memcmp(Header.Magic, FileMagic, sizeof(FileMagic)) != 0 || Header.Version != FileVersion ||
+      Header.Width <= 0 || Header.Height <= 0 || Header.Layers <= 0)
+  {
+    File.close();
+    return false;
+  }
+  Width = Header.Width;
+  Height = Header.Height;
+  Layers = Header.Layers;
+  while (File.seek(End) && File.read(reinterpret_cast<char*>(&Record), RecordSize) == RecordSize &&
+         memcmp(Record.Magic, FrameMagic, sizeof(FrameMagic)) == 0 && End+RecordSize+Record.Size <= File.size())
+  {
+    FrameEntry Entry;
+
+    Entry.Offset = End+RecordSize;
+    Entry.Timestamp = Record.Timestamp;
+    Entry.Flags = Record.Flags;
+    Entry.Size = Record.Size;
+    Frames.push_back(Entry);
+    End += RecordSize+Record.Size;
+  }
+  return true;
+}
+
+
+bool RawFrameReader::ReadFrame(int index, MEImage& image)
+{
+  if (index < 0 || index >= GetCount())
+    return false;
+
+  int First = index;
+
+  while (First >= 0 && !(Frames[First].Flags & FrameKeyframe))
+  {
+    First--;
+  }
+  if (First < 0)
+    return false;
+
+  // Continue from the last decoded frame in the same keyframe interval
+  if (Decoded >= First && Decoded <= index)
+    First = Decoded+1;
+
+  for (int i = First; i <= index; ++i)
+  {
+    if (!DecodeFrame(i))
+    {
+      Decoded = -1;
+      return false;
+    }
+  }
+  if (image.GetWidth() != Width || image.GetHeight() != Height || image.GetLayerCount() != Layers)
+    image = MEImage(Width, Height, Layers);
+
+  IplImage* Image = image.GetIplImage();
+  const int RowSize = Width*Layers;
+
+  for (int y = 0; y < Height; ++y)
+  {
+    memcpy(Image->imageData+y*Image->widthStep, Current.data()+y*RowSize, RowSize);
+  }
+  return true;
+}
+
+
+bool RawFrameReader::DecodeFrame(int index)
+{
+  const FrameEntry& Entry = Frames[index];
+  const int Size = Width*Height*Layers;
+
+  Data.resize(Entry.Size);
+  Residuals.resize(Size);
+  Current.resize(Size);
+  if (!File.seek(Entry.Offset) || File.read(reinterpret_cast<char*>(Data.data()), Entry.Size) != (qint64)Entry.Size)
+    return false;
+
+  if (Entry.Flags & FrameStored)
+  {
+    if ((int)Entry.Size != Size)
+      return false;
+
+    memcpy(Residuals.data(), Data.data(), Size);
+  } else
+  if (Entry.Size < (uint32_t)FrequencyTableSize ||
+      !RansDecode(Data.data()+FrequencyTableSize, Entry.Size-FrequencyTableSize,
+                  reinterpret_cast<const uint16_t*>(Data.data()), Residuals.data(), Size))
+  {
+    MC_WARNING("Corrupted raw frame %d in %s", index, qPrintable(File.fileName()));
+    return false;
+  }
+  if (Entry.Flags & FrameKeyframe)
+  {
+    for (int i = 0; i < Size; ++i)
+    {
+      Current[i] = RestoreValue(Residuals[i], i < Layers ? 0 : Current[i-Layers]);
+    }
+  } else {
+    for (int i = 0; i < Size; ++i)
+    {
+      Current[i] = RestoreValue(Residuals[i], Current[i]);
+    }
+  }
+  Decoded = index;
+  return true;
+}
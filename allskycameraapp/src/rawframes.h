@@ -0,0 +1,102 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+
+#pragma once
+
+#include <QFile>
+#include <QString>
+
+#include <vector>
+
+#include <stdint.h>
+
+class MEImage;
+
+// Lossless storage of the raw night frames in allskycam_<night>.rawframes
+// files. The frames are predicted from the previous frame (keyframes from the
+// left pixel) and the folded residuals are compressed with a static order-0 rANS
+// coder, frames that do not compress are stored as is.
+class RawFrameWriter
+{
+public:
+  explicit RawFrameWriter(const QString& path, int keyframe_interval = 32);
+  ~RawFrameWriter();
+
+  // The frame is appended to the file of its night
+  bool Append(int64_t timestamp, const MEImage& image);
+  void Close();
+
+protected:
+  bool Open(const QString& night, int width, int height, int layers);
+
+  QString Path;
+  QString Night;
+  QFile File;
+  int KeyframeInterval { 32 };
+  int SinceKeyframe { 0 };
+  int Width { 0 };
+  int Height { 0 };
+  int Layers { 0 };
+  std::vector<unsigned char> Current;
+  std::vector<unsigned char> Previous;
+  std::vector<unsigned char> Residuals;
+  std::vector<unsigned char> Output;
+  // Statistics of the night
+  int FrameCount { 0 };
+  int64_t RawBytes { 0 };
+  int64_t StoredBytes { 0 };
+  double EncodeTime { 0 };
+};
+
+// Random access to a night: the closest keyframe and the following frames are decoded
+class RawFrameReader
+{
+public:
+  RawFrameReader() = default;
+
+  bool Open(const QString& filename);
+  int GetCount() const { return (int)Frames.size(); }
+  int64_t GetTimestamp(int index) const { return Frames[index].Timestamp; }
+  bool ReadFrame(int index, MEImage& image);
+
+protected:
+  struct FrameEntry
+  {
+    int64_t Offset;
+    int64_t Timestamp;
+    uint32_t Flags;
+    uint32_t Size;
+  };
+
+  bool DecodeFrame(int index);
+
+  QFile File;
+  int Width { 0 };
+  int Height { 0 };
+  int Layers { 0 };
+  std::vector<FrameEntry> Frames;
+  // Last decoded frame, the sequential reads continue from it
+  int Decoded { -1 };
+  std::vector<unsigned char> Current;
+  std::vector<unsigned char> Residuals;
+  std::vector<unsigned char> Data;
+};
@@ -0,0 +1,173 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "reprojection.h"
+
+#include <MEImage.hpp>
+
+#include <QStringList>
+
+#include <algorithm>
+
+#include <math.h>
+#include <string.h>
+
+namespace
+{
+// Output tile size, the source pixels of a tile stay in the cache
+const int TileSize = 16;
+// Marks the panorama pixels outside of the fisheye circle
+const uint16_t InvalidCoordinate = 0xFFFF;
+}
+
+
+bool LensModel::Parse(const QString& str)
+{
+  QStringList Values = str.split(',');
+
+  if (Values.size() < 3)
+    return false;
+
+  CenterX = Values[0].toFloat();
+  CenterY = Values[1].toFloat();
+  Radius = Values[2].toFloat();
+  if (Values.size() > 3)
+    AzimuthOffset = Values[3].toFloat();
+  if (Values.size() > 4)
+    Mirrored = Values[4].toInt() != 0;
+
+  return Radius > 0;
+}
+
+
+bool SkyProjection::Init(const LensModel& lens, int source_width, int source_height, int width, int height,
+                         float min_altitude)
+{
+  if (source_width < 2 || source_height < 2 || width <= 0 || height <= 0 || min_altitude >= 90)
+    return false;
+
+  const double CenterX = lens.CenterX < 0 ? (source_width-1) / 2.0 : lens.CenterX;
+  const double CenterY = lens.CenterY < 0 ? (source_height-1) / 2.0 : lens.CenterY;
+  const double Radius = lens.Radius <= 0 ? std::min(source_width, source_height) / 2.0 : lens.Radius;
+
+  Width = width;
+  Height = height;
+  SourceWidth = source_width;
+  SourceHeight = source_height;
+  Table.clear();
+  Table.reserve(width*height);
+  for (int ty = 0; ty < height; ty += TileSize)
+  {
+    for (int tx = 0; tx < width; tx += TileSize)
+    {
+      for (int y = ty; y < std::min(ty+TileSize, height); ++y)
+      {
+        // Zenith at the top, the lowest altitude at the bottom
+        const double Altitude = 90.0-(90.0-min_altitude)*(y+0.5) / height;
+        // Equidistant projection: the distance from the centre is linear in the zenith angle
+        const double Distance = Radius*(90.0-Altitude) / 90.0;
+
+        for (int x = tx; x < std::min(tx+TileSize, width); ++x)
+        {
+          const double Azimuth = ((x+0.5)*360.0 / width+lens.AzimuthOffset)*M_PI / 180.0;
+          const double SourceX = CenterX+(lens.Mirrored ? -1 : 1)*Distance*sin(Azimuth);
+          const double SourceY = CenterY-Distance*cos(Azimuth);
+          RemapEntry Entry;
+
+          if (SourceX < 0 || SourceY < 0 || SourceX >= source_width-1 || SourceY >= source_height-1)
+          {
+            Entry.X = InvalidCoordinate;
+            Entry.Y = InvalidCoordinate;
+            Entry.FractionX = 0;
+            Entry.FractionY = 0;
+          } else {
+            Entry.X = (uint16_t)SourceX;
+            Entry.Y = (uint16_t)SourceY;
+            Entry.FractionX = (uint8_t)std::min(255.0, (SourceX-Entry.X)*256.0+0.5);
+            Entry.FractionY = (uint8_t)std::min(255.0, (SourceY-Entry.Y)*256.0+0.5);
+          }
+          Table.push_back(Entry);
+        }
+      }
+    }
+  }
+  return true;
+}
+
+
+bool SkyProjection::Apply(const MEImage& source, MEImage& panorama) const
+{
+  if (!IsValid(source) || panorama.GetWidth() != Width || panorama.GetHeight() != Height ||
+      panorama.GetLayerCount() != source.GetLayerCount())
+  {
+    return false;
+  }
+  const int Layers = source.GetLayerCount();
+  const IplImage* Source = source.GetIplImage();
+  IplImage* Output = panorama.GetIplImage();
+  const unsigned char* SourceData = reinterpret_cast<unsigned char*>(Source->imageData);
+  const int Stride = Source->widthStep;
+  const RemapEntry* Entry = Table.data();
+
+  for (int ty = 0; ty < Height; ty += TileSize)
+  {
+    for (int tx = 0; tx < Width; tx += TileSize)
+    {
+      for (int y = ty; y < std::min(ty+TileSize, Height); ++y)
+      {
+        unsigned char* Row = reinterpret_cast<unsigned char*>(Output->imageData)+y*Output->widthStep;
+
+        for (int x = tx; x < std::min(tx+TileSize, Width); ++x, ++Entry)
+        {
+          unsigned char* Pixel = Row+x*Layers;
+
+          if (Entry->X == InvalidCoordinate)
+          {
+            memset(Pixel, 0, Layers);
+            continue;
+          }
+          // Bilinear weights in 16 bit fixed-point
+          const int FractionX = Entry->FractionX;
+          const int FractionY = Entry->FractionY;
+          const int Weight00 = (256-FractionX)*(256-FractionY);
+          const int Weight01 = FractionX*(256-FractionY);
+          const int Weight10 = (256-FractionX)*FractionY;
+          const int Weight11 = FractionX*FractionY;
+          const unsigned char* Top = SourceData+Entry->Y*Stride+Entry->X*Layers;
+          const unsigned char* Bottom = Top+Stride;
+
+          for (int l = 0; l < Layers; ++l)
+          {
+            Pixel[l] = (unsigned char)((Top[l]*Weight00+Top[l+Layers]*Weight01+Bottom[l]*Weight10+
+                                        Bottom[l+Layers]*Weight11+32768) >> 16);
+          }
+        }
+      }
+    }
+  }
+  return true;
+}
+
+
+bool SkyProjection::IsValid(const MEImage& source) const
+{
+  return !Table.empty() && source.GetWidth() == SourceWidth && source.GetHeight() == SourceHeight;
+}
@@ -0,0 +1,76 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <QString>
+
+#include <stdint.h>
+#include <vector>
+
+class MEImage;
+
+// Equidistant fisheye lens calibration, the horizon is a circle around the centre
+struct LensModel
+{
+  bool Parse(const QString& str);
+
+  // Negative values select the image centre and the inscribed circle
+  float CenterX { -1 };
+  float CenterY { -1 };
+  float Radius { -1 };
+  // Azimuth of the image top in degrees (clockwise)
+  float AzimuthOffset { 0 };
+  // The camera image is mirrored (e.g. -hf without -vf)
+  bool Mirrored { false };
+};
+
+// Fisheye to equirectangular azimuth/altitude panorama with a precomputed remap table
+class SkyProjection
+{
+public:
+  SkyProjection() = default;
+
+  bool Init(const LensModel& lens, int source_width, int source_height, int width, int height, float min_altitude = 0);
+  bool Apply(const MEImage& source, MEImage& panorama) const;
+  bool IsValid(const MEImage& source) const;
+  int GetWidth() const { return Width; }
+  int GetHeight() const { return Height; }
+
+protected:
+#pragma pack(push, 1)
+  // Top-left source pixel and 8 bit bilinear fractions
+  struct RemapEntry
+  {
+    uint16_t X;
+    uint16_t Y;
+    uint8_t FractionX;
+    uint8_t FractionY;
+  };
+#pragma pack(pop)
+
+  int Width { 0 };
+  int Height { 0 };
+  int SourceWidth { 0 };
+  int SourceHeight { 0 };
+  // Entries are stored tile by tile in the order of the processing
+  std::vector<RemapEntry> Table;
+};
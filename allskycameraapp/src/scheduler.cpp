@@ -0,0 +1,199 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "scheduler.h"
+
+#include <MCLog.hpp>
+
+#include <algorithm>
+#include <chrono>
+
+int64_t SteadyClock::Now() const
+{
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+           std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+void SteadyClock::WaitUntil(std::unique_lock<std::mutex>& lock, std::condition_variable& condition, int64_t deadline)
+{
+  condition.wait_until(lock, std::chrono::steady_clock::time_point(std::chrono::milliseconds(deadline)));
+}
+
+
+void ManualClock::WaitUntil(std::unique_lock<std::mutex>& lock, std::condition_variable& condition, int64_t deadline)
+{
+  (void)lock;
+  (void)condition;
+  Current = std::max(Current, deadline);
+}
+
+
+EventScheduler::EventScheduler(SchedulerClock* clock) : Clock(clock != nullptr ? clock : new SteadyClock())
+{
+}
+
+
+int EventScheduler::Schedule(const QString& name, int64_t deadline, const Task& task, int64_t period)
+{
+  int Id = 0;
+
+  {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    Event NewEvent;
+
+    Id = NextId++;
+    NewEvent.Deadline = deadline;
+    NewEvent.Period = period;
+    NewEvent.Id = Id;
+    NewEvent.Name = name;
+    NewEvent.Function = task;
+    Events.push(NewEvent);
+  }
+  // The new event can be earlier than the current wait
+  Condition.notify_all();
+  return Id;
+}
+
+
+int EventScheduler::ScheduleIn(const QString& name, int64_t delay, const Task& task, int64_t period)
+{
+  return Schedule(name, Clock->Now()+delay, task, period);
+}
+
+
+void EventScheduler::Cancel(int id)
+{
+  {
+    std::lock_guard<std::mutex> Lock(Mutex);
+
+    Cancelled.push_back(id);
+  }
+  Condition.notify_all();
+}
+
+
+bool EventScheduler::RunOnce()
+{
+  std::unique_lock<std::mutex> Lock(Mutex);
+  Event Current;
+
+  while (true)
+  {
+    if (Stopped || Events.empty())
+      return false;
+
+    const Event& Next = Events.top();
+    auto CancelIter = std::find(Cancelled.begin(), Cancelled.end(), Next.Id);
+
+    if (CancelIter != Cancelled.end())
+    {
+      Cancelled.erase(CancelIter);
+      Events.pop();
+      continue;
+    }
+    if (Clock->Now() >= Next.Deadline)
+      break;
+
+    // Wake up at the deadline or when an event is added or cancelled
+    Clock->WaitUntil(Lock, Condition, Next.Deadline);
+  }
+  Current = Events.top();
+  Events.pop();
+
+  const int64_t Jitter = Clock->Now()-Current.Deadline;
+  EventStats& CurrentStats = Stats[Current.Name];
+
+  CurrentStats.Runs++;
+  CurrentStats.TotalJitter += Jitter;
+  CurrentStats.MaxJitter = std::max(CurrentStats.MaxJitter, Jitter);
+  if (Jitter > MissedThreshold)
+  {
+    CurrentStats.Missed++;
+    MC_WARNING("Event %s started %d ms after its deadline", qPrintable(Current.Name), (int)Jitter);
+  }
+  if (Current.Period > 0)
+  {
+    Event NextRun = Current;
+
+    // Skip the periods which are already over instead of running them in a burst
+    NextRun.Deadline += Current.Period;
+    if (NextRun.Deadline <= Clock->Now())
+    {
+      const int64_t Skipped = (Clock->Now()-NextRun.Deadline) / Current.Period+1;
+
+      CurrentStats.Missed += (int)Skipped;
+      NextRun.Deadline += Skipped*Current.Period;
+    }
+    Events.push(NextRun);
+  }
+  Lock.unlock();
+  Current.Function(Current.Deadline);
+  return true;
+}
+
+
+void EventScheduler::Run()
+{
+  while (RunOnce())
+  {
+  }
+}
+
+
+void EventScheduler::Stop()
+{
+  {
+    std::lock_guard<std::mutex> Lock(Mutex);
+
+    Stopped = true;
+  }
+  Condition.notify_all();
+}
+
+
+void EventScheduler::LogStats() const
+{
+  std::lock_guard<std::mutex> Lock(Mutex);
+
+  for (auto& item : Stats)
+  {
+    const EventStats& Current = item.second;
+
+    MC_LOG("Event %s - runs: %d missed: %d average jitter: %d ms max jitter: %d ms", qPrintable(item.first), Current.Runs,
+           Current.Missed, (int)(Current.TotalJitter / std::max(1, Current.Runs)), (int)Current.MaxJitter);
+  }
+}
+
+
+bool EventScheduler::GetStats(const QString& name, int& runs, int& missed, int64_t& max_jitter) const
+{
+  std::lock_guard<std::mutex> Lock(Mutex);
+  auto Iter = Stats.find(name);
+
+  if (Iter == Stats.end())
+    return false;
+
+  runs = Iter->second.Runs;
+  missed = Iter->second.Missed;
+  max_jitter = Iter->second.MaxJitter;
+  return true;
+}
@@ -0,0 +1,126 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <QString>
+
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <vector>
+
+#include <stdint.h>
+
+// Time base of the scheduler in milliseconds
+class SchedulerClock
+{
+public:
+  virtual ~SchedulerClock() = default;
+
+  virtual int64_t Now() const = 0;
+  // Waits until the deadline or a notification of the condition
+  virtual void WaitUntil(std::unique_lock<std::mutex>& lock, std::condition_variable& condition, int64_t deadline) = 0;
+};
+
+// Monotonic system clock
+class SteadyClock : public SchedulerClock
+{
+public:
+  int64_t Now() const override;
+  void WaitUntil(std::unique_lock<std::mutex>& lock, std::condition_variable& condition, int64_t deadline) override;
+};
+
+// Simulated clock jumping straight to the deadlines, the events run faster than real time
+class ManualClock : public SchedulerClock
+{
+public:
+  int64_t Now() const override { return Current; }
+  void WaitUntil(std::unique_lock<std::mutex>& lock, std::condition_variable& condition, int64_t deadline) override;
+  // Simulated duration of a task
+  void Advance(int64_t milliseconds) { Current += milliseconds; }
+
+protected:
+  int64_t Current { 0 };
+};
+
+// Runs the events at absolute deadlines in the order of the deadlines. The periodic
+// events keep their phase, a late run does not shift the following deadlines.
+class EventScheduler
+{
+public:
+  // The argument is the deadline of the current run
+  typedef std::function<void(int64_t)> Task;
+
+  // The scheduler owns the clock, the system clock is used by default
+  explicit EventScheduler(SchedulerClock* clock = nullptr);
+
+  int Schedule(const QString& name, int64_t deadline, const Task& task, int64_t period = 0);
+  int ScheduleIn(const QString& name, int64_t delay, const Task& task, int64_t period = 0);
+  void Cancel(int id);
+  // Waits for the next event and runs it, false if there are no more events
+  bool RunOnce();
+  // Runs the events until Stop() is called or the queue is empty
+  void Run();
+  void Stop();
+  int64_t Now() const { return Clock->Now(); }
+  void LogStats() const;
+  // Statistics of an event, false if it has not run yet
+  bool GetStats(const QString& name, int& runs, int& missed, int64_t& max_jitter) const;
+
+  // Runs starting later than this are counted as missed deadlines (ms)
+  int64_t MissedThreshold { 1000 };
+
+protected:
+  struct Event
+  {
+    int64_t Deadline;
+    int64_t Period;
+    int Id;
+    QString Name;
+    Task Function;
+
+    bool operator>(const Event& other) const
+    {
+      return Deadline > other.Deadline || (Deadline == other.Deadline && Id > other.Id);
+    }
+  };
+
+  struct EventStats
+  {
+    int Runs;
+    int Missed;
+    int64_t TotalJitter;
+    int64_t MaxJitter;
+  };
+
+  std::unique_ptr<SchedulerClock> Clock;
+  mutable std::mutex Mutex;
+  std::condition_variable Condition;
+  std::priority_queue<Event, std::vector<Event>, std::greater<Event>> Events;
+  std::vector<int> Cancelled;
+  std::map<QString, EventStats> Stats;
+  int NextId { 1 };
+  bool Stopped { false };
+};
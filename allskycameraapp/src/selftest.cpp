@@ -0,0 +1,484 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+
+#include "selftest.h"
+#include "ftpuploader.h"
+#include "rawframes.h"
+#include "scheduler.h"
+#include "timelapse.h"
+
+#include <MEImage.hpp>
+
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QHostAddress>
+#include <QTcpServer>
+#include <QTcpSocket>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace
+{
+bool Check(const char* name, bool result)
+{
+  printf("%-50s %s\n", name, result ? "ok" : "FAILED");
+  return result;
+}
+
+
+// A 40 s periodic event on the simulated clock, the second run stalls the loop for 130 s
+bool CheckScheduler()
+{
+  ManualClock* Clock = new ManualClock();
+  EventScheduler Scheduler(Clock);
+  std::vector<int64_t> Deadlines;
+  int Runs = 0;
+  int Missed = 0;
+  int64_t MaxJitter = 0;
+  bool Success = true;
+
+  Scheduler.Schedule("capture", 0, [&](int64_t deadline)
+  {
+    Deadlines.push_back(deadline);
+    Clock->Advance(Deadlines.size() == 2 ? 130000 : 500);
+  }, 40000);
+  // A one-shot event which is due while the first run is in progress
+  Scheduler.Schedule("late", 300, [&](int64_t) {});
+  for (int i = 0; i < 5; ++i)
+  {
+    Scheduler.RunOnce();
+  }
+  Success &= Check("Scheduler: periodic deadlines keep their phase",
+                   Deadlines == std::vector<int64_t>({ 0, 40000, 80000, 200000 }));
+  Success &= Check("Scheduler: late run and skipped periods are missed",
+                   Scheduler.GetStats("capture", Runs, Missed, MaxJitter) && Runs == 4 && Missed == 3 && MaxJitter == 90000);
+  Success &= Check("Scheduler: jitter below the threshold is not missed",
+                   Scheduler.GetStats("late", Runs, Missed, MaxJitter) && Runs == 1 && Missed == 0 && MaxJitter == 200);
+  Success &= Check("Scheduler: simulated clock at the last deadline", Clock->Now() == 200500);
+  return Success;
+}
+
+
+uint32_t Get32(const QByteArray& data, int offset)
+{
+  uint32_t Value = 0;
+
+  if (offset+4 <= data.size())
+    memcpy(&Value, data.constData()+offset, 4);
+  return Value;
+}
+
+
+// A video left unfinished by a restart is continued, then finished as a stale video
+bool CheckTimelapse()
+{
+  const QString Path = QDir::tempPath()+QString("/allskycam_selftest_%1").arg((int)getpid());
+  const QString Filename = Path+"/timelapse_test.avi";
+  const std::vector<unsigned char> Frame(1001, 0x55);
+  bool Success = true;
+
+  QDir(Path).removeRecursively();
+  QDir().mkpath(Path);
+  {
+    TimelapseWriter Writer;
+
+    Success &= Check("Timelapse: new video", Writer.Open(Filename, 64, 48, 25) && Writer.Append(Frame) && Writer.Append(Frame));
+  }
+  {
+    TimelapseWriter Writer;
+
+    Success &= Check("Timelapse: unfinished video is continued", Writer.Open(Filename, 64, 48, 25) && Writer.Append(Frame));
+  }
+  Success &= Check("Timelapse: current video is not finished",
+                   TimelapseWriter::FinishStale(Path, Filename) && QFile::exists(Filename+".idx"));
+  Success &= Check("Timelapse: stale video is finished",
+                   TimelapseWriter::FinishStale(Path, QString()) && !QFile::exists(Filename+".idx"));
+
+  QFile Video(Filename);
+  QByteArray Data;
+
+  if (Video.open(QIODevice::ReadOnly))
+    Data = Video.readAll();
+
+  // 3 padded frame chunks after the 224 byte header, then the idx1 chunk with 3 entries
+  const int IndexOffset = 224+3*(8+1002);
+
+  Success &= Check("Timelapse: headers of the finished video",
+                   Data.size() == IndexOffset+8+3*16 && Get32(Data, 4) == (uint32_t)Data.size()-8 &&
+                   (Get32(Data, 44) & 0x10) != 0 && Get32(Data, 48) == 3 && Get32(Data, 140) == 3);
+  Success &= Check("Timelapse: index of the finished video",
+                   Data.mid(IndexOffset, 4) == "idx1" && Get32(Data, IndexOffset+4) == 3*16 &&
+                   Get32(Data, IndexOffset+8+2*16+8) == 4+2*(8+1002) && Get32(Data, IndexOffset+8+2*16+12) == 1001);
+  Success &= Check("Timelapse: finished video is not continued", !TimelapseWriter().Open(Filename, 64, 48, 25) && !QFile::exists(Filename+".idx"));
+  QDir(Path).removeRecursively();
+  return Success;
+}
+
+
+// Keyframes every 4 frames, the noise frame 5 does not compress and it is stored as is.
+// The decoded frames are compared to the written ones.
+bool CheckRawFrames()
+{
+  const QString Path = QDir::tempPath()+QString("/allskycam_selftest_%1").arg((int)getpid());
+  const int Width = 64;
+  const int Height = 48;
+  const int FrameCount = 10;
+  const int NoiseFrame = 5;
+  // 23:00 local time, every frame belongs to the same night
+  const int64_t StartTime = QDateTime(QDate(2024, 1, 15), QTime(23, 0)).toMSecsSinceEpoch();
+  std::vector<MEImage> Frames;
+  uint32_t Random = 12345;
+  bool Written = true;
+  bool Success = true;
+
+  QDir(Path).removeRecursively();
+  QDir().mkpath(Path);
+  {
+    RawFrameWriter Writer(Path, 4);
+
+    for (int i = 0; i < FrameCount; ++i)
+    {
+      Frames.emplace_back(Width, Height, 3);
+      IplImage* Image = Frames.back().GetIplImage();
+
+      // Dark gradient with a drifting star and a little noise
+      for (int y = 0; y < Height; ++y)
+      {
+        unsigned char* Row = reinterpret_cast<unsigned char*>(Image->imageData+y*Image->widthStep);
+
+        for (int x = 0; x < Width*3; ++x)
+        {
+          Random = Random*1103515245+12345;
+          Row[x] = i == NoiseFrame ? (unsigned char)(Random >> 24) :
+                   (unsigned char)(10+x / 24+y / 8+((Random >> 16) & 3)+(x / 3 == 20+i && y == 20 ? 200 : 0));
+        }
+      }
+      Written &= Writer.Append(StartTime+i*60000, Frames.back());
+    }
+  }
+  Success &= Check("Raw frames: frames written", Written);
+
+  const QStringList Files = QDir(Path).entryList(QStringList() << "allskycam_*.rawframes", QDir::Files, QDir::Name);
+  const QString Filename = Files.size() == 1 ? Path+'/'+Files[0] : QString();
+  QFile File(Filename);
+  QByteArray Data;
+  std::vector<uint32_t> Flags;
+
+  if (File.open(QIODevice::ReadOnly))
+    Data = File.readAll();
+
+  // 24 byte file header, 24 byte frame records: magic, flags, timestamp, size
+  for (int Offset = 24; Offset+24 <= Data.size(); Offset += 24+(int)Get32(Data, Offset+16))
+  {
+    Flags.push_back(Get32(Data, Offset+4));
+  }
+  Success &= Check("Raw frames: keyframes and stored noise frame",
+                   (int)Flags.size() == FrameCount && Flags[0] == 1 && Flags[4] == 1 && Flags[8] == 1 && Flags[3] == 0 &&
+                   Flags[NoiseFrame] == 2 && Data.size() < FrameCount*Width*Height*3);
+
+  // Random access into the middle of the intervals first, then the sequential reads
+  RawFrameReader Reader;
+  const int Order[] = { 6, 2, 9, 5, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9 };
+  bool Identical = Reader.Open(Filename) && Reader.GetCount() == FrameCount;
+
+  for (int i = 0; Identical && i < (int)(sizeof(Order) / sizeof(Order[0])); ++i)
+  {
+    MEImage Image;
+    const IplImage* Original = Frames[Order[i]].GetIplImage();
+
+    Identical = Reader.ReadFrame(Order[i], Image) && Reader.GetTimestamp(Order[i]) == StartTime+Order[i]*60000;
+    for (int y = 0; Identical && y < Height; ++y)
+    {
+      Identical = memcmp(Image.GetIplImage()->imageData+y*Image.GetIplImage()->widthStep,
+                         Original->imageData+y*Original->widthStep, Width*3) == 0;
+    }
+  }
+  Success &= Check("Raw frames: lossless random access", Identical);
+  QDir(Path).removeRecursively();
+  return Success;
+}
+
+
+// Loopback stand-in of an FTP server in its own thread, the stored files are kept in memory
+class FtpStandIn
+{
+public:
+  ~FtpStandIn()
+  {
+    Stop();
+  }
+
+  // Listen on a free loopback port, returns the port or 0
+  int Start()
+  {
+    std::unique_lock<std::mutex> Lock(Mutex);
+
+    Running = true;
+    Worker = std::thread(&FtpStandIn::Run, this);
+    Condition.wait(Lock, [this]() { return Port >= 0; });
+    return Port;
+  }
+
+  void Stop()
+  {
+    Running = false;
+    if (Worker.joinable())
+      Worker.join();
+  }
+
+  // The data connections of the next count transfers are closed before the file is read
+  void DropTransfers(int count)
+  {
+    std::lock_guard<std::mutex> Lock(Mutex);
+
+    DropCount = count;
+  }
+
+  // Wait until the stored files and the aborted transfers reach the given counts
+  bool WaitFor(size_t files, int aborted, int timeout)
+  {
+    std::unique_lock<std::mutex> Lock(Mutex);
+
+    return Condition.wait_for(Lock, std::chrono::milliseconds(timeout),
+                              [&]() { return Files.size() >= files && Aborted >= aborted; });
+  }
+
+  std::vector<QByteArray> GetFiles() const
+  {
+    std::lock_guard<std::mutex> Lock(Mutex);
+
+    return Files;
+  }
+
+protected:
+  void Run()
+  {
+    QTcpServer Server;
+    const bool Listening = Server.listen(QHostAddress::LocalHost, 0);
+
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+
+      Port = Listening ? Server.serverPort() : 0;
+    }
+    Condition.notify_all();
+    while (Listening && Running)
+    {
+      if (!Server.waitForNewConnection(100))
+        continue;
+
+      std::unique_ptr<QTcpSocket> Control(Server.nextPendingConnection());
+
+      Control->setParent(nullptr);
+      Session(*Control);
+      Control->abort();
+    }
+  }
+
+  void Session(QTcpSocket& control)
+  {
+    std::unique_ptr<QTcpServer> Passive;
+    auto Reply = [&control](const QByteArray& line)
+    {
+      control.write(line+"\r\n");
+      control.waitForBytesWritten(1000);
+    };
+
+    Reply("220 Stand-in ready");
+    while (Running && control.state() == QAbstractSocket::ConnectedState)
+    {
+      if (!control.canReadLine())
+      {
+        control.waitForReadyRead(100);
+        continue;
+      }
+      const QByteArray Line = control.readLine().trimmed();
+      const QByteArray Command = Line.left(4).toUpper();
+
+      if (Command == "USER")
+        Reply("331 Password required");
+      else
+      if (Command == "PASS")
+        Reply("230 Logged in");
+      else
+      if (Command == "TYPE" || Command == "NOOP")
+        Reply("200 Ok");
+      else
+      if (Command == "PASV")
+      {
+        Passive.reset(new QTcpServer());
+        if (!Passive->listen(QHostAddress::LocalHost, 0))
+        {
+          Reply("425 No data port");
+          continue;
+        }
+        const int DataPort = Passive->serverPort();
+
+        Reply(QString("227 Entering Passive Mode (127,0,0,1,%1,%2)").arg(DataPort / 256).arg(DataPort % 256).toLatin1());
+      } else
+      if (Command == "STOR")
+      {
+        Reply("150 Opening data connection");
+        Transfer(Passive.get(), Reply);
+        Passive.reset();
+      } else
+      if (Command == "QUIT")
+      {
+        Reply("221 Bye");
+        break;
+      } else {
+        Reply("502 Not implemented");
+      }
+    }
+  }
+
+  void Transfer(QTcpServer* passive, const std::function<void(const QByteArray&)>& reply)
+  {
+    if (passive == nullptr || !passive->waitForNewConnection(5000))
+    {
+      reply("425 No data connection");
+      return;
+    }
+    QTcpSocket* Data = passive->nextPendingConnection();
+    bool Drop = false;
+
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+
+      Drop = DropCount > 0;
+      DropCount -= Drop ? 1 : 0;
+    }
+    if (Drop)
+    {
+      Data->abort();
+      reply("426 Connection closed, transfer aborted");
+      std::lock_guard<std::mutex> Lock(Mutex);
+
+      Aborted++;
+      Condition.notify_all();
+      return;
+    }
+    // The end of the file is the end of the data connection
+    QByteArray File;
+
+    while (Data->state() == QAbstractSocket::ConnectedState && Data->waitForReadyRead(5000))
+      File += Data->readAll();
+    File += Data->readAll();
+    reply("226 Transfer complete");
+    std::lock_guard<std::mutex> Lock(Mutex);
+
+    Files.push_back(File);
+    Condition.notify_all();
+  }
+
+  mutable std::mutex Mutex;
+  std::condition_variable Condition;
+  std::thread Worker;
+  std::atomic<bool> Running { false };
+  int Port { -1 };
+  int DropCount { 0 };
+  int Aborted { 0 };
+  std::vector<QByteArray> Files;
+};
+
+
+ImageBuffer MakeFrame(size_t size, unsigned char value)
+{
+  return std::make_shared<const std::vector<unsigned char>>(size, value);
+}
+
+
+QByteArray ToBytes(const ImageBuffer& frame)
+{
+  return QByteArray(reinterpret_cast<const char*>(frame->data()), (int)frame->size());
+}
+
+
+// An upload, a retry after an aborted transfer and a failed frame replaced by a newer one
+bool CheckFtpUploader()
+{
+  FtpStandIn Server;
+  const int Port = Server.Start();
+  bool Success = true;
+
+  if (!Check("FTP: loopback stand-in server", Port > 0))
+    return false;
+
+  FtpUploader Uploader(QString("127.0.0.1:%1").arg(Port), "selftest", "selftest", "image.jpg");
+  const ImageBuffer First = MakeFrame(100000, 1);
+  const ImageBuffer Retried = MakeFrame(2000, 2);
+  const ImageBuffer Stale = MakeFrame(3000, 3);
+  const ImageBuffer Newer = MakeFrame(4000, 4);
+
+  Uploader.RetryDelay = 1000;
+  Uploader.Timeout = 5000;
+  Uploader.Start();
+
+  Uploader.Upload(First);
+  Success &= Check("FTP: upload", Server.WaitFor(1, 0, 10000) && Server.GetFiles().back() == ToBytes(First));
+
+  // The first transfer of the frame is aborted, the retry follows after RetryDelay
+  Server.DropTransfers(1);
+  Uploader.Upload(Retried);
+  Success &= Check("FTP: retry after a dropped data connection",
+                   Server.WaitFor(2, 1, 10000) && Server.GetFiles().back() == ToBytes(Retried));
+
+  // The newer frame arrives during the retry delay of the failed one
+  Server.DropTransfers(1);
+  Uploader.Upload(Stale);
+  Server.WaitFor(2, 2, 10000);
+  Uploader.Upload(Newer);
+  Success &= Check("FTP: stale frame dropped for a newer one",
+                   Server.WaitFor(3, 2, 10000) && Server.GetFiles().back() == ToBytes(Newer));
+  // Longer than the retry delay, the dropped frame must not follow
+  std::this_thread::sleep_for(std::chrono::milliseconds(2*Uploader.RetryDelay));
+  Success &= Check("FTP: stale frame not uploaded later", Server.GetFiles().size() == 3);
+  Uploader.Stop();
+  Uploader.LogStats();
+  return Success;
+}
+}
+
+
+bool RunSelfTest()
+{
+  bool Success = true;
+
+  Success &= CheckScheduler();
+  Success &= CheckTimelapse();
+  Success &= CheckRawFrames();
+  Success &= CheckFtpUploader();
+  return Success;
+}
@@ -0,0 +1,35 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+// NEON on the Raspberry Pi, SSE2 on desktop builds and plain C everywhere else.
+// The scalar loops always handle the tail which does not fill a full vector.
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define ASC_NEON 1
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#define ASC_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// Bytes processed by one vector iteration
+const int SimdWidth = 16;
@@ -0,0 +1,338 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "stacker.h"
+#include "simd.h"
+
+#include <MEImage.hpp>
+
+#include <MCLog.hpp>
+
+#include <QDir>
+#include <QFile>
+
+#include <stdio.h>
+#include <string.h>
+
+namespace
+{
+const char CheckpointMagic[4] = { 'A', 'S', 'C', 'K' };
+const int CheckpointVersion = 1;
+// The 16 bit clipped counters limit the length of a stack
+const int MaxFrameCount = 65535;
+// Samples of the largest frame (12 MP camera, 3 layers)
+const int64_t MaxDataSize = 4096*3072*3;
+// Bytes per sample in the checkpoint: max, sum, square sum, clipped sum and clipped count
+const int64_t CheckpointSampleSize = 1+4+4+4+2;
+
+#pragma pack(push, 1)
+struct CheckpointHeader
+{
+  char Magic[4];
+  uint16_t Version;
+  uint16_t Width;
+  uint16_t Height;
+  uint16_t Layers;
+  int32_t FrameCount;
+};
+#pragma pack(pop)
+
+
+#if defined(ASC_SSE2)
+inline void AddWidened(uint32_t* sums, __m128i values)
+{
+  const __m128i Zero = _mm_setzero_si128();
+  __m128i Low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(sums));
+  __m128i High = _mm_loadu_si128(reinterpret_cast<const __m128i*>(sums+4));
+
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(sums), _mm_add_epi32(Low, _mm_unpacklo_epi16(values, Zero)));
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(sums+4), _mm_add_epi32(High, _mm_unpackhi_epi16(values, Zero)));
+}
+#elif defined(ASC_NEON)
+inline void AddWidened(uint32_t* sums, uint16x8_t values)
+{
+  vst1q_u32(sums, vaddw_u16(vld1q_u32(sums), vget_low_u16(values)));
+  vst1q_u32(sums+4, vaddw_u16(vld1q_u32(sums+4), vget_high_u16(values)));
+}
+#endif
+
+
+void Accumulate(const unsigned char* data, unsigned char* max_stack, uint32_t* sums, uint32_t* square_sums, int size)
+{
+  int i = 0;
+
+#if defined(ASC_NEON)
+  for (; i+SimdWidth <= size; i += SimdWidth)
+  {
+    uint8x16_t Samples = vld1q_u8(data+i);
+    uint8x8_t Low = vget_low_u8(Samples);
+    uint8x8_t High = vget_high_u8(Samples);
+
+    vst1q_u8(max_stack+i, vmaxq_u8(vld1q_u8(max_stack+i), Samples));
+    AddWidened(sums+i, vmovl_u8(Low));
+    AddWidened(sums+i+8, vmovl_u8(High));
+    AddWidened(square_sums+i, vmull_u8(Low, Low));
+    AddWidened(square_sums+i+8, vmull_u8(High, High));
+  }
+#elif defined(ASC_SSE2)
+  const __m128i Zero = _mm_setzero_si128();
+
+  for (; i+SimdWidth <= size; i += SimdWidth)
+  {
+    __m128i Samples = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data+i));
+    __m128i Maximum = _mm_loadu_si128(reinterpret_cast<const __m128i*>(max_stack+i));
+    __m128i Low = _mm_unpacklo_epi8(Samples, Zero);
+    __m128i High = _mm_unpackhi_epi8(Samples, Zero);
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(max_stack+i), _mm_max_epu8(Maximum, Samples));
+    AddWidened(sums+i, Low);
+    AddWidened(sums+i+8, High);
+    // 255*255 still fits into an unsigned 16 bit lane
+    AddWidened(square_sums+i, _mm_mullo_epi16(Low, Low));
+    AddWidened(square_sums+i+8, _mm_mullo_epi16(High, High));
+  }
+#endif
+  for (; i < size; ++i)
+  {
+    if (data[i] > max_stack[i])
+      max_stack[i] = data[i];
+
+    sums[i] += data[i];
+    square_sums[i] += data[i]*data[i];
+  }
+}
+}
+
+
+bool NightStacker::Start(const QString& path, const QString& night_name)
+{
+  if (!QDir().mkpath(path))
+  {
+    MC_WARNING("Unable to create stack directory: %s", qPrintable(path));
+    return false;
+  }
+  Path = path+'/';
+  NightName = night_name;
+  Reset(0, 0, 0);
+  if (LoadCheckpoint())
+  {
+    MC_LOG("Stacking resumed from checkpoint (%d frames)", FrameCount);
+  }
+  return true;
+}
+
+
+bool NightStacker::Add(MEImage& image)
+{
+  if (!IsActive() || FrameCount >= MaxFrameCount)
+    return false;
+
+  if (FrameCount == 0 && Width == 0)
+    Reset(image.GetWidth(), image.GetHeight(), image.GetLayerCount());
+
+  if (image.GetWidth() != Width || image.GetHeight() != Height || image.GetLayerCount() != Layers)
+  {
+    MC_WARNING("Frame size differs from the stack size, frame skipped");
+    return false;
+  }
+  const unsigned char* Data = reinterpret_cast<unsigned char*>(image.GetIplImage()->imageData);
+  const int DataSize = (int)Sums.size();
+
+  // Sigma clipping against the statistics of the previous frames
+  if (FrameCount >= ClipWarmup)
+  {
+    const float InvCount = 1.0f / FrameCount;
+    const float ClipLimit = ClipSigma*ClipSigma;
+
+    for (int i = 0; i < DataSize; ++i)
+    {
+      const float Mean = Sums[i]*InvCount;
+      const float Variance = SquareSums[i]*InvCount-Mean*Mean;
+      const float Diff = Data[i]-Mean;
+
+      // One level of variance at least to keep the dark sky samples
+      if (Diff*Diff <= ClipLimit*(Variance < 1.0f ? 1.0f : Variance))
+      {
+        ClippedSums[i] += Data[i];
+        ClippedCounts[i]++;
+      }
+    }
+  } else {
+    for (int i = 0; i < DataSize; ++i)
+    {
+      ClippedSums[i] += Data[i];
+      ClippedCounts[i]++;
+    }
+  }
+  Accumulate(Data, MaxStack.data(), Sums.data(), SquareSums.data(), DataSize);
+  FrameCount++;
+  if (CheckpointInterval > 0 && FrameCount % CheckpointInterval == 0)
+    Checkpoint();
+
+  return true;
+}
+
+
+bool NightStacker::Checkpoint()
+{
+  if (!IsActive() || FrameCount == 0)
+    return false;
+
+  const QString FileName = GetFileName(".ckpt");
+  QFile CurrentFile(FileName+".tmp");
+  CheckpointHeader Header;
+
+  memcpy(Header.Magic, CheckpointMagic, sizeof(CheckpointMagic));
+  Header.Version = CheckpointVersion;
+  Header.Width = Width;
+  Header.Height = Height;
+  Header.Layers = Layers;
+  Header.FrameCount = FrameCount;
+  if (!CurrentFile.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    return false;
+
+  CurrentFile.write(reinterpret_cast<const char*>(&Header), sizeof(Header));
+  CurrentFile.write(reinterpret_cast<const char*>(MaxStack.data()), MaxStack.size());
+  CurrentFile.write(reinterpret_cast<const char*>(Sums.data()), Sums.size()*sizeof(uint32_t));
+  CurrentFile.write(reinterpret_cast<const char*>(SquareSums.data()), SquareSums.size()*sizeof(uint32_t));
+  CurrentFile.write(reinterpret_cast<const char*>(ClippedSums.data()), ClippedSums.size()*sizeof(uint32_t));
+  CurrentFile.write(reinterpret_cast<const char*>(ClippedCounts.data()), ClippedCounts.size()*sizeof(uint16_t));
+  if (!CurrentFile.flush())
+  {
+    MC_WARNING("Unable to write stack checkpoint: %s", qPrintable(FileName));
+    return false;
+  }
+  CurrentFile.close();
+  // Replace the previous checkpoint atomically
+  return rename(qPrintable(FileName+".tmp"), qPrintable(FileName)) == 0;
+}
+
+
+bool NightStacker::Finish()
+{
+  if (!IsActive())
+    return false;
+
+  bool Success = true;
+
+  if (FrameCount > 0)
+  {
+    const int DataSize = (int)Sums.size();
+    std::vector<unsigned char> Mean(DataSize);
+    std::vector<unsigned char> Clipped(DataSize);
+
+    for (int i = 0; i < DataSize; ++i)
+    {
+      Mean[i] = (unsigned char)(Sums[i] / FrameCount);
+      Clipped[i] = ClippedCounts[i] > 0 ? (unsigned char)(ClippedSums[i] / ClippedCounts[i]) : Mean[i];
+    }
+    Success = SaveProduct("_max.jpg", MaxStack) && SaveProduct("_mean.jpg", Mean) &&
+              SaveProduct("_clipped.jpg", Clipped);
+    MC_LOG("Night stacks saved: %s (%d frames)", qPrintable(GetFileName("_*.jpg")), FrameCount);
+  }
+  QFile::remove(GetFileName(".ckpt"));
+  NightName.clear();
+  // Release the accumulators for the daytime
+  Reset(0, 0, 0);
+  std::vector<unsigned char>().swap(MaxStack);
+  std::vector<uint32_t>().swap(Sums);
+  std::vector<uint32_t>().swap(SquareSums);
+  std::vector<uint32_t>().swap(ClippedSums);
+  std::vector<uint16_t>().swap(ClippedCounts);
+  return Success;
+}
+
+
+bool NightStacker::LoadCheckpoint()
+{
+  QFile CurrentFile(GetFileName(".ckpt"));
+  CheckpointHeader Header;
+
+  if (!CurrentFile.open(QIODevice::ReadOnly))
+    return false;
+
+  if (CurrentFile.read(reinterpret_cast<char*>(&Header), sizeof(Header)) != sizeof(Header) ||
+      memcmp(Header.Magic, CheckpointMagic, sizeof(CheckpointMagic)) != 0 || Header.Version != CheckpointVersion)
+  {
+    MC_WARNING("Invalid stack checkpoint: %s", qPrintable(CurrentFile.fileName()));
+    return false;
+  }
+  const int64_t HeaderDataSize = (int64_t)Header.Width*Header.Height*Header.Layers;
+
+  // The sizes are checked before the allocation, a foreign file must not abort the start of the night
+  if (Header.Width == 0 || Header.Height == 0 || Header.Layers == 0 || HeaderDataSize > MaxDataSize ||
+      Header.FrameCount < 0 || Header.FrameCount > MaxFrameCount ||
+      CurrentFile.size() != (qint64)sizeof(Header)+CheckpointSampleSize*HeaderDataSize)
+  {
+    MC_WARNING("Invalid stack checkpoint size: %s", qPrintable(CurrentFile.fileName()));
+    return false;
+  }
+  Reset(Header.Width, Header.Height, Header.Layers);
+
+  const int64_t DataSize = (int64_t)Sums.size();
+  bool Success = true;
+
+  Success = Success && CurrentFile.read(reinterpret_cast<char*>(MaxStack.data()), DataSize) == DataSize;
+  Success = Success && CurrentFile.read(reinterpret_cast<char*>(Sums.data()), DataSize*4) == DataSize*4;
+  Success = Success && CurrentFile.read(reinterpret_cast<char*>(SquareSums.data()), DataSize*4) == DataSize*4;
+  Success = Success && CurrentFile.read(reinterpret_cast<char*>(ClippedSums.data()), DataSize*4) == DataSize*4;
+  Success = Success && CurrentFile.read(reinterpret_cast<char*>(ClippedCounts.data()), DataSize*2) == DataSize*2;
+  if (!Success)
+  {
+    MC_WARNING("Truncated stack checkpoint: %s", qPrintable(CurrentFile.fileName()));
+    Reset(0, 0, 0);
+    return false;
+  }
+  FrameCount = Header.FrameCount;
+  return true;
+}
+
+
+void NightStacker::Reset(int width, int height, int layers)
+{
+  const int DataSize = width*height*layers;
+
+  Width = width;
+  Height = height;
+  Layers = layers;
+  FrameCount = 0;
+  MaxStack.assign(DataSize, 0);
+  Sums.assign(DataSize, 0);
+  SquareSums.assign(DataSize, 0);
+  ClippedSums.assign(DataSize, 0);
+  ClippedCounts.assign(DataSize, 0);
+}
+
+
+bool NightStacker::SaveProduct(const QString& suffix, const std::vector<unsigned char>& data) const
+{
+  MEImage Product(Width, Height, Layers);
+
+  memcpy(Product.GetIplImage()->imageData, data.data(), data.size());
+  Product.SaveToFile(GetFileName(suffix).toStdString());
+  return QFile::exists(GetFileName(suffix));
+}
+
+
+QString NightStacker::GetFileName(const QString& suffix) const
+{
+  return Path+"stack_"+NightName+suffix;
+}
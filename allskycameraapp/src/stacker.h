@@ -0,0 +1,67 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <QString>
+
+#include <stdint.h>
+#include <vector>
+
+class MEImage;
+
+// Streaming star trail (max), mean and sigma-clipped mean stacks of one night
+class NightStacker
+{
+public:
+  NightStacker() = default;
+
+  bool Start(const QString& path, const QString& night_name);
+  bool Add(MEImage& image);
+  bool Checkpoint();
+  bool Finish();
+  bool IsActive() const { return !NightName.isEmpty(); }
+
+  // Save the accumulators after every Nth frame
+  int CheckpointInterval { 10 };
+  // Samples further than ClipSigma*sigma from the running mean are rejected
+  float ClipSigma { 2.5 };
+  // Frames accepted without clipping while the statistics settle
+  int ClipWarmup { 5 };
+
+protected:
+  bool LoadCheckpoint();
+  void Reset(int width, int height, int layers);
+  bool SaveProduct(const QString& suffix, const std::vector<unsigned char>& data) const;
+  QString GetFileName(const QString& suffix) const;
+
+  QString Path;
+  QString NightName;
+  int Width { 0 };
+  int Height { 0 };
+  int Layers { 0 };
+  int FrameCount { 0 };
+  std::vector<unsigned char> MaxStack;
+  std::vector<uint32_t> Sums;
+  std::vector<uint32_t> SquareSums;
+  std::vector<uint32_t> ClippedSums;
+  std::vector<uint16_t> ClippedCounts;
+};
@@ -0,0 +1,87 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "stagestats.h"
+
+#include <MCLog.hpp>
+
+#include <algorithm>
+
+void PipelineStats::Add(Stage stage, int milliseconds)
+{
+  std::lock_guard<std::mutex> Lock(Mutex);
+  Timing& Current = Timings[stage];
+
+  Current.Count++;
+  Current.Total += milliseconds;
+  Current.Last = milliseconds;
+  Current.Max = std::max(Current.Max, milliseconds);
+}
+
+
+void PipelineStats::AddDropped(Stage stage)
+{
+  std::lock_guard<std::mutex> Lock(Mutex);
+
+  Timings[stage].Dropped++;
+}
+
+
+int PipelineStats::GetCount(Stage stage) const
+{
+  std::lock_guard<std::mutex> Lock(Mutex);
+
+  return Timings[stage].Count;
+}
+
+
+void PipelineStats::Log() const
+{
+  std::lock_guard<std::mutex> Lock(Mutex);
+
+  for (int i = 0; i < StageCount; ++i)
+  {
+    const Timing& Current = Timings[i];
+
+    if (Current.Count == 0)
+      continue;
+
+    MC_LOG("Stage %s - frames: %d dropped: %d last: %d ms average: %d ms max: %d ms", GetStageName((Stage)i),
+           Current.Count, Current.Dropped, Current.Last, (int)(Current.Total / Current.Count), Current.Max);
+  }
+}
+
+
+const char* PipelineStats::GetStageName(Stage stage)
+{
+  switch (stage)
+  {
+    case Capture:
+      return "capture";
+    case Analysis:
+      return "analysis";
+    case Encode:
+      return "encode";
+    default:
+      break;
+  }
+  return "unknown";
+}
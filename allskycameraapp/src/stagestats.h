@@ -0,0 +1,76 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <chrono>
+#include <mutex>
+
+// Processing time of the capture pipeline stages
+class PipelineStats
+{
+public:
+  enum Stage
+  {
+    Capture = 0,
+    Analysis,
+    Encode,
+    StageCount
+  };
+
+  void Add(Stage stage, int milliseconds);
+  void AddDropped(Stage stage);
+  int GetCount(Stage stage) const;
+  void Log() const;
+
+  static const char* GetStageName(Stage stage);
+
+protected:
+  struct Timing
+  {
+    int Count;
+    int Dropped;
+    long long Total;
+    int Last;
+    int Max;
+  };
+
+  mutable std::mutex Mutex;
+  Timing Timings[StageCount] {};
+};
+
+// Measures the lifetime of the object as one run of a stage
+class StageTimer
+{
+public:
+  StageTimer(PipelineStats& stats, PipelineStats::Stage stage) :
+    Stats(stats), CurrentStage(stage), Start(std::chrono::steady_clock::now()) {}
+  ~StageTimer()
+  {
+    Stats.Add(CurrentStage, (int)std::chrono::duration_cast<std::chrono::milliseconds>(
+                              std::chrono::steady_clock::now()-Start).count());
+  }
+
+protected:
+  PipelineStats& Stats;
+  PipelineStats::Stage CurrentStage;
+  std::chrono::steady_clock::time_point Start;
+};
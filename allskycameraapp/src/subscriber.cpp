@@ -0,0 +1,261 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+
+// Sample subscriber of the shared frame ring and the event socket of allskycameraapp
+// with a latency benchmark of the two channels.
+
+#include "eventchannel.h"
+#include "framering.h"
+
+#include <MEImage.hpp>
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDateTime>
+
+#include <algorithm>
+#include <vector>
+
+#include <stdio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace
+{
+const int ConnectTimeout = 5000;
+
+
+// The frame is read in place, the result is valid only if the slot was not reused meanwhile
+bool GetMeanLevel(const FrameRing& ring, uint64_t sequence, double& level)
+{
+  const FrameHeader* Frame = ring.GetFrame(sequence);
+
+  if (Frame == nullptr)
+    return false;
+
+  const unsigned char* Data = ring.GetData(Frame);
+  const int Width = Frame->Width;
+  const int Height = Frame->Height;
+  const int Stride = Frame->Stride;
+  long long Sum = 0;
+
+  if (Width <= 0 || Height <= 0 || Stride < Width*3 || Height*Stride > ring.GetSlotSize())
+    return false;
+
+  for (int y = 0; y < Height; ++y)
+  {
+    const unsigned char* Row = Data+y*Stride;
+
+    for (int x = 0; x < Width*3; ++x)
+    {
+      Sum += Row[x];
+    }
+  }
+  level = (double)Sum / (Width*Height*3);
+  return ring.CheckFrame(Frame, sequence);
+}
+
+
+const char* GetLabelName(int label)
+{
+  return label == 0 ? "clear" : (label == 1 ? "clouds" : "unknown");
+}
+
+
+int Subscribe(const QString& ring_name, const QString& event_path)
+{
+  FrameRing Ring;
+  EventSubscriber Subscriber;
+  ChannelEvent Event;
+
+  if (!ring_name.isEmpty() && !Ring.Open(ring_name))
+  {
+    printf("Unable to open the frame ring %s\n", qPrintable(ring_name));
+    return 1;
+  }
+  if (!Subscriber.Connect(event_path))
+  {
+    printf("Unable to connect to %s\n", qPrintable(event_path));
+    return 1;
+  }
+  while (Subscriber.IsConnected())
+  {
+    if (!Subscriber.Receive(Event, -1))
+      continue;
+
+    const double Latency = (EventSubscriber::GetMonotonicTime()-Event.PublishTime) / 1000.0;
+    const QString Time = QDateTime::fromMSecsSinceEpoch(Event.Timestamp).toString("yyyy-MM-dd HH:mm:ss");
+
+    if (Event.Type == ChannelEvent::LabelEvent)
+    {
+      printf("%s label %s (%1.3f/%1.3f)\n", qPrintable(Time), GetLabelName(Event.Label), Event.Probabilities[0],
+             Event.Probabilities[1]);
+    } else
+    if (Event.Type == ChannelEvent::ExposureEvent)
+    {
+      printf("%s exposure %d us, ISO %d\n", qPrintable(Time), Event.ShutterTime, Event.Iso);
+    } else {
+      double Level = 0;
+
+      if (Ring.IsOpen() && GetMeanLevel(Ring, Event.Sequence, Level))
+      {
+        printf("%s frame %llu %s, mean level %1.1f, latency %1.0f us\n", qPrintable(Time), (unsigned long long)Event.Sequence,
+               GetLabelName(Event.Label), Level, Latency);
+      } else {
+        printf("%s frame %llu %s, latency %1.0f us\n", qPrintable(Time), (unsigned long long)Event.Sequence,
+               GetLabelName(Event.Label), Latency);
+      }
+    }
+    fflush(stdout);
+  }
+  printf("The event channel was closed\n");
+  return 0;
+}
+
+
+void PrintLatencies(const char* name, std::vector<double>& latencies)
+{
+  if (latencies.empty())
+  {
+    printf("%-8s no samples\n", name);
+    return;
+  }
+  std::sort(latencies.begin(), latencies.end());
+  printf("%-8s min %7.1f us, median %7.1f us, 99%% %7.1f us, max %7.1f us (%d samples)\n", name, latencies.front(),
+         latencies[latencies.size() / 2], latencies[latencies.size()*99 / 100], latencies.back(), (int)latencies.size());
+}
+
+
+// The subscriber process of the benchmark
+int RunBenchmarkSubscriber(const QString& ring_name, const QString& event_path, int count)
+{
+  FrameRing Ring;
+  EventSubscriber Subscriber;
+  ChannelEvent Event;
+  std::vector<double> EventLatencies;
+  std::vector<double> FrameLatencies;
+  int Torn = 0;
+  const qint64 Deadline = QDateTime::currentMSecsSinceEpoch()+ConnectTimeout;
+
+  while (!Subscriber.Connect(event_path, ChannelEvent::FrameEvent) || !Ring.Open(ring_name))
+  {
+    if (QDateTime::currentMSecsSinceEpoch() > Deadline)
+      return 1;
+
+    usleep(1000);
+  }
+  while ((int)EventLatencies.size() < count && Subscriber.Receive(Event, ConnectTimeout))
+  {
+    // The warm-up events before the subscription was accepted have no frame
+    if (Event.Sequence == 0)
+      continue;
+
+    double Level = 0;
+
+    EventLatencies.push_back((EventSubscriber::GetMonotonicTime()-Event.PublishTime) / 1000.0);
+    if (GetMeanLevel(Ring, Event.Sequence, Level))
+      FrameLatencies.push_back((EventSubscriber::GetMonotonicTime()-Event.PublishTime) / 1000.0);
+    else
+      Torn++;
+  }
+  PrintLatencies("event", EventLatencies);
+  PrintLatencies("frame", FrameLatencies);
+  printf("%d frames overwritten before they were read\n", Torn);
+  return (int)EventLatencies.size() == count ? 0 : 1;
+}
+
+
+// Publisher in this process and subscriber in a child process, both ends run the code of the daemon
+int RunBenchmark(int count, int interval)
+{
+  const QString Name = QString("allskycam_bench_%1").arg((int)getpid());
+  const QString EventPath = "/tmp/"+Name+".sock";
+  FrameRing Ring;
+  EventPublisher Publisher(EventPath);
+  MEImage Image(640, 384, 3);
+  ChannelEvent Event = {};
+  int Status = 1;
+
+  if (!Ring.Create(4, 640*384*3, Name) || !Publisher.Start())
+  {
+    printf("Unable to create the benchmark channels\n");
+    return 1;
+  }
+  const pid_t Child = fork();
+
+  if (Child == 0)
+  {
+    const int Result = RunBenchmarkSubscriber(Name, EventPath, count);
+
+    fflush(stdout);
+    _exit(Result);
+  }
+
+  if (Child < 0)
+    return 1;
+
+  // Warm-up events until the subscriber is connected
+  Event.Type = ChannelEvent::FrameEvent;
+  for (int i = 0; i < ConnectTimeout && Publisher.GetSubscriberCount() == 0; ++i)
+  {
+    Publisher.Publish(Event);
+    usleep(1000);
+  }
+  printf("Publish %d frames (640x384) every %d ms\n", count, interval);
+  fflush(stdout);
+  for (int i = 0; i < count; ++i)
+  {
+    // The frame content changes to make the copy realistic
+    Image.GetIplImage()->imageData[i % (640*384*3)] = (char)i;
+    Ring.Publish(Image, QDateTime::currentMSecsSinceEpoch(), 0, 0);
+    Event.Sequence = Ring.GetSequence();
+    Event.Timestamp = QDateTime::currentMSecsSinceEpoch();
+    Publisher.Publish(Event);
+    usleep(interval*1000);
+  }
+  waitpid(Child, &Status, 0);
+  printf("%d events dropped by the publisher\n", Publisher.GetDroppedCount());
+  return WIFEXITED(Status) ? WEXITSTATUS(Status) : 1;
+}
+}
+
+
+int main(int argc, char* argv[])
+{
+  QCoreApplication App(argc, argv);
+  QCommandLineParser Parser;
+  QCommandLineOption RingOption("ring", "Name of the shared frame ring", "ring");
+  QCommandLineOption EventsOption("events", "Path of the event socket", "events", "/tmp/allskycam.sock");
+  QCommandLineOption BenchmarkOption("benchmark", "Measure the latency of the given number of frames and exit", "benchmark");
+  QCommandLineOption IntervalOption("interval", "Frame period of the benchmark (ms)", "interval", "10");
+
+  Parser.addHelpOption();
+  Parser.addOption(RingOption);
+  Parser.addOption(EventsOption);
+  Parser.addOption(BenchmarkOption);
+  Parser.addOption(IntervalOption);
+  Parser.process(App);
+  if (Parser.isSet("benchmark"))
+    return RunBenchmark(Parser.value(BenchmarkOption).toInt(), Parser.value(IntervalOption).toInt());
+
+  return Subscribe(Parser.value(RingOption), Parser.value(EventsOption));
+}
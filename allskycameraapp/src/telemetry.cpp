@@ -0,0 +1,450 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "telemetry.h"
+#include "encoder.h"
+
+#include <MCLog.hpp>
+
+#include <QDateTime>
+#include <QDir>
+#include <QStringList>
+
+#include <algorithm>
+#include <memory>
+
+#include <stdio.h>
+#include <string.h>
+
+namespace
+{
+struct ColumnHeader
+{
+  char Magic[4];
+  uint32_t Version;
+  uint32_t Count;
+  uint32_t Reserved;
+};
+
+const char RingMagic[4] = { 'A', 'S', 'T', 'R' };
+const char ColumnMagic[4] = { 'A', 'S', 'T', 'C' };
+const uint32_t TelemetryVersion = 1;
+// Bytes of one record in the columnar files
+const int ColumnRecordSize = 8+4*5+1*2;
+// Longest gap between two frames counted as observation time (ms)
+const int64_t MaxFrameGap = 5*60*1000;
+
+
+QString GetNightFilename(const QString& path, uint32_t night)
+{
+  return QString("%1/telemetry_%2.tsc").arg(path).arg((int)night);
+}
+
+
+template <typename T>
+void AppendColumn(std::vector<unsigned char>& buffer, const std::vector<TelemetryRecord>& records, T TelemetryRecord::*field)
+{
+  const size_t Start = buffer.size();
+
+  buffer.resize(Start+records.size()*sizeof(T));
+  for (size_t i = 0; i < records.size(); ++i)
+  {
+    memcpy(&buffer[Start+i*sizeof(T)], &(records[i].*field), sizeof(T));
+  }
+}
+}
+
+
+TelemetryLog::~TelemetryLog()
+{
+  Close();
+}
+
+
+bool TelemetryLog::Open(const QString& path)
+{
+  const qint64 FileSize = sizeof(RingHeader)+(qint64)RingCapacity*sizeof(TelemetryRecord);
+
+  Close();
+  Path = path;
+  QDir().mkpath(Path);
+  Ring.setFileName(Path+"/telemetry.ring");
+  if (!Ring.open(QIODevice::ReadWrite))
+  {
+    MC_WARNING("Unable to open %s", qPrintable(Ring.fileName()));
+    return false;
+  }
+  const bool Initialize = Ring.size() != FileSize;
+
+  if (Initialize && !Ring.resize(FileSize))
+  {
+    Close();
+    return false;
+  }
+  uchar* Mapping = Ring.map(0, FileSize);
+
+  if (Mapping == nullptr)
+  {
+    MC_WARNING("Unable to map %s", qPrintable(Ring.fileName()));
+    Close();
+    return false;
+  }
+  Header = reinterpret_cast<RingHeader*>(Mapping);
+  Records = reinterpret_cast<TelemetryRecord*>(Mapping+sizeof(RingHeader));
+  if (Initialize || memcmp(Header->Magic, RingMagic, 4) != 0 || Header->Version != TelemetryVersion ||
+      Header->Capacity != RingCapacity)
+  {
+    memset(Header, 0, sizeof(RingHeader));
+    memcpy(Header->Magic, RingMagic, 4);
+    Header->Version = TelemetryVersion;
+    Header->Capacity = RingCapacity;
+  }
+  return true;
+}
+
+
+void TelemetryLog::Close()
+{
+  if (Header != nullptr)
+    Ring.unmap(reinterpret_cast<uchar*>(Header));
+
+  if (Ring.isOpen())
+    Ring.close();
+
+  Header = nullptr;
+  Records = nullptr;
+  NightStart = 0;
+  NightEnd = 0;
+}
+
+
+void TelemetryLog::Append(const TelemetryRecord& record)
+{
+  if (!IsOpen())
+    return;
+
+  // The calendar is checked only at the night boundaries
+  if (record.Timestamp < NightStart || record.Timestamp >= NightEnd)
+    UpdateNight(record.Timestamp);
+
+  // Plain memory writes, the kernel writes the pages back
+  Records[Header->Count % RingCapacity] = record;
+  Header->Count++;
+}
+
+
+void TelemetryLog::UpdateNight(int64_t timestamp)
+{
+  const QDate Date = QDateTime::fromMSecsSinceEpoch(timestamp).addSecs(-12*3600).date();
+
+  Night = (uint32_t)Date.toString("yyyyMMdd").toInt();
+  NightStart = QDateTime(Date, QTime(12, 0)).toMSecsSinceEpoch();
+  NightEnd = QDateTime(Date.addDays(1), QTime(12, 0)).toMSecsSinceEpoch();
+  if (Header->Night == Night)
+    return;
+
+  // Convert the previous night to a columnar file and restart the ring
+  if (Header->Count > 0)
+    FlushNight();
+
+  Header->Night = Night;
+  Header->Count = 0;
+}
+
+
+bool TelemetryLog::FlushNight()
+{
+  const QString Filename = GetNightFilename(Path, Header->Night);
+  const uint64_t First = Header->Count > RingCapacity ? Header->Count-RingCapacity : 0;
+  std::vector<TelemetryRecord> Night;
+  TelemetryColumns Existing;
+
+  // The night was already flushed once (clock change), merge the records
+  if (QFile::exists(Filename) && Existing.Load(Filename))
+  {
+    for (int i = 0; i < Existing.Count; ++i)
+    {
+      TelemetryRecord Record;
+
+      Record.Timestamp = Existing.Timestamps[i];
+      Record.ShutterTime = Existing.ShutterTimes[i];
+      Record.Iso = Existing.Isos[i];
+      Record.Brightness = Existing.Brightness[i];
+      Record.SunArea = Existing.SunAreas[i];
+      Record.ClearSkyCount = Existing.ClearSkyCounts[i];
+      Record.NightMode = Existing.NightModes[i];
+      Record.Label = Existing.Labels[i];
+      Record.Reserved = 0;
+      Night.push_back(Record);
+    }
+  }
+  for (uint64_t i = First; i < Header->Count; ++i)
+  {
+    Night.push_back(Records[i % RingCapacity]);
+  }
+  std::stable_sort(Night.begin(), Night.end(), [](const TelemetryRecord& record1, const TelemetryRecord& record2)
+                   { return record1.Timestamp < record2.Timestamp; });
+  if (!WriteBuffer(Filename, TelemetryColumns::Serialize(Night)))
+    return false;
+
+  MC_LOG("Telemetry of %d frames saved to %s", (int)Night.size(), qPrintable(Filename));
+  return true;
+}
+
+
+bool TelemetryLog::ReadRing(const QString& path, std::vector<TelemetryRecord>& records, QString& night)
+{
+  QFile File(path+"/telemetry.ring");
+  RingHeader Header;
+
+  records.clear();
+  if (!File.open(QIODevice::ReadOnly) || File.read(reinterpret_cast<char*>(&Header), sizeof(Header)) != sizeof(Header) ||
+      memcmp(Header.Magic, RingMagic, 4) != 0 || Header.Capacity != RingCapacity)
+  {
+    return false;
+  }
+  std::vector<TelemetryRecord> Ring(RingCapacity);
+
+  if (File.read(reinterpret_cast<char*>(Ring.data()), Ring.size()*sizeof(TelemetryRecord)) !=
+      (qint64)(Ring.size()*sizeof(TelemetryRecord)))
+  {
+    return false;
+  }
+  for (uint64_t i = Header.Count > RingCapacity ? Header.Count-RingCapacity : 0; i < Header.Count; ++i)
+  {
+    records.push_back(Ring[i % RingCapacity]);
+  }
+  night = QString::number((int)Header.Night);
+  return true;
+}
+
+
+TelemetryColumns::~TelemetryColumns()
+{
+  if (Mapping != nullptr)
+    File.unmap(Mapping);
+}
+
+
+bool TelemetryColumns::Load(const QString& filename)
+{
+  File.setFileName(filename);
+  if (!File.open(QIODevice::ReadOnly))
+    return false;
+
+  Mapping = File.map(0, File.size());
+  return Mapping != nullptr && Assign(Mapping, File.size());
+}
+
+
+void TelemetryColumns::Build(const std::vector<TelemetryRecord>& records)
+{
+  Buffer = Serialize(records);
+  Assign(Buffer.data(), Buffer.size());
+}
+
+
+int TelemetryColumns::Find(int64_t timestamp) const
+{
+  return std::lower_bound(Timestamps, Timestamps+Count, timestamp)-Timestamps;
+}
+
+
+TelemetryRecord TelemetryColumns::GetRecord(int index) const
+{
+  TelemetryRecord Record = {};
+
+  Record.Timestamp = Timestamps[index];
+  Record.ShutterTime = ShutterTimes[index];
+  Record.Iso = Isos[index];
+  Record.Brightness = Brightness[index];
+  Record.SunArea = SunAreas[index];
+  Record.ClearSkyCount = ClearSkyCounts[index];
+  Record.NightMode = NightModes[index];
+  Record.Label = Labels[index];
+  return Record;
+}
+
+
+std::vector<unsigned char> TelemetryColumns::Serialize(const std::vector<TelemetryRecord>& records)
+{
+  std::vector<unsigned char> Result(sizeof(ColumnHeader));
+  ColumnHeader Header;
+
+  memcpy(Header.Magic, ColumnMagic, 4);
+  Header.Version = TelemetryVersion;
+  Header.Count = (uint32_t)records.size();
+  Header.Reserved = 0;
+  memcpy(Result.data(), &Header, sizeof(Header));
+  // The widest columns first, every column stays aligned
+  AppendColumn(Result, records, &TelemetryRecord::Timestamp);
+  AppendColumn(Result, records, &TelemetryRecord::ShutterTime);
+  AppendColumn(Result, records, &TelemetryRecord::Iso);
+  AppendColumn(Result, records, &TelemetryRecord::Brightness);
+  AppendColumn(Result, records, &TelemetryRecord::SunArea);
+  AppendColumn(Result, records, &TelemetryRecord::ClearSkyCount);
+  AppendColumn(Result, records, &TelemetryRecord::NightMode);
+  AppendColumn(Result, records, &TelemetryRecord::Label);
+  return Result;
+}
+
+
+bool TelemetryColumns::Assign(const unsigned char* data, int64_t size)
+{
+  ColumnHeader Header;
+
+  if (size < (int64_t)sizeof(Header))
+    return false;
+
+  memcpy(&Header, data, sizeof(Header));
+  if (memcmp(Header.Magic, ColumnMagic, 4) != 0 || Header.Version != TelemetryVersion ||
+      size < (int64_t)sizeof(Header)+(int64_t)Header.Count*ColumnRecordSize)
+  {
+    MC_WARNING("Invalid telemetry file: %s", qPrintable(File.fileName()));
+    return false;
+  }
+  const unsigned char* Column = data+sizeof(Header);
+
+  Count = (int)Header.Count;
+  Timestamps = reinterpret_cast<const int64_t*>(Column);
+  ShutterTimes = reinterpret_cast<const int32_t*>(Column += Count*8);
+  Isos = reinterpret_cast<const int32_t*>(Column += Count*4);
+  Brightness = reinterpret_cast<const int32_t*>(Column += Count*4);
+  SunAreas = reinterpret_cast<const float*>(Column += Count*4);
+  ClearSkyCounts = reinterpret_cast<const int32_t*>(Column += Count*4);
+  NightModes = reinterpret_cast<const int8_t*>(Column += Count*4);
+  Labels = reinterpret_cast<const int8_t*>(Column += Count);
+  return true;
+}
+
+
+bool RunTelemetryQuery(const QString& path, const QString& query, int64_t from, int64_t to)
+{
+  QStringList Nights;
+  std::vector<std::unique_ptr<TelemetryColumns>> Columns;
+
+  if (query != "nights" && query != "exposure")
+  {
+    printf("Unknown telemetry query: %s\n", qPrintable(query));
+    return false;
+  }
+  for (auto filename : QDir(path).entryList(QStringList() << "telemetry_*.tsc", QDir::Files, QDir::Name))
+  {
+    std::unique_ptr<TelemetryColumns> Night(new TelemetryColumns());
+
+    if (!Night->Load(path+'/'+filename))
+      continue;
+
+    Nights << filename.mid(10, 8);
+    Columns.push_back(std::move(Night));
+  }
+  // The current night from the ring
+  std::vector<TelemetryRecord> Current;
+  QString CurrentNight;
+
+  if (TelemetryLog::ReadRing(path, Current, CurrentNight) && !Current.empty())
+  {
+    // A night converted after a restart continues in the ring, the records are merged
+    const int Converted = Nights.indexOf(CurrentNight);
+
+    if (Converted >= 0)
+    {
+      const TelemetryColumns& Night = *Columns[Converted];
+
+      for (int i = 0; i < Night.Count; ++i)
+        Current.push_back(Night.GetRecord(i));
+      std::stable_sort(Current.begin(), Current.end(), [](const TelemetryRecord& record1, const TelemetryRecord& record2)
+      {
+        return record1.Timestamp < record2.Timestamp;
+      });
+      Current.erase(std::unique(Current.begin(), Current.end(), [](const TelemetryRecord& record1, const TelemetryRecord& record2)
+      {
+        return record1.Timestamp == record2.Timestamp;
+      }), Current.end());
+      Columns[Converted].reset(new TelemetryColumns());
+      Columns[Converted]->Build(Current);
+    } else {
+      Columns.push_back(std::unique_ptr<TelemetryColumns>(new TelemetryColumns()));
+      Columns.back()->Build(Current);
+      Nights << CurrentNight;
+    }
+  }
+  int ShutterHistogram[32] = { 0 };
+  int BrightnessHistogram[16] = { 0 };
+  int Total = 0;
+
+  for (size_t n = 0; n < Columns.size(); ++n)
+  {
+    const TelemetryColumns& Night = *Columns[n];
+    const int First = Night.Find(from);
+    const int Last = Night.Find(to);
+    int64_t ClearTime = 0;
+    int64_t NightTime = 0;
+    int ClearFrames = 0;
+
+    if (First >= Last)
+      continue;
+
+    Total += Last-First;
+    // Only the needed columns are touched
+    for (int i = First; i < Last; ++i)
+    {
+      if (query == "exposure")
+      {
+        ShutterHistogram[Night.ShutterTimes[i] > 0 ? 31-__builtin_clz((unsigned int)Night.ShutterTimes[i]) : 0]++;
+        BrightnessHistogram[std::max(0, std::min(255, (int)Night.Brightness[i])) / 16]++;
+        continue;
+      }
+      if (Night.NightModes[i] != 1)
+        continue;
+
+      // A frame represents the time until the next frame
+      const int64_t Duration = i+1 < Last ? std::min(MaxFrameGap, Night.Timestamps[i+1]-Night.Timestamps[i]) : 0;
+
+      NightTime += Duration;
+      if (Night.Labels[i] == 0)
+      {
+        ClearTime += Duration;
+        ClearFrames++;
+      }
+    }
+    if (query == "nights")
+    {
+      printf("%s: frames: %d clear frames: %d night: %1.2f h clear: %1.2f h\n", qPrintable(Nights[n]), Last-First,
+             ClearFrames, NightTime / 3600000.0, ClearTime / 3600000.0);
+    }
+  }
+  if (query == "exposure")
+  {
+    printf("Shutter time histogram (%d frames):\n", Total);
+    for (int i = 0; i < 32; ++i)
+    {
+      if (ShutterHistogram[i] > 0)
+        printf("  %10u-%10u us: %d\n", 1u << i, (uint32_t)((2ull << i)-1), ShutterHistogram[i]);
+    }
+    printf("Brightness histogram:\n");
+    for (int i = 0; i < 16; ++i)
+    {
+      printf("  %3d-%3d: %d\n", i*16, i*16+15, BrightnessHistogram[i]);
+    }
+  }
+  return true;
+}
@@ -0,0 +1,125 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <QFile>
+#include <QString>
+
+#include <vector>
+
+#include <stdint.h>
+
+// Exposure and classification state of one captured frame
+struct TelemetryRecord
+{
+  // Milliseconds since the epoch
+  int64_t Timestamp;
+  int32_t ShutterTime;
+  int32_t Iso;
+  int32_t Brightness;
+  float SunArea;
+  int32_t ClearSkyCount;
+  int8_t NightMode;
+  // -1: unknown, 0: clear, 1: clouds
+  int8_t Label;
+  int16_t Reserved;
+};
+
+// Per-frame telemetry. The records of the current night are appended to a memory mapped ring
+// (telemetry.ring) without system calls, the finished nights are converted to columnar files
+// (telemetry_<night>.tsc) where every field is stored contiguously.
+class TelemetryLog
+{
+public:
+  TelemetryLog() = default;
+  ~TelemetryLog();
+
+  bool Open(const QString& path);
+  void Close();
+  void Append(const TelemetryRecord& record);
+  bool IsOpen() const { return Header != nullptr; }
+
+  // Records of the ring in time order
+  static bool ReadRing(const QString& path, std::vector<TelemetryRecord>& records, QString& night);
+
+  // Records of a night: 8192 frames are more than a night at the shortest frame period
+  static const int RingCapacity = 8192;
+
+protected:
+  struct RingHeader
+  {
+    char Magic[4];
+    uint32_t Version;
+    uint32_t Capacity;
+    uint32_t Night;
+    uint64_t Count;
+  };
+
+  bool FlushNight();
+  void UpdateNight(int64_t timestamp);
+
+  QString Path;
+  QFile Ring;
+  RingHeader* Header { nullptr };
+  TelemetryRecord* Records { nullptr };
+  // Noon to noon range of the current night
+  int64_t NightStart { 0 };
+  int64_t NightEnd { 0 };
+  uint32_t Night { 0 };
+};
+
+// Columns of the telemetry of a night, mapped from a columnar file or built from the ring
+class TelemetryColumns
+{
+public:
+  TelemetryColumns() = default;
+  ~TelemetryColumns();
+
+  bool Load(const QString& filename);
+  void Build(const std::vector<TelemetryRecord>& records);
+  // The index of the first record at or after the timestamp
+  int Find(int64_t timestamp) const;
+  TelemetryRecord GetRecord(int index) const;
+
+  int Count { 0 };
+  const int64_t* Timestamps { nullptr };
+  const int32_t* ShutterTimes { nullptr };
+  const int32_t* Isos { nullptr };
+  const int32_t* Brightness { nullptr };
+  const float* SunAreas { nullptr };
+  const int32_t* ClearSkyCounts { nullptr };
+  const int8_t* NightModes { nullptr };
+  const int8_t* Labels { nullptr };
+
+  static std::vector<unsigned char> Serialize(const std::vector<TelemetryRecord>& records);
+
+protected:
+  bool Assign(const unsigned char* data, int64_t size);
+
+  QFile File;
+  uchar* Mapping { nullptr };
+  std::vector<unsigned char> Buffer;
+};
+
+// Aggregations of the telemetry in the [from, to) range: "nights" (clear hours per night)
+// or "exposure" (shutter time and brightness histograms)
+bool RunTelemetryQuery(const QString& path, const QString& query, int64_t from, int64_t to);
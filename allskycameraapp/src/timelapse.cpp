@@ -0,0 +1,311 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+
+#include "timelapse.h"
+
+#include <MCLog.hpp>
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace
+{
+// Fixed layout of the AVI headers
+const int64_t RiffSizeOffset = 4;
+const int64_t AviFlagsOffset = 44;
+const int64_t TotalFramesOffset = 48;
+const int64_t AviBufferSizeOffset = 60;
+const int64_t StreamLengthOffset = 140;
+const int64_t StreamBufferSizeOffset = 144;
+const int64_t MoviSizeOffset = 216;
+const int64_t MoviOffset = 220;
+const int64_t HeaderSize = 224;
+const uint32_t AviHasIndex = 0x10;
+const uint32_t KeyFrame = 0x10;
+// RIFF sizes are 32 bit, AVI 1.0 players stop at 2 GB
+const int64_t MaxFileSize = 0x7fff0000;
+
+struct IndexEntry
+{
+  char ChunkId[4];
+  uint32_t Flags;
+  uint32_t Offset;
+  uint32_t Size;
+};
+
+
+void Put16(unsigned char* data, int offset, uint16_t value)
+{
+  memcpy(data+offset, &value, 2);
+}
+
+
+void Put32(unsigned char* data, int offset, uint32_t value)
+{
+  memcpy(data+offset, &value, 4);
+}
+
+
+bool Write32(int fd, int64_t offset, uint32_t value)
+{
+  return pwrite(fd, &value, 4, offset) == 4;
+}
+
+
+bool WriteAll(int fd, const void* data, size_t size, int64_t offset)
+{
+  return pwrite(fd, data, size, offset) == (ssize_t)size;
+}
+}
+
+
+TimelapseWriter::~TimelapseWriter()
+{
+  Close();
+}
+
+
+bool TimelapseWriter::Open(const QString& filename, int width, int height, int fps)
+{
+  Close();
+  Filename = filename;
+  Fd = open(qPrintable(filename), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  IndexFd = open(qPrintable(filename+".idx"), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (Fd < 0 || IndexFd < 0 || !(lseek(Fd, 0, SEEK_END) == 0 ? Create(width, height, fps) : Resume()))
+  {
+    MC_WARNING("Unable to open the timelapse video %s", qPrintable(filename));
+    Close();
+    return false;
+  }
+  MC_LOG("Timelapse video: %s (%d frames)", qPrintable(filename), (int)FrameCount);
+  return true;
+}
+
+
+void TimelapseWriter::Close()
+{
+  if (Fd >= 0)
+    close(Fd);
+
+  if (IndexFd >= 0)
+    close(IndexFd);
+
+  Fd = -1;
+  IndexFd = -1;
+  FrameCount = 0;
+  MaxFrameSize = 0;
+  End = 0;
+}
+
+
+bool TimelapseWriter::Append(const std::vector<unsigned char>& jpeg)
+{
+  if (Fd < 0)
+    return false;
+
+  const uint32_t Size = (uint32_t)jpeg.size();
+  const int64_t PaddedSize = (Size+1) & ~1;
+
+  if (End+8+PaddedSize > MaxFileSize)
+    return false;
+
+  const unsigned char Padding = 0;
+  unsigned char ChunkHeader[8];
+  IndexEntry Entry = { { '0', '0', 'd', 'c' }, KeyFrame, (uint32_t)(End-MoviOffset), Size };
+
+  // The frame, its index entry, then the counters which make it visible
+  memcpy(ChunkHeader, "00dc", 4);
+  Put32(ChunkHeader, 4, Size);
+  if (!WriteAll(Fd, ChunkHeader, 8, End) || !WriteAll(Fd, jpeg.data(), Size, End+8) ||
+      (PaddedSize != Size && !WriteAll(Fd, &Padding, 1, End+8+Size)) ||
+      !WriteAll(IndexFd, &Entry, sizeof(Entry), (int64_t)FrameCount*sizeof(Entry)))
+  {
+    MC_WARNING("Unable to write the timelapse video %s", qPrintable(Filename));
+    return false;
+  }
+  End += 8+PaddedSize;
+  FrameCount++;
+  MaxFrameSize = std::max(MaxFrameSize, Size);
+  return UpdateHeaders();
+}
+
+
+bool TimelapseWriter::Finish()
+{
+  if (Fd < 0)
+    return false;
+
+  const uint32_t IndexSize = FrameCount*sizeof(IndexEntry);
+  unsigned char Buffer[65536];
+  int64_t Position = End+8;
+  uint32_t Copied = 0;
+
+  // The index is streamed from the side file, the memory use does not depend on the length
+  memcpy(Buffer, "idx1", 4);
+  Put32(Buffer, 4, IndexSize);
+  if (!WriteAll(Fd, Buffer, 8, End))
+    return false;
+
+  while (Copied < IndexSize)
+  {
+    const ssize_t Bytes = pread(IndexFd, Buffer, std::min<uint32_t>(sizeof(Buffer), IndexSize-Copied), Copied);
+
+    if (Bytes <= 0 || !WriteAll(Fd, Buffer, Bytes, Position))
+    {
+      MC_WARNING("Unable to write the index of %s", qPrintable(Filename));
+      return false;
+    }
+    Copied += Bytes;
+    Position += Bytes;
+  }
+  if (ftruncate(Fd, Position) != 0 || !UpdateHeaders(AviHasIndex) ||
+      !Write32(Fd, RiffSizeOffset, (uint32_t)(Position-8)) || fsync(Fd) != 0)
+  {
+    MC_WARNING("Unable to finish the timelapse video %s", qPrintable(Filename));
+    return false;
+  }
+  MC_LOG("Timelapse video finished: %s (%d frames)", qPrintable(Filename), (int)FrameCount);
+  Close();
+  QFile::remove(Filename+".idx");
+  return true;
+}
+
+
+bool TimelapseWriter::FinishStale(const QString& path, const QString& current)
+{
+  const QStringList Indexes = QDir(path).entryList(QStringList() << "*.avi.idx", QDir::Files, QDir::Name);
+  bool Success = true;
+
+  for (const QString& index : Indexes)
+  {
+    const QString Filename = path+'/'+index.left(index.size()-4);
+    TimelapseWriter Writer;
+
+    if (Filename == current)
+      continue;
+
+    // Nothing was written before the crash
+    if (QFileInfo(Filename).size() < HeaderSize)
+    {
+      QFile::remove(Filename);
+      QFile::remove(Filename+".idx");
+      continue;
+    }
+    // The size is not used when an existing video is continued
+    if (!Writer.Open(Filename, 0, 0, 1) || !Writer.Finish())
+    {
+      MC_WARNING("Unable to finish the stale timelapse video %s", qPrintable(Filename));
+      Success = false;
+    }
+  }
+  return Success;
+}
+
+
+bool TimelapseWriter::Create(int width, int height, int fps)
+{
+  unsigned char Header[HeaderSize] = {};
+
+  memcpy(Header, "RIFF", 4);
+  memcpy(Header+8, "AVI LIST", 8);
+  Put32(Header, 16, 192);
+  memcpy(Header+20, "hdrlavih", 8);
+  Put32(Header, 28, 56);
+  // Main AVI header
+  Put32(Header, 32, 1000000 / fps);
+  Put32(Header, 56, 1);
+  Put32(Header, 64, width);
+  Put32(Header, 68, height);
+  memcpy(Header+88, "LIST", 4);
+  Put32(Header, 92, 116);
+  memcpy(Header+96, "strlstrh", 8);
+  Put32(Header, 104, 56);
+  // Stream header
+  memcpy(Header+108, "vidsMJPG", 8);
+  Put32(Header, 128, 1);
+  Put32(Header, 132, fps);
+  Put32(Header, 148, 0xffffffff);
+  Put16(Header, 160, width);
+  Put16(Header, 162, height);
+  memcpy(Header+164, "strf", 4);
+  Put32(Header, 168, 40);
+  // Bitmap info header
+  Put32(Header, 172, 40);
+  Put32(Header, 176, width);
+  Put32(Header, 180, height);
+  Put16(Header, 184, 1);
+  Put16(Header, 186, 24);
+  memcpy(Header+188, "MJPG", 4);
+  Put32(Header, 192, width*height*3);
+  memcpy(Header+212, "LIST", 4);
+  memcpy(Header+220, "movi", 4);
+  End = HeaderSize;
+  return WriteAll(Fd, Header, HeaderSize, 0) && ftruncate(IndexFd, 0) == 0 && UpdateHeaders();
+}
+
+
+bool TimelapseWriter::Resume()
+{
+  unsigned char Header[HeaderSize];
+  uint32_t Flags = 0;
+  IndexEntry Entry;
+
+  if (pread(Fd, Header, HeaderSize, 0) != HeaderSize || memcmp(Header, "RIFF", 4) != 0 || memcmp(Header+8, "AVI ", 4) != 0 ||
+      memcmp(Header+212, "LIST", 4) != 0 || memcmp(Header+220, "movi", 4) != 0)
+    return false;
+
+  memcpy(&Flags, Header+AviFlagsOffset, 4);
+  memcpy(&FrameCount, Header+TotalFramesOffset, 4);
+  memcpy(&MaxFrameSize, Header+AviBufferSizeOffset, 4);
+  if (Flags & AviHasIndex)
+  {
+    // Open() created the index file again
+    MC_WARNING("The timelapse video is finished: %s", qPrintable(Filename));
+    QFile::remove(Filename+".idx");
+    return false;
+  }
+  // The frames after the last complete index entry are dropped
+  FrameCount = std::min<uint32_t>(FrameCount, lseek(IndexFd, 0, SEEK_END) / sizeof(IndexEntry));
+  End = HeaderSize;
+  if (FrameCount > 0)
+  {
+    if (pread(IndexFd, &Entry, sizeof(Entry), (int64_t)(FrameCount-1)*sizeof(Entry)) != sizeof(Entry))
+      return false;
+
+    End = MoviOffset+Entry.Offset+8+((Entry.Size+1) & ~1);
+  }
+  return ftruncate(Fd, End) == 0 && ftruncate(IndexFd, (int64_t)FrameCount*sizeof(Entry)) == 0 && UpdateHeaders();
+}
+
+
+bool TimelapseWriter::UpdateHeaders(uint32_t flags)
+{
+  return Write32(Fd, RiffSizeOffset, (uint32_t)(End-8)) && Write32(Fd, MoviSizeOffset, (uint32_t)(End-MoviSizeOffset-4)) &&
+         Write32(Fd, AviFlagsOffset, flags) && Write32(Fd, TotalFramesOffset, FrameCount) &&
+         Write32(Fd, StreamLengthOffset, FrameCount) && Write32(Fd, AviBufferSizeOffset, MaxFrameSize) &&
+         Write32(Fd, StreamBufferSizeOffset, MaxFrameSize);
+}
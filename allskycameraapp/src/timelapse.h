@@ -0,0 +1,65 @@
+/**
+ *  This file is part of allskycameraapp
+ *
+ *  Copyright (C) 2017 Csaba Kertész (csaba.kertesz@gmail.com)
+ *
+ *  AiBO+ is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AiBO+ is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+
+#pragma once
+
+#include <QString>
+
+#include <vector>
+
+#include <stdint.h>
+
+// Motion JPEG AVI built from the compressed frames without decoding. The
+// headers are updated after every frame, the file is playable at any time.
+// The index entries are collected in <filename>.idx, Finish() appends them as
+// the idx1 chunk.
+class TimelapseWriter
+{
+public:
+  TimelapseWriter() = default;
+  ~TimelapseWriter();
+
+  // An unfinished video is continued
+  bool Open(const QString& filename, int width, int height, int fps);
+  void Close();
+  bool IsOpen() const { return Fd >= 0; }
+  const QString& GetFilename() const { return Filename; }
+  bool Append(const std::vector<unsigned char>& jpeg);
+  // Writes the index, the video can not be continued after it
+  bool Finish();
+
+  // Finishes the unfinished videos (with a .idx file) of the directory except the current one
+  static bool FinishStale(const QString& path, const QString& current);
+
+protected:
+  bool Create(int width, int height, int fps);
+  bool Resume();
+  bool UpdateHeaders(uint32_t flags = 0);
+
+  QString Filename;
+  int Fd { -1 };
+  int IndexFd { -1 };
+  uint32_t FrameCount { 0 };
+  uint32_t MaxFrameSize { 0 };
+  // End of the movi list
+  int64_t End { 0 };
+};